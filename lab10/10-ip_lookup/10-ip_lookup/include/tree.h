@@ -18,6 +18,8 @@
 
 #define MAP_NUM 65536
 #define MAP_SHIFT 16
+
+#define TREE_ARENA_SIZE (1UL << 30) // address space reserved for the nodes of each tree
 typedef struct node {
     bool type; //I_NODE or M_NODE
     uint32_t port;
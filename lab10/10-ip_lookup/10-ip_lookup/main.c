@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include "util.h"
 #include "tree.h"
+#include "arena.h"
 
 const char* forwardingtable = "test/forwarding_table.txt";
 
@@ -54,6 +55,9 @@ int main(void){
     printf("basic_pass-%d\nbasic_lookup_time-%ldus\nadvance_pass-%d\nadvance_lookup_time-%ldus\n", \
             basic_pass,basic_interval,advanced_pass,advanced_interval);
 
+    printf("Memory of the trees......\n");
+    arena_report(stdout);
+
     return 0;
 }
 
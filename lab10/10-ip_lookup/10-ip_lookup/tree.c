@@ -1,4 +1,5 @@
 #include "tree.h"
+#include "arena.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,7 +7,19 @@
 node_t* root;
 TrieNodeOpt* unmatch;
 
-TrieNodeOpt *Trie_map[MAP_NUM];
+// the 65536 roots of the advanced tree, contiguous in the arena
+TrieNodeOpt *Trie_map;
+
+// the nodes of both trees are allocated from arenas of hugepages, as the
+// lookups touch them randomly
+static struct arena *basic_arena;
+static struct arena *advance_arena;
+
+// allocate a node from the arena, or malloc it if the arena is used up
+static void *node_alloc(struct arena *arena, size_t size) {
+    void *node = arena_alloc(arena, size, sizeof(void *));
+    return node ? node : malloc(size);
+}
 
 uint32_t* read_test_data(const char* lookup_file);
 void insert_tree_node(node_t * root, char* binaryArray, int prefix, uint32_t port);
@@ -62,7 +75,8 @@ uint32_t* read_test_data(const char* lookup_file){
 // Constructing an basic trie-tree to lookup according to `forward_file`
 void create_tree(const char* forward_file){
     //fprintf(stderr,"TODO:%s",__func__);
-    root =(node_t*)malloc(sizeof(node_t));
+    basic_arena = arena_create("basic_tree", TREE_ARENA_SIZE);
+    root = (node_t*)node_alloc(basic_arena, sizeof(node_t));
     root->type = I_NODE;
     root->lchild = NULL;
     root->rchild = NULL;
@@ -162,7 +176,7 @@ void insert_tree_node(node_t * root, char* binaryArray, int prefix, uint32_t por
                 current_node = current_node->lchild;
             }
             else{
-                current_node->lchild = (node_t*)malloc(sizeof(node_t));
+                current_node->lchild = (node_t*)node_alloc(basic_arena, sizeof(node_t));
                 current_node = current_node->lchild;
 
                 current_node->type = I_NODE;
@@ -175,7 +189,7 @@ void insert_tree_node(node_t * root, char* binaryArray, int prefix, uint32_t por
                 current_node = current_node->rchild;
             }
             else{
-                current_node->rchild = (node_t*)malloc(sizeof(node_t));
+                current_node->rchild = (node_t*)node_alloc(basic_arena, sizeof(node_t));
                 current_node = current_node->rchild;
 
                 current_node->type = I_NODE;
@@ -229,17 +243,17 @@ void create_tree_advance(const char* forward_file){
         }
 
         if (prefix >= MAP_SHIFT) {
-            TrieNodeOpt *root = Trie_map[(0xffff0000 & binaryIP) >> MAP_SHIFT];
+            TrieNodeOpt *root = &Trie_map[(0xffff0000 & binaryIP) >> MAP_SHIFT];
             insert_node_advance(root, binaryIP, port, prefix);
         } else {
             uint32_t mask = (~(0xFFFFFFFF >> prefix));
             uint32_t start = (binaryIP & mask) >> MAP_SHIFT;
             uint32_t end = start + (1 << (MAP_SHIFT - prefix));
             for (int i = start; i < end; i++) {
-                if (Trie_map[i]->type == I_NODE || (Trie_map[i]->prefix_diff >= 16 - prefix)) {
-                    Trie_map[i]->type = M_NODE;
-                    Trie_map[i]->port = port;
-                    Trie_map[i]->prefix_diff = 16 - prefix;
+                if (Trie_map[i].type == I_NODE || (Trie_map[i].prefix_diff >= 16 - prefix)) {
+                    Trie_map[i].type = M_NODE;
+                    Trie_map[i].port = port;
+                    Trie_map[i].prefix_diff = 16 - prefix;
                 }
             }
         } 
@@ -259,7 +273,7 @@ uint32_t *lookup_tree_advance(uint32_t* ip_vec){
     for(int i = 0;i < TEST_SIZE;i++){
         uint32_t ip = ip_vec[i];
         
-        TrieNodeOpt *curr = Trie_map[ip >> MAP_SHIFT];
+        TrieNodeOpt *curr = &Trie_map[ip >> MAP_SHIFT];
         TrieNodeOpt *match = unmatch;
 
         uint32_t curr_bit;
@@ -293,15 +307,16 @@ uint32_t *lookup_tree_advance(uint32_t* ip_vec){
 
 // Init Trie_map
 void Trie_map_init() {
-    unmatch = (TrieNodeOpt*)malloc(sizeof(TrieNodeOpt));
+    advance_arena = arena_create("advance_tree", TREE_ARENA_SIZE);
+    unmatch = (TrieNodeOpt*)node_alloc(advance_arena, sizeof(TrieNodeOpt));
     unmatch->port = -1;
+    Trie_map = (TrieNodeOpt*)node_alloc(advance_arena, sizeof(TrieNodeOpt) * MAP_NUM);
     for (int i = 0; i < MAP_NUM; i++) {
-        Trie_map[i] = (TrieNodeOpt*)malloc(sizeof(TrieNodeOpt));
-        Trie_map[i]->type = I_NODE;
-        Trie_map[i]->port = 0;
-        Trie_map[i]->prefix_diff = 0;
+        Trie_map[i].type = I_NODE;
+        Trie_map[i].port = 0;
+        Trie_map[i].prefix_diff = 0;
         for (int j = 0; j < 4; j++) {
-            Trie_map[i]->children[j] = NULL;
+            Trie_map[i].children[j] = NULL;
         }
     }
 }
@@ -319,7 +334,7 @@ void insert_node_advance(TrieNodeOpt *root, uint32_t ip, int port, int prefix) {
         next = curr->children[cur_bit];
         // If the children node's space type not been allocated.
         if (next == NULL) {
-            next = (TrieNodeOpt*)malloc(sizeof(TrieNodeOpt));
+            next = (TrieNodeOpt*)node_alloc(advance_arena, sizeof(TrieNodeOpt));
             next->port = 0;
             next->type = I_NODE;
             next->children[0] = next->children[1] = next->children[2] = next->children[3] = NULL;
@@ -335,7 +350,7 @@ void insert_node_advance(TrieNodeOpt *root, uint32_t ip, int port, int prefix) {
         for(int i = 0;i < 2;i++){
             next = curr->children[start_bit + i]; //最低位设置为0
             if (next == NULL) {
-                next = (TrieNodeOpt*)malloc(sizeof(TrieNodeOpt));
+                next = (TrieNodeOpt*)node_alloc(advance_arena, sizeof(TrieNodeOpt));
                 next->port = port;
                 next->type = M_NODE;
                 next->children[0] = next->children[1] = next->children[2] = next->children[3] = NULL;
@@ -0,0 +1,144 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static struct arena *arenas;	// all the arenas, the latest created first
+
+static const char *arena_backing_names[] = {
+	"hugetlb",
+	"thp",
+	"normal",
+};
+
+const char *arena_backing_str(enum arena_backing backing)
+{
+	return arena_backing_names[backing];
+}
+
+static int hugepages_enabled()
+{
+	char *env = getenv("USTACK_HUGEPAGES");
+	return !env || atoi(env);
+}
+
+// map size bytes aligned to ARENA_HUGEPAGE_SIZE, so that transparent
+// hugepages could back the whole range
+static char *map_aligned(size_t size)
+{
+	size_t len = size + ARENA_HUGEPAGE_SIZE;
+	char *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, \
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (addr == MAP_FAILED)
+		return NULL;
+
+	char *base = (char *)(((unsigned long)addr + ARENA_HUGEPAGE_SIZE - 1) & \
+			~(ARENA_HUGEPAGE_SIZE - 1));
+	if (base > addr)
+		munmap(addr, base - addr);
+	if (base + size < addr + len)
+		munmap(base + size, addr + len - (base + size));
+
+	return base;
+}
+
+// reserve an arena of size bytes (rounded up to hugepages) for the subsystem
+// name, which must be a string constant
+struct arena *arena_create(const char *name, size_t size)
+{
+	struct arena *arena = malloc(sizeof(struct arena));
+	if (!arena)
+		return NULL;
+	bzero(arena, sizeof(struct arena));
+
+	size = (size + ARENA_HUGEPAGE_SIZE - 1) & ~(ARENA_HUGEPAGE_SIZE - 1);
+	arena->name = name;
+	arena->size = size;
+	pthread_mutex_init(&arena->lock, NULL);
+
+	int huge = hugepages_enabled();
+	char *base = MAP_FAILED;
+	if (huge)
+		base = mmap(NULL, size, PROT_READ | PROT_WRITE, \
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+	if (base != MAP_FAILED) {
+		arena->backing = ARENA_HUGETLB;
+	}
+	else {
+		// not enough hugepages reserved, fall back to transparent ones
+		base = map_aligned(size);
+		if (!base) {
+			free(arena);
+			return NULL;
+		}
+
+		arena->backing = ARENA_NORMAL;
+		if (huge && madvise(base, size, MADV_HUGEPAGE) == 0)
+			arena->backing = ARENA_THP;
+	}
+	arena->base = base;
+
+	arena->next = __atomic_load_n(&arenas, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&arenas, &arena->next, arena, 1, \
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	return arena;
+}
+
+// allocate size bytes aligned to align (power of 2) from the arena, which are
+// zeroed, or NULL if the arena is used up
+void *arena_alloc(struct arena *arena, size_t size, size_t align)
+{
+	if (!arena)
+		return NULL;
+
+	void *ptr = NULL;
+	pthread_mutex_lock(&arena->lock);
+	size_t start = (arena->used + align - 1) & ~(align - 1);
+	if (start + size <= arena->size) {
+		ptr = arena->base + start;
+		arena->used = start + size;
+	}
+	pthread_mutex_unlock(&arena->lock);
+
+	return ptr;
+}
+
+// bytes of the arena resident in memory
+size_t arena_resident(struct arena *arena)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t npages = arena->size / page_size;
+	unsigned char *vec = malloc(npages);
+	if (!vec)
+		return 0;
+
+	size_t resident = 0;
+	if (mincore(arena->base, arena->size, vec) == 0) {
+		for (size_t i = 0; i < npages; i++)
+			if (vec[i] & 1)
+				resident += page_size;
+	}
+	free(vec);
+
+	return resident;
+}
+
+struct arena *arena_list()
+{
+	return __atomic_load_n(&arenas, __ATOMIC_ACQUIRE);
+}
+
+// print the memory of each arena
+void arena_report(FILE *fp)
+{
+	fprintf(fp, "arena\t\tbacking\treserved\tused\t\tresident\n");
+	for (struct arena *arena = arena_list(); arena; arena = arena->next)
+		fprintf(fp, "%-15s\t%s\t%zu KB\t%zu KB\t%zu KB\n", arena->name, \
+				arena_backing_str(arena->backing), arena->size >> 10, \
+				arena->used >> 10, arena_resident(arena) >> 10);
+}
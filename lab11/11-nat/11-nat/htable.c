@@ -0,0 +1,353 @@
+#include "htable.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/random.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define CTRL_EMPTY		0x80
+#define CTRL_DELETED	0xFE
+
+#define H1(hash)		((hash) >> 7)
+#define H2(hash)		((u8)((hash) & 0x7F))
+
+static u64 hash_key[2];
+static pthread_once_t hash_key_once = PTHREAD_ONCE_INIT;
+
+static void init_hash_key()
+{
+	if (getrandom(hash_key, sizeof(hash_key), 0) != sizeof(hash_key)) {
+		perror("Get random hash key failed");
+		exit(1);
+	}
+}
+
+#define ROTL(x, b)		(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND \
+	do { \
+		v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+		v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+	} while (0)
+
+// SipHash-1-3 of buf, keyed by a random key of this process, so that the
+// distribution could not be predicted from the keys
+u64 htable_hash(const void *buf, int len)
+{
+	pthread_once(&hash_key_once, init_hash_key);
+
+	u64 v0 = hash_key[0] ^ 0x736f6d6570736575ULL;
+	u64 v1 = hash_key[1] ^ 0x646f72616e646f6dULL;
+	u64 v2 = hash_key[0] ^ 0x6c7967656e657261ULL;
+	u64 v3 = hash_key[1] ^ 0x7465646279746573ULL;
+
+	const u8 *p = buf;
+	int left = len;
+	for (; left >= 8; p += 8, left -= 8) {
+		u64 m;
+		memcpy(&m, p, 8);
+		v3 ^= m;
+		SIPROUND;
+		v0 ^= m;
+	}
+
+	u64 b = (u64)len << 56;
+	for (int i = 0; i < left; i++)
+		b |= (u64)p[i] << (8 * i);
+	v3 ^= b;
+	SIPROUND;
+	v0 ^= b;
+
+	v2 ^= 0xFF;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// bitmask of the slots in the group whose control byte is c
+static inline u32 group_match(const u8 *ctrl, u8 c)
+{
+#ifdef __SSE2__
+	__m128i group = _mm_load_si128((const __m128i *)ctrl);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(c)));
+#else
+	u32 mask = 0;
+	for (int i = 0; i < HTABLE_GROUP; i++)
+		if (ctrl[i] == c)
+			mask |= 1 << i;
+	return mask;
+#endif
+}
+
+// bitmask of the empty or deleted slots in the group
+static inline u32 group_match_free(const u8 *ctrl)
+{
+#ifdef __SSE2__
+	return _mm_movemask_epi8(_mm_load_si128((const __m128i *)ctrl));
+#else
+	u32 mask = 0;
+	for (int i = 0; i < HTABLE_GROUP; i++)
+		if (ctrl[i] & CTRL_EMPTY)
+			mask |= 1 << i;
+	return mask;
+#endif
+}
+
+static struct htable_array *array_alloc(u64 ngroups)
+{
+	u64 nslots = ngroups * HTABLE_GROUP;
+	struct htable_array *arr = malloc(sizeof(struct htable_array));
+	if (!arr || posix_memalign((void **)&arr->ctrl, HTABLE_GROUP, nslots) != 0 || \
+			!(arr->slots = malloc(nslots * sizeof(struct htable_slot)))) {
+		log(ERROR, "could not allocate hash table of %lu slots.", nslots);
+		exit(1);
+	}
+	memset(arr->ctrl, CTRL_EMPTY, nslots);
+	arr->ngroups = ngroups;
+	arr->growth_left = nslots - nslots / 8;
+
+	return arr;
+}
+
+static void array_free(struct htable_array *arr)
+{
+	free(arr->ctrl);
+	free(arr->slots);
+	free(arr);
+}
+
+static void array_free_rcu(struct rcu_head *head)
+{
+	array_free(list_entry(head, struct htable_array, rcu));
+}
+
+// index of the slot of the entry with the key (or the entry itself if eq is
+// NULL), -1 if not found; the entry matched is stored to found if not NULL
+//
+// The control bytes are loaded before the slots, which are filled before
+// the bytes are published, so that the slots matched could be read without
+// the lock.
+static long array_find(struct htable_array *arr, u64 hash, const void *key, \
+		htable_eq_t eq, void **found)
+{
+	if (!arr)
+		return -1;
+
+	u64 gmask = arr->ngroups - 1;
+	u64 g = H1(hash) & gmask;
+	for (u64 i = 1; i <= arr->ngroups; i++) {
+		const u8 *ctrl = arr->ctrl + g * HTABLE_GROUP;
+		u32 match = group_match(ctrl, H2(hash));
+		u32 empty = group_match(ctrl, CTRL_EMPTY);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		while (match) {
+			long idx = g * HTABLE_GROUP + __builtin_ctz(match);
+			struct htable_slot *slot = &arr->slots[idx];
+			void *entry = __atomic_load_n(&slot->entry, __ATOMIC_RELAXED);
+			if (__atomic_load_n(&slot->hash, __ATOMIC_RELAXED) == hash && \
+					(eq ? eq(entry, key) : entry == key)) {
+				// the slot could be refilled by now, so hand out the entry
+				// that was compared rather than reloading it
+				if (found)
+					*found = entry;
+				return idx;
+			}
+			match &= match - 1;
+		}
+
+		if (empty)
+			return -1;
+
+		// triangular probing visits each group once
+		g = (g + i) & gmask;
+	}
+
+	return -1;
+}
+
+// put the entry into the first free slot on its probing sequence
+static void array_put(struct htable_array *arr, u64 hash, void *entry)
+{
+	u64 gmask = arr->ngroups - 1;
+	u64 g = H1(hash) & gmask;
+	for (u64 i = 1; ; i++) {
+		u32 free = group_match_free(arr->ctrl + g * HTABLE_GROUP);
+		if (free) {
+			u64 idx = g * HTABLE_GROUP + __builtin_ctz(free);
+			if (arr->ctrl[idx] == CTRL_EMPTY)
+				arr->growth_left -= 1;
+			__atomic_store_n(&arr->slots[idx].hash, hash, __ATOMIC_RELAXED);
+			__atomic_store_n(&arr->slots[idx].entry, entry, __ATOMIC_RELAXED);
+			__atomic_store_n(&arr->ctrl[idx], H2(hash), __ATOMIC_RELEASE);
+			return ;
+		}
+
+		g = (g + i) & gmask;
+	}
+}
+
+// move the entries in (at most) ngroups groups of old into cur
+static void htable_migrate(struct htable *ht, u64 ngroups)
+{
+	struct htable_array *old = ht->old;
+	if (!old)
+		return ;
+
+	for (; ngroups > 0 && ht->migrated < old->ngroups; ngroups--) {
+		u64 start = ht->migrated * HTABLE_GROUP;
+		for (u64 idx = start; idx < start + HTABLE_GROUP; idx++) {
+			if (old->ctrl[idx] & CTRL_EMPTY)
+				continue;
+			array_put(ht->cur, old->slots[idx].hash, old->slots[idx].entry);
+			// not to be found in old any more, but keep the probing sequences
+			__atomic_store_n(&old->ctrl[idx], CTRL_DELETED, __ATOMIC_RELEASE);
+		}
+		ht->migrated += 1;
+	}
+
+	if (ht->migrated == old->ngroups) {
+		rcu_assign_pointer(ht->old, NULL);
+		call_rcu(&old->rcu, array_free_rcu);
+	}
+}
+
+static void htable_grow(struct htable *ht)
+{
+	// finish the last growing first
+	if (ht->old)
+		htable_migrate(ht, ht->old->ngroups);
+
+	// with most of the used slots deleted, rehash into the same size
+	u64 ngroups = ht->cur->ngroups;
+	if (ht->size * 2 >= ngroups * HTABLE_GROUP)
+		ngroups *= 2;
+
+	ht->migrated = 0;
+	rcu_assign_pointer(ht->old, ht->cur);
+	rcu_assign_pointer(ht->cur, array_alloc(ngroups));
+}
+
+// the lookups under rcu missing during the changes are retried
+static inline void htable_write_begin(struct htable *ht)
+{
+	__atomic_store_n(&ht->seq, ht->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void htable_write_end(struct htable *ht)
+{
+	__atomic_store_n(&ht->seq, ht->seq + 1, __ATOMIC_RELEASE);
+}
+
+void htable_init(struct htable *ht)
+{
+	bzero(ht, sizeof(struct htable));
+	ht->cur = array_alloc(1);
+}
+
+// destroy the table, which is no longer looked up by anyone
+void htable_destroy(struct htable *ht)
+{
+	array_free(ht->cur);
+	if (ht->old)
+		array_free(ht->old);
+	ht->cur = ht->old = NULL;
+	ht->size = 0;
+}
+
+// lookup the entry with the key, whose hash is hash
+void *htable_lookup(struct htable *ht, u64 hash, const void *key, htable_eq_t eq)
+{
+	void *entry;
+	if (array_find(ht->cur, hash, key, eq, &entry) >= 0 || \
+			array_find(ht->old, hash, key, eq, &entry) >= 0)
+		return entry;
+
+	return NULL;
+}
+
+// lookup the entry with the key without the lock of the writer, which must be
+// called in a critical section of rcu
+void *htable_lookup_rcu(struct htable *ht, u64 hash, const void *key, htable_eq_t eq)
+{
+	while (1) {
+		u64 seq = __atomic_load_n(&ht->seq, __ATOMIC_ACQUIRE);
+
+		void *entry;
+		if (array_find(rcu_dereference(ht->cur), hash, key, eq, &entry) >= 0 || \
+				array_find(rcu_dereference(ht->old), hash, key, eq, &entry) >= 0)
+			return entry;
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (!(seq & 1) && __atomic_load_n(&ht->seq, __ATOMIC_RELAXED) == seq)
+			return NULL;
+	}
+}
+
+// insert the entry, whose key should not be in the table
+void htable_insert(struct htable *ht, u64 hash, void *entry)
+{
+	htable_write_begin(ht);
+
+	htable_migrate(ht, HTABLE_MIGRATE);
+	if (ht->cur->growth_left == 0)
+		htable_grow(ht);
+
+	array_put(ht->cur, hash, entry);
+	ht->size += 1;
+
+	htable_write_end(ht);
+}
+
+// remove the entry (compared by pointer), return 0 if not found
+int htable_remove(struct htable *ht, u64 hash, void *entry)
+{
+	struct htable_array *arr = ht->cur;
+	long idx = array_find(arr, hash, entry, NULL, NULL);
+	if (idx < 0) {
+		arr = ht->old;
+		if ((idx = array_find(arr, hash, entry, NULL, NULL)) < 0)
+			return 0;
+	}
+
+	htable_write_begin(ht);
+
+	// no probing sequence has gone through a group with empty slot, which
+	// could be emptied again
+	if (group_match(arr->ctrl + idx / HTABLE_GROUP * HTABLE_GROUP, CTRL_EMPTY)) {
+		__atomic_store_n(&arr->ctrl[idx], CTRL_EMPTY, __ATOMIC_RELEASE);
+		arr->growth_left += 1;
+	}
+	else
+		__atomic_store_n(&arr->ctrl[idx], CTRL_DELETED, __ATOMIC_RELEASE);
+	ht->size -= 1;
+
+	htable_write_end(ht);
+
+	return 1;
+}
+
+// the entry at or after pos (which is advanced past it), NULL if no more
+void *htable_next(struct htable *ht, u64 *pos)
+{
+	u64 ncur = ht->cur->ngroups * HTABLE_GROUP;
+	u64 nold = ht->old ? ht->old->ngroups * HTABLE_GROUP : 0;
+	while (*pos < ncur + nold) {
+		u64 i = (*pos)++;
+		struct htable_array *arr = i < ncur ? ht->cur : ht->old;
+		u64 idx = i < ncur ? i : i - ncur;
+		if (!(arr->ctrl[idx] & CTRL_EMPTY))
+			return arr->slots[idx].entry;
+	}
+
+	return NULL;
+}
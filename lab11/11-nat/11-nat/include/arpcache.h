@@ -4,12 +4,15 @@
 #include "base.h"
 #include "types.h"
 #include "list.h"
+#include "timer.h"
+#include "rcu.h"
 
 #include <pthread.h>
 
 #define MAX_ARP_SIZE 32				// maximum number of IP->mac mapping entries
 #define ARP_ENTRY_TIMEOUT 15		// timeout for IP->mac entry
 #define ARP_REQUEST_MAX_RETRIES	5	// maximum number of retries of arp request
+#define ARP_REQUEST_INTERVAL 1		// timeout for arp request
 
 // pending packet, waiting for arp reply
 struct cached_pkt {
@@ -23,28 +26,34 @@ struct arp_req {
 	struct list_head list;	
 	iface_info_t *iface;	// the interface that will send the pending packets
 	u32 ip4;				// destination ip address
-	time_t sent;			// last time when arp request is sent
+	struct timer timer;		// retransmission of arp request
 	int retries;			// number of retries
+	int answered;			// replied while the timer is running
 	struct list_head cached_packets;	// pending packets
 };
 
+// IP->mac mapping, never changed once published but replaced by a new one
 struct arp_cache_entry {
+	struct rcu_head rcu;
 	u32 ip4; 			// destination ip address, stored in host byte order
 	u8 mac[ETH_ALEN];	// mac address
-	time_t added;		// the time when this entry is inserted
-	int valid;			// whether this entry is valid (has not triggered the timeout)
+};
+
+struct arp_cache_slot {
+	struct arp_cache_entry *entry;	// published to lookups, NULL if free
+	struct timer timer;				// timeout of the entry
 };
 
 typedef struct {
-	struct arp_cache_entry entries[MAX_ARP_SIZE];	// IP->max mapping entries
+	struct arp_cache_slot slots[MAX_ARP_SIZE];	// IP->max mapping entries
 	struct list_head req_list;			// the pending packet list
-	pthread_mutex_t lock;				// each operation on arp cache should apply the lock first
-	pthread_t thread;					// the id of the arp cache sweeping thread
+	pthread_mutex_t lock;				// each update of arp cache should apply
+										// the lock first, while lookups are
+										// lock-free (see rcu.h)
 } arpcache_t;
 
 void arpcache_init();
 void arpcache_destroy();
-void *arpcache_sweep(void *);
 
 int arpcache_lookup(u32 ip4, u8 mac[]);
 void arpcache_insert(u32 ip4, u8 mac[]);
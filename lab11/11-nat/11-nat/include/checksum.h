@@ -3,20 +3,59 @@
 
 #include "types.h"
 
-// calculate the checksum of the given buf, providing sum 
+#include <string.h>
+
+// the internet checksum (RFC 1071), summed up in 64-bit words by the scalar,
+// SSE2 or AVX2 kernel picked at runtime by the cpu features (the scalar one
+// only on the cpus other than x86)
+//
+// csum_partial returns the one's complement sum of buf, providing sum as the
+// initial value, folded into 16 bits but not complemented, so that the sums
+// of several pieces are chained by passing one as the initial value of the
+// next, as long as each piece starts at an even offset. csum_partial_copy
+// also copies the buf, in the same pass over it.
+
+u16 csum_partial(const void *buf, int nbytes, u32 sum);
+u16 csum_partial_copy(void *dst, const void *src, int nbytes, u32 sum);
+const char *csum_impl_name();
+
+int csum_nr_kernels();
+const char *csum_kernel_name(int kernel);
+u16 csum_kernel_partial(int kernel, const void *buf, int nbytes, u32 sum);
+u16 csum_kernel_partial_copy(int kernel, void *dst, const void *src, \
+		int nbytes, u32 sum);
+
+// bufs up to this size (the headers) are summed up inline, saving the call
+#define CSUM_INLINE_MAX		64
+
+// calculate the checksum of the given buf, providing sum
 // as the initial value
 static inline u16 checksum(u16 *buf, int nbytes, u32 sum)
 {
-	for (int i = 0; i < nbytes / 2; i++)
-		sum += buf[i];
- 
-	if (nbytes % 2)
-		sum += ((u8 *)buf)[nbytes-1];
+	if (nbytes > CSUM_INLINE_MAX)
+		return (u16)~csum_partial(buf, nbytes, sum);
+
+	u64 sum64 = sum;
+	const u8 *p = (const u8 *)buf;
+	for (; nbytes >= 4; p += 4, nbytes -= 4) {
+		u32 v;
+		memcpy(&v, p, 4);
+		sum64 += v;
+	}
+	if (nbytes & 2) {
+		u16 v;
+		memcpy(&v, p, 2);
+		sum64 += v;
+		p += 2;
+	}
+	if (nbytes & 1)
+		sum64 += *p;
 
-	while (sum >> 16)
-		sum = (sum >> 16) + (sum & 0xffff);
+	sum64 = (sum64 >> 32) + (sum64 & 0xffffffff);
+	while (sum64 >> 16)
+		sum64 = (sum64 >> 16) + (sum64 & 0xffff);
 
-    return (u16)~sum;
+	return (u16)~sum64;
 }
 
 #endif
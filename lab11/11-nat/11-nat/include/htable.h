@@ -0,0 +1,74 @@
+#ifndef __HTABLE_H__
+#define __HTABLE_H__
+
+#include "types.h"
+#include "rcu.h"
+
+// open addressing hash table of pointers to entries, in the way of swiss
+// tables
+//
+// The slots are divided into groups of HTABLE_GROUP, with one control byte for
+// each slot: empty, deleted, or the low 7 bits of the hash of its entry. The
+// other bits of the hash select the group to start probing from, and the
+// control bytes of a whole group are compared at once (with SSE2), so that
+// only the slots with the same 7 bits are checked, and a lookup stops at the
+// first group with an empty slot.
+//
+// When 7/8 of the slots are used, the table grows by doubling (or is rehashed
+// in the same size if most of them are deleted) incrementally: the entries in
+// the old slots are moved by HTABLE_MIGRATE groups at each insertion, and are
+// looked up in both until then. Removing never moves the entries, so that they
+// could be removed while iterating the table.
+//
+// Only the hash and the pointer of the entries are stored, whose keys are
+// compared by the eq callback in lookup. The insertions and removals must be
+// serialized by the user, and htable_lookup could only run in parallel with
+// other lookups, while htable_lookup_rcu could also run in parallel with one
+// writer, inside a critical section of rcu: the slots are filled before their
+// control bytes are published, the arrays replaced by growing are freed by
+// call_rcu, and a lookup missing while the table is being changed (as an
+// entry might be moving between the arrays) is retried by the sequence count.
+// The entries removed must also be freed after a grace period then.
+
+#define HTABLE_GROUP	16
+#define HTABLE_MIGRATE	4		// groups moved by each insertion when growing
+
+struct htable_slot {
+	u64 hash;
+	void *entry;
+};
+
+struct htable_array {
+	struct rcu_head rcu;		// freed after the lookups have left
+	u8 *ctrl;					// control bytes of the slots
+	struct htable_slot *slots;
+	u64 ngroups;				// power of 2
+	u64 growth_left;			// empty slots to be used before growing
+};
+
+struct htable {
+	struct htable_array *cur;
+	struct htable_array *old;	// being moved into cur while growing (NULL
+								// if not growing)
+	u64 migrated;				// groups of old which have been moved
+	u64 size;					// number of entries
+	u64 seq;					// odd while the table is being changed
+};
+
+// whether the entry has the key
+typedef int (*htable_eq_t)(const void *entry, const void *key);
+
+u64 htable_hash(const void *buf, int len);
+void htable_init(struct htable *ht);
+void htable_destroy(struct htable *ht);
+void *htable_lookup(struct htable *ht, u64 hash, const void *key, htable_eq_t eq);
+void *htable_lookup_rcu(struct htable *ht, u64 hash, const void *key, htable_eq_t eq);
+void htable_insert(struct htable *ht, u64 hash, void *entry);
+int htable_remove(struct htable *ht, u64 hash, void *entry);
+void *htable_next(struct htable *ht, u64 *pos);
+
+// iterate all the entries, which could be removed in the loop
+#define htable_for_each(ht, pos, entry) \
+	for (pos = 0; (entry = htable_next(ht, &pos)) != NULL; )
+
+#endif
@@ -5,7 +5,9 @@
 #include "base.h"
 #include "list.h"
 
-#include "hash.h"
+#include "htable.h"
+#include "timer.h"
+#include "arena.h"
 
 #include <time.h>
 #include <pthread.h>
@@ -15,6 +17,9 @@
 
 #define TCP_ESTABLISHED_TIMEOUT	60		// if the tcp connection does not transmit any packet 
                                         // in 60 seconds, it is regarded as finished
+#define NAT_FINISHED_TIMEOUT	1		// the finished tcp connection is removed 1 second later
+
+#define NAT_ARENA_SIZE	(64UL << 20)	// for the port pool and the mappings
 
 // DIR_IN is direction that packet from public network to private network, 
 // DIR_OUT is direction that packet from private network to public network
@@ -33,8 +38,6 @@ struct nat_connection {
 
 // the mapping entry used for address translation
 struct nat_mapping {
-	struct list_head list;
-
 	u32 remote_ip;			// ip address of the real peer
 	u16 remote_port;		// port of the real peer
 	u32 internal_ip;		// ip address seen in private network
@@ -42,22 +45,30 @@ struct nat_mapping {
 	u32 external_ip;		// ip address seen in public network (the ip address of external interface)
 	u16 external_port;		// port seen in public network (assigned by nat)
 
-	time_t update_time;		// when receiving the latest packet
+	time_t update_time;		// when receiving the latest packet (in s of
+					// the timer clock)
 	struct nat_connection conn;	// statistics of the tcp connection
+
+	struct timer timer;		// timeout of the mapping
+	int removed;			// removed while the timer is running
+	struct nat_mapping *next_free;	// link in the free list of mappings
 };
 
 struct nat_table {
-	struct list_head nat_mapping_list[HASH_8BITS];	// nat hash table
+	struct htable mapping_in;			// (remote, external) -> mapping
+	struct htable mapping_out;			// (remote, internal) -> mapping
 
 	iface_info_t *internal_iface;		// pointer to internal interface
 	iface_info_t *external_iface;		// pointer to external interface
 
-	u8 assigned_ports[65536];			// port pool, indicates whether a port is assigned
+	u8 *assigned_ports;					// port pool (65536 entries), indicates whether a port is assigned
+
+	struct arena *arena;				// the port pool and the mappings are allocated from
+	struct nat_mapping *free_mappings;	// freed mappings, reused before allocating
 
 	struct list_head rules;				// dnat rules
 
 	pthread_mutex_t lock;				// each nat operation should apply the lock first
-	pthread_t thread;					// thread id of nat timeout
 };
 
 struct dnat_rule {
@@ -74,7 +74,9 @@ static inline u16 tcp_checksum(struct iphdr *ip, struct tcphdr *tcp)
 	u16 reserv_proto = ip->protocol;
 	u16 tcp_len = ntohs(ip->tot_len) - IP_HDR_SIZE(ip);
 
-	u32 sum = ip->saddr + ip->daddr + htons(reserv_proto) + htons(tcp_len);
+	// the addresses are added in halves, not to overflow
+	u32 sum = (ip->saddr >> 16) + (ip->saddr & 0xffff) + (ip->daddr >> 16) + \
+		(ip->daddr & 0xffff) + htons(reserv_proto) + htons(tcp_len);
 	u16 cksum = checksum((u16 *)tcp, (int)tcp_len, sum);
 
 	tcp->checksum = tmp;
@@ -4,11 +4,15 @@
 #include "rtable.h"
 #include "arp.h"
 #include "nat.h"
+#include "packet_pool.h"
+#include "metrics.h"
 
 #include <stdlib.h>
 
 void handle_ip_packet(iface_info_t *iface, char *packet, int len)
 {
+	latency_stage(LAT_IP);
+
 	struct iphdr *ip = packet_to_ip_hdr(packet);
 	u32 daddr = ntohl(ip->daddr);
 	if (daddr == iface->ip && ip->protocol == IPPROTO_ICMP) {
@@ -17,7 +21,7 @@ void handle_ip_packet(iface_info_t *iface, char *packet, int len)
 			icmp_send_packet(packet, len, ICMP_ECHOREPLY, 0);
 		}
 
-		free(packet);
+		packet_free(packet);
 	}
 	else {
 		nat_translate_packet(iface, packet, len);
@@ -0,0 +1,463 @@
+#include "metrics.h"
+#include "log.h"
+#include "arena.h"
+
+#include <stdlib.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/un.h>
+
+#define METRICS_CACHE_LINE		64
+#define METRICS_REQ_TIMEOUT		100		// ms to wait for an HTTP request line
+#define TSC_CALIBRATE_TIME		20000	// us to measure the TSC frequency
+
+static const char *drop_reason_str[NR_DROP_REASONS] = {
+	[DROP_RX_ERROR] = "rx_error",
+	[DROP_NO_BUFFER] = "no_buffer",
+	[DROP_TX_ERROR] = "tx_error",
+	[DROP_UNKNOWN_PROTO] = "unknown_proto",
+	[DROP_NOT_LOCAL] = "not_local",
+	[DROP_NO_ROUTE] = "no_route",
+	[DROP_TTL_EXCEEDED] = "ttl_exceeded",
+	[DROP_ARP_UNREACHABLE] = "arp_unreachable",
+	[DROP_BAD_CHECKSUM] = "bad_checksum",
+	[DROP_NAT_INVALID_DIR] = "nat_invalid_dir",
+	[DROP_NAT_NO_MAPPING] = "nat_no_mapping",
+	[DROP_NAT_NO_PORT] = "nat_no_port",
+	[DROP_TCP_NO_SOCK] = "tcp_no_sock",
+	[DROP_TCP_INVALID_SEQ] = "tcp_invalid_seq",
+	[DROP_MALFORMED] = "malformed",
+	[DROP_VLAN_FILTERED] = "vlan_filtered",
+};
+
+static const char *latency_stage_str[NR_LAT_STAGES] = {
+	[LAT_DISPATCH] = "dispatch",
+	[LAT_IP] = "ip",
+	[LAT_LPM] = "lpm",
+	[LAT_SEND_BY_ARP] = "send_by_arp",
+	[LAT_TCP_PROCESS] = "tcp_process",
+	[LAT_DONE] = "done",
+};
+
+static const double latency_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+__thread struct metrics_block *local_metrics;
+int latency_sample;
+__thread int latency_countdown;
+__thread u64 latency_rx_tsc;
+static double tsc_per_ns = 1.0;
+static int dump_pipe[2];
+
+// blocks of the running threads, and the counters of the exited ones
+static struct list_head metrics_blocks = { &metrics_blocks, &metrics_blocks };
+static struct metrics_block *retired;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+static pthread_key_t metrics_key;
+
+static struct metrics_block *new_metrics_block()
+{
+	int nifaces = instance->max_ifindex + 1;
+	int size = sizeof(struct metrics_block) + nifaces * sizeof(struct iface_counters);
+	size = (size + METRICS_CACHE_LINE - 1) & ~(METRICS_CACHE_LINE - 1);
+
+	struct metrics_block *mb = NULL;
+	if (posix_memalign((void **)&mb, METRICS_CACHE_LINE, size) != 0)
+		return NULL;
+	bzero(mb, size);
+	mb->nifaces = nifaces;
+
+	if (latency_sample) {
+		size = sizeof(struct latency_hist) * NR_LAT_STAGES;
+		if (posix_memalign((void **)&mb->lat, METRICS_CACHE_LINE, size) != 0) {
+			free(mb);
+			return NULL;
+		}
+		bzero(mb->lat, size);
+	}
+
+	return mb;
+}
+
+static void free_metrics_block(struct metrics_block *mb)
+{
+	free(mb->lat);
+	free(mb);
+}
+
+// add the latency histograms of src into dst
+static void latency_merge(struct latency_hist *dst, struct latency_hist *src)
+{
+	for (int i = 0; i < NR_LAT_STAGES; i++) {
+		dst[i].count += __atomic_load_n(&src[i].count, __ATOMIC_RELAXED);
+		dst[i].sum += __atomic_load_n(&src[i].sum, __ATOMIC_RELAXED);
+		u64 max = __atomic_load_n(&src[i].max, __ATOMIC_RELAXED);
+		if (max > dst[i].max)
+			dst[i].max = max;
+		for (int j = 0; j < LAT_NR_BUCKETS; j++)
+			dst[i].buckets[j] += __atomic_load_n(&src[i].buckets[j], __ATOMIC_RELAXED);
+	}
+}
+
+// add the counters of an exited thread into retired, and release its block
+static void metrics_thread_exit(void *arg)
+{
+	struct metrics_block *mb = arg;
+
+	pthread_mutex_lock(&metrics_lock);
+	for (int i = 0; i < NR_DROP_REASONS; i++)
+		retired->drops[i] += mb->drops[i];
+	retired->polls += mb->polls;
+	retired->empty_polls += mb->empty_polls;
+	for (int i = 0; i < mb->nifaces && i < retired->nifaces; i++) {
+		retired->ifaces[i].rx_packets += mb->ifaces[i].rx_packets;
+		retired->ifaces[i].rx_bytes += mb->ifaces[i].rx_bytes;
+		retired->ifaces[i].tx_packets += mb->ifaces[i].tx_packets;
+		retired->ifaces[i].tx_bytes += mb->ifaces[i].tx_bytes;
+	}
+	if (mb->lat && retired->lat)
+		latency_merge(retired->lat, mb->lat);
+	list_delete_entry(&mb->list);
+	pthread_mutex_unlock(&metrics_lock);
+
+	free_metrics_block(mb);
+}
+
+static void metrics_key_init()
+{
+	retired = new_metrics_block();
+	pthread_key_create(&metrics_key, metrics_thread_exit);
+}
+
+// allocate the counters of the calling thread
+struct metrics_block *metrics_block_alloc()
+{
+	pthread_once(&metrics_once, metrics_key_init);
+
+	struct metrics_block *mb = new_metrics_block();
+	if (!mb)
+		return NULL;
+
+	pthread_mutex_lock(&metrics_lock);
+	list_add_tail(&mb->list, &metrics_blocks);
+	pthread_mutex_unlock(&metrics_lock);
+
+	pthread_setspecific(metrics_key, mb);
+
+	return mb;
+}
+
+// sum up the counters of all the threads into sum
+static void metrics_collect(struct metrics_block *sum)
+{
+	pthread_once(&metrics_once, metrics_key_init);
+
+	pthread_mutex_lock(&metrics_lock);
+	memcpy(sum->drops, retired->drops, sizeof(sum->drops));
+	sum->polls = retired->polls;
+	sum->empty_polls = retired->empty_polls;
+	memcpy(sum->ifaces, retired->ifaces, sum->nifaces * sizeof(struct iface_counters));
+	if (sum->lat && retired->lat)
+		memcpy(sum->lat, retired->lat, sizeof(struct latency_hist) * NR_LAT_STAGES);
+
+	struct metrics_block *mb = NULL;
+	list_for_each_entry(mb, &metrics_blocks, list) {
+		for (int i = 0; i < NR_DROP_REASONS; i++)
+			sum->drops[i] += __atomic_load_n(&mb->drops[i], __ATOMIC_RELAXED);
+		sum->polls += __atomic_load_n(&mb->polls, __ATOMIC_RELAXED);
+		sum->empty_polls += __atomic_load_n(&mb->empty_polls, __ATOMIC_RELAXED);
+		for (int i = 0; i < mb->nifaces && i < sum->nifaces; i++) {
+			struct iface_counters *c = &mb->ifaces[i];
+			sum->ifaces[i].rx_packets += __atomic_load_n(&c->rx_packets, __ATOMIC_RELAXED);
+			sum->ifaces[i].rx_bytes += __atomic_load_n(&c->rx_bytes, __ATOMIC_RELAXED);
+			sum->ifaces[i].tx_packets += __atomic_load_n(&c->tx_packets, __ATOMIC_RELAXED);
+			sum->ifaces[i].tx_bytes += __atomic_load_n(&c->tx_bytes, __ATOMIC_RELAXED);
+		}
+		if (sum->lat && mb->lat)
+			latency_merge(sum->lat, mb->lat);
+	}
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+#define IFACE_COUNTER(fp, sum, field, help) \
+	do { \
+		fprintf(fp, "# HELP ustack_iface_" #field "_total " help "\n"); \
+		fprintf(fp, "# TYPE ustack_iface_" #field "_total counter\n"); \
+		iface_info_t *iface = NULL; \
+		list_for_each_entry(iface, &instance->iface_list, list) { \
+			fprintf(fp, "ustack_iface_" #field "_total{iface=\"%s\"} %lu\n", \
+					iface->name, sum->ifaces[iface->index].field); \
+		} \
+	} while (0)
+
+// the value at quantile q of histogram h, which is the upper bound of the
+// bucket it falls in
+static u64 latency_quantile(struct latency_hist *h, double q)
+{
+	u64 rank = q * h->count, n = 0;
+	for (int i = 0; i < LAT_NR_BUCKETS; i++) {
+		n += h->buckets[i];
+		if (n > rank) {
+			if (i < (1 << LAT_SUB_BITS))
+				return i + 1;
+
+			int shift = (i >> LAT_SUB_BITS) - 1;
+			u64 upper = (u64)((1 << LAT_SUB_BITS) + (i & ((1 << LAT_SUB_BITS) - 1)) + 1) << shift;
+			return upper < h->max ? upper : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+static void latency_write(FILE *fp, struct latency_hist *lat)
+{
+	fprintf(fp, "# HELP ustack_latency_ns Latency from receiving the frame to "
+			"reaching the stage.\n");
+	fprintf(fp, "# TYPE ustack_latency_ns summary\n");
+	for (int i = 0; i < NR_LAT_STAGES; i++) {
+		struct latency_hist *h = &lat[i];
+		for (int j = 0; j < sizeof(latency_quantiles) / sizeof(double); j++)
+			fprintf(fp, "ustack_latency_ns{stage=\"%s\",quantile=\"%g\"} %.0f\n", \
+					latency_stage_str[i], latency_quantiles[j], \
+					h->count ? latency_quantile(h, latency_quantiles[j]) / tsc_per_ns : 0);
+		fprintf(fp, "ustack_latency_ns_sum{stage=\"%s\"} %.0f\n", \
+				latency_stage_str[i], h->sum / tsc_per_ns);
+		fprintf(fp, "ustack_latency_ns_count{stage=\"%s\"} %lu\n", \
+				latency_stage_str[i], h->count);
+	}
+
+	fprintf(fp, "# HELP ustack_latency_max_ns Max latency from receiving the "
+			"frame to reaching the stage.\n");
+	fprintf(fp, "# TYPE ustack_latency_max_ns gauge\n");
+	for (int i = 0; i < NR_LAT_STAGES; i++)
+		fprintf(fp, "ustack_latency_max_ns{stage=\"%s\"} %.0f\n", \
+				latency_stage_str[i], lat[i].max / tsc_per_ns);
+}
+
+// memory of the arenas, with the resident part counted by mincore
+static void arena_write(FILE *fp)
+{
+	fprintf(fp, "# HELP ustack_arena_bytes Memory of the arenas, by subsystem.\n");
+	fprintf(fp, "# TYPE ustack_arena_bytes gauge\n");
+	for (struct arena *arena = arena_list(); arena; arena = arena->next) {
+		const char *backing = arena_backing_str(arena->backing);
+		fprintf(fp, "ustack_arena_bytes{arena=\"%s\",backing=\"%s\","
+				"state=\"reserved\"} %zu\n", arena->name, backing, arena->size);
+		fprintf(fp, "ustack_arena_bytes{arena=\"%s\",backing=\"%s\","
+				"state=\"used\"} %zu\n", arena->name, backing, arena->used);
+		fprintf(fp, "ustack_arena_bytes{arena=\"%s\",backing=\"%s\","
+				"state=\"resident\"} %zu\n", arena->name, backing, arena_resident(arena));
+	}
+}
+
+// write all the counters in the Prometheus text format
+static void metrics_write(FILE *fp)
+{
+	struct metrics_block *sum = new_metrics_block();
+	if (!sum)
+		return ;
+	metrics_collect(sum);
+
+	IFACE_COUNTER(fp, sum, rx_packets, "Packets received on the interface.");
+	IFACE_COUNTER(fp, sum, rx_bytes, "Bytes received on the interface.");
+	IFACE_COUNTER(fp, sum, tx_packets, "Packets sent on the interface.");
+	IFACE_COUNTER(fp, sum, tx_bytes, "Bytes sent on the interface.");
+
+	fprintf(fp, "# HELP ustack_drops_total Packets dropped, by reason.\n");
+	fprintf(fp, "# TYPE ustack_drops_total counter\n");
+	for (int i = 0; i < NR_DROP_REASONS; i++)
+		fprintf(fp, "ustack_drops_total{reason=\"%s\"} %lu\n", \
+				drop_reason_str[i], sum->drops[i]);
+
+	fprintf(fp, "# HELP ustack_rx_polls_total Iterations of the receiving loops.\n");
+	fprintf(fp, "# TYPE ustack_rx_polls_total counter\n");
+	fprintf(fp, "ustack_rx_polls_total %lu\n", sum->polls);
+	fprintf(fp, "# HELP ustack_rx_empty_polls_total Iterations of the receiving "
+			"loops which found no packet.\n");
+	fprintf(fp, "# TYPE ustack_rx_empty_polls_total counter\n");
+	fprintf(fp, "ustack_rx_empty_polls_total %lu\n", sum->empty_polls);
+
+	if (sum->lat)
+		latency_write(fp, sum->lat);
+
+	arena_write(fp);
+
+	free_metrics_block(sum);
+}
+
+// serve one client: the counters are written as they are, or as an HTTP
+// response if the client sends an HTTP request (e.g. curl --unix-socket)
+static void metrics_serve(int cfd)
+{
+	char req[1024];
+	int http = 0;
+
+	struct pollfd pfd = { .fd = cfd, .events = POLLIN };
+	if (poll(&pfd, 1, METRICS_REQ_TIMEOUT) > 0) {
+		int n = recv(cfd, req, sizeof(req) - 1, 0);
+		if (n > 4 && strncmp(req, "GET ", 4) == 0)
+			http = 1;
+	}
+
+	char *body = NULL;
+	size_t body_len = 0;
+	FILE *fp = open_memstream(&body, &body_len);
+	if (!fp)
+		return ;
+	metrics_write(fp);
+	fclose(fp);
+
+	char hdr[128];
+	int hdr_len = 0;
+	if (http)
+		hdr_len = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: %lu\r\n\r\n", body_len);
+
+	if (hdr_len > 0)
+		send(cfd, hdr, hdr_len, MSG_NOSIGNAL);
+	for (size_t off = 0; off < body_len; ) {
+		int n = send(cfd, body + off, body_len - off, MSG_NOSIGNAL);
+		if (n <= 0)
+			break;
+		off += n;
+	}
+
+	free(body);
+}
+
+static void *metrics_server(void *arg)
+{
+	int sfd = (int)(long)arg;
+
+	while (1) {
+		int cfd = accept(sfd, NULL, NULL);
+		if (cfd < 0) {
+			if (errno == EINTR)
+				continue;
+			log(ERROR, "accept metrics client failed: %s", strerror(errno));
+			break;
+		}
+
+		metrics_serve(cfd);
+		close(cfd);
+	}
+
+	return NULL;
+}
+
+// export the counters on the unix socket of USTACK_METRICS
+static void metrics_socket_init()
+{
+	char *path = getenv("USTACK_METRICS");
+	if (!path || !*path)
+		return ;
+
+	struct sockaddr_un addr;
+	bzero(&addr, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		log(ERROR, "metrics socket path %s is too long.", path);
+		exit(1);
+	}
+	strcpy(addr.sun_path, path);
+
+	int sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sfd < 0) {
+		perror("Create metrics socket failed");
+		exit(1);
+	}
+
+	unlink(path);
+	if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || \
+			listen(sfd, 16) < 0) {
+		perror("Bind metrics socket failed");
+		exit(1);
+	}
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, metrics_server, (void *)(long)sfd) != 0) {
+		log(ERROR, "could not create metrics thread.");
+		exit(1);
+	}
+	pthread_detach(thread);
+
+	log(DEBUG, "export metrics on %s.", path);
+}
+
+// measure the TSC frequency against the monotonic clock
+static void calibrate_tsc()
+{
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	u64 tsc0 = read_tsc();
+	usleep(TSC_CALIBRATE_TIME);
+	u64 tsc1 = read_tsc();
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+	if (ns > 0 && tsc1 > tsc0)
+		tsc_per_ns = (tsc1 - tsc0) / ns;
+}
+
+static void latency_signal_handler(int sig)
+{
+	// only async-signal-safe calls here, the dump is done by latency_dumper
+	char c = 0;
+	if (write(dump_pipe[1], &c, 1) < 0)
+		return ;
+}
+
+static void *latency_dumper(void *arg)
+{
+	char c;
+	while (read(dump_pipe[0], &c, 1) > 0 || errno == EINTR) {
+		metrics_write(stderr);
+		fflush(stderr);
+	}
+
+	return NULL;
+}
+
+// USTACK_LATENCY=N records the latency histograms of the pipeline stages for
+// one of every N frames (1 for all the frames), which are dumped to stderr on
+// SIGUSR1, and exported with the counters
+static void latency_init()
+{
+	char *env = getenv("USTACK_LATENCY");
+	if (!env || atoi(env) <= 0)
+		return ;
+
+	calibrate_tsc();
+
+	if (pipe(dump_pipe) < 0) {
+		perror("Create latency dump pipe failed");
+		exit(1);
+	}
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, latency_dumper, NULL) != 0) {
+		log(ERROR, "could not create latency dump thread.");
+		exit(1);
+	}
+	pthread_detach(thread);
+
+	struct sigaction sa;
+	bzero(&sa, sizeof(sa));
+	sa.sa_handler = latency_signal_handler;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	latency_sample = atoi(env);
+	log(DEBUG, "record latency of 1/%d frames, %.3f cycles/ns, dump on SIGUSR1.", \
+			latency_sample, tsc_per_ns);
+}
+
+// USTACK_METRICS=PATH exports the counters on the unix socket PATH, e.g.
+// `socat - UNIX-CONNECT:PATH` or `curl --unix-socket PATH http://localhost/`
+void metrics_init()
+{
+	latency_init();
+	metrics_socket_init();
+}
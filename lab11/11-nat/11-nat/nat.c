@@ -4,16 +4,119 @@
 #include "tcp.h"
 #include "rtable.h"
 #include "log.h"
+#include "packet_pool.h"
+#include "metrics.h"
+#include "timer.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <signal.h>
 
 #define MAX_LINE_LEN 100
 
 static struct nat_table nat;
 
+static void nat_mapping_expired(void *arg);
+static int is_flow_finished(struct nat_connection *conn);
+
+// key of the mappings, ip and port are the external ones for DIR_IN, or the
+// internal ones for DIR_OUT
+struct nat_key {
+	u32 remote_ip;
+	u32 ip;
+	u16 remote_port;
+	u16 port;
+};
+
+static u64 nat_key_hash(u32 remote_ip, u16 remote_port, u32 ip, u16 port)
+{
+	struct nat_key key = {
+		.remote_ip = remote_ip,
+		.ip = ip,
+		.remote_port = remote_port,
+		.port = port,
+	};
+	return htable_hash(&key, sizeof(key));
+}
+
+static int nat_mapping_eq_in(const void *entry, const void *key)
+{
+	const struct nat_mapping *m = entry;
+	const struct nat_key *k = key;
+	return m->remote_ip == k->remote_ip && m->remote_port == k->remote_port && \
+		m->external_ip == k->ip && m->external_port == k->port;
+}
+
+static int nat_mapping_eq_out(const void *entry, const void *key)
+{
+	const struct nat_mapping *m = entry;
+	const struct nat_key *k = key;
+	return m->remote_ip == k->remote_ip && m->remote_port == k->remote_port && \
+		m->internal_ip == k->ip && m->internal_port == k->port;
+}
+
+// allocate a zeroed mapping, with nat lock held
+//
+// The mappings are carved from the arena of nat, and are never returned to 
+// the system: the freed ones are kept in a free list for the next ones.
+static struct nat_mapping *nat_alloc_mapping()
+{
+	struct nat_mapping *entry = nat.free_mappings;
+	if (entry) {
+		nat.free_mappings = entry->next_free;
+		memset(entry, 0, sizeof(struct nat_mapping));
+		return entry;
+	}
+
+	entry = arena_alloc(nat.arena, sizeof(struct nat_mapping), \
+			__alignof__(struct nat_mapping));
+	if (!entry)
+		entry = calloc(1, sizeof(struct nat_mapping));
+
+	return entry;
+}
+
+// put the mapping into the free list, with nat lock held
+static void nat_free_mapping(struct nat_mapping *entry)
+{
+	entry->next_free = nat.free_mappings;
+	nat.free_mappings = entry;
+}
+
+// remove the mapping from both tables and free its port, with nat lock held
+static void nat_unhash_mapping(struct nat_mapping *entry)
+{
+	nat.assigned_ports[entry->external_port] = 0;
+	htable_remove(&nat.mapping_in, nat_key_hash(entry->remote_ip, \
+				entry->remote_port, entry->external_ip, entry->external_port), entry);
+	htable_remove(&nat.mapping_out, nat_key_hash(entry->remote_ip, \
+				entry->remote_port, entry->internal_ip, entry->internal_port), entry);
+}
+
+// remove the mapping, with nat lock held
+static void nat_remove_mapping(struct nat_mapping *entry)
+{
+	nat_unhash_mapping(entry);
+	// the timer is running, which frees the entry then
+	if (del_timer(&entry->timer))
+		nat_free_mapping(entry);
+	else
+		entry->removed = 1;
+}
+
+// hash the new mapping into both tables, and arm its timer
+static void nat_start_mapping(struct nat_mapping *entry)
+{
+	htable_insert(&nat.mapping_in, nat_key_hash(entry->remote_ip, \
+				entry->remote_port, entry->external_ip, entry->external_port), entry);
+	htable_insert(&nat.mapping_out, nat_key_hash(entry->remote_ip, \
+				entry->remote_port, entry->internal_ip, entry->internal_port), entry);
+
+	entry->removed = 0;
+	init_timer(&entry->timer, nat_mapping_expired, entry);
+	mod_timer(&entry->timer, (TCP_ESTABLISHED_TIMEOUT + 1) * 1000);
+}
+
 // get the interface from iface name
 static iface_info_t *if_name_to_iface(char *if_name)
 {
@@ -54,13 +157,15 @@ static int get_packet_direction(char *packet)
 	struct iphdr *ip = packet_to_ip_hdr(packet);
 	u32 saddr = ntohl(ip->saddr);
 	u32 daddr = ntohl(ip->daddr);
-	rt_entry_t *src_entry = longest_prefix_match(saddr);
-	rt_entry_t *dst_entry = longest_prefix_match(daddr);
+	rcu_read_lock();
+	iface_info_t *src_iface = longest_prefix_match(saddr)->iface;
+	iface_info_t *dst_iface = longest_prefix_match(daddr)->iface;
+	rcu_read_unlock();
 
-	if ((src_entry->iface == nat.internal_iface) && (dst_entry->iface == nat.external_iface)) {
+	if ((src_iface == nat.internal_iface) && (dst_iface == nat.external_iface)) {
 		return DIR_OUT;
 	}
-	else if ((src_entry->iface == nat.external_iface) && (daddr == nat.external_iface->ip)) {
+	else if ((src_iface == nat.external_iface) && (daddr == nat.external_iface->ip)) {
 		return DIR_IN;
 	}
 	else{
@@ -68,16 +173,6 @@ static int get_packet_direction(char *packet)
 	}
 }
 
-static u8 rmt_hash(u32 addr, u16 port) {
-    char str[6];
-    memset(str, 0, 6 * sizeof(char));
-    memcpy(str, &addr, sizeof(u32));
-    memcpy(str + 4, &port, sizeof(u16));
-
-	u8 res = hash8(str, 6);
-    return res;
-}
-
 // do translation for the packet: replace the ip/port, recalculate ip & tcp
 // checksum, update the statistics of the tcp connection
 void do_translation(iface_info_t *iface, char *packet, int len, int dir)
@@ -93,22 +188,25 @@ void do_translation(iface_info_t *iface, char *packet, int len, int dir)
     u16 dport = ntohs(tcphdr->dport);
     u16 rport = (dir == DIR_IN) ? sport : dport;
 
-    u8 idx = rmt_hash(raddr, rport);
-    struct list_head *head = &nat.nat_mapping_list[idx];
+    struct nat_key key = {
+        .remote_ip = raddr,
+        .ip = (dir == DIR_IN) ? daddr : saddr,
+        .remote_port = rport,
+        .port = (dir == DIR_IN) ? dport : sport,
+    };
+    u64 hash = htable_hash(&key, sizeof(key));
     struct nat_mapping *entry;
 
     pthread_mutex_lock(&nat.lock);
-    list_for_each_entry(entry, head, list) {
-        if (raddr != entry->remote_ip || rport != entry->remote_port){
-			continue;
-		}
+    if (dir == DIR_IN)
+        entry = htable_lookup(&nat.mapping_in, hash, &key, nat_mapping_eq_in);
+    else
+        entry = htable_lookup(&nat.mapping_out, hash, &key, nat_mapping_eq_out);
 
+    if (entry) {
 		int clear = (tcphdr->flags & TCP_RST) ? 1 : 0;
 
         if (dir == DIR_IN) {
-            if (daddr != entry->external_ip || dport != entry->external_port){
-				continue;
-			}
             iphdr->daddr = htonl(entry->internal_ip);
             tcphdr->dport = htons(entry->internal_port);
 
@@ -119,9 +217,6 @@ void do_translation(iface_info_t *iface, char *packet, int len, int dir)
 			}
         } 
 		else {
-            if (saddr != entry->internal_ip || sport != entry->internal_port){
-				 continue;
-			}
             iphdr->saddr = htonl(entry->external_ip);
             tcphdr->sport = htons(entry->external_port);
             entry->conn.internal_fin = (tcphdr->flags & TCP_FIN) ? 1 : 0;
@@ -131,25 +226,25 @@ void do_translation(iface_info_t *iface, char *packet, int len, int dir)
 			}
         }
 
+		entry->update_time = timer_now() / 1000;
+		if (clear)
+			nat_remove_mapping(entry);
+		else if (is_flow_finished(&entry->conn))
+			mod_timer_pending(&entry->timer, NAT_FINISHED_TIMEOUT * 1000);
+
         pthread_mutex_unlock(&nat.lock);
 
-		entry->update_time = time(NULL);
         tcphdr->checksum = tcp_checksum(iphdr, tcphdr);
         iphdr->checksum = ip_checksum(iphdr);
         ip_send_packet(packet, len);
-
-		if (clear) {
-			nat.assigned_ports[entry->external_port] = 0;
-			list_delete_entry(&(entry->list));
-			free(entry);
-		}
         return;
     }
 
 	if ((tcphdr->flags & TCP_SYN) == 0) {
         fprintf(stderr, "Invalid packet!\n");
+        metrics_drop(DROP_NAT_NO_MAPPING);
         icmp_send_packet(packet, len, ICMP_DEST_UNREACH, ICMP_HOST_UNREACH);
-        free(packet);
+        packet_free(packet);
         pthread_mutex_unlock(&nat.lock);
         return;
     }
@@ -158,8 +253,7 @@ void do_translation(iface_info_t *iface, char *packet, int len, int dir)
 		struct dnat_rule *rule;
         list_for_each_entry(rule, &nat.rules, list) {
             if (daddr == rule->external_ip && dport == rule->external_port) {
-                struct nat_mapping *new_entry = (struct nat_mapping *) malloc(sizeof(struct nat_mapping));
-                list_add_tail(&new_entry->list, head);
+                struct nat_mapping *new_entry = nat_alloc_mapping();
 
                 new_entry->remote_ip = raddr;
                 new_entry->remote_port = rport;
@@ -172,7 +266,8 @@ void do_translation(iface_info_t *iface, char *packet, int len, int dir)
                 new_entry->conn.external_seq_end = tcp_seq_end(iphdr, tcphdr);
                 if (tcphdr->flags & TCP_ACK) new_entry->conn.external_ack = tcphdr->ack;
 
-                new_entry->update_time = time(NULL);
+                new_entry->update_time = timer_now() / 1000;
+                nat_start_mapping(new_entry);
                 pthread_mutex_unlock(&nat.lock);
 
                 iphdr->daddr = htonl(rule->internal_ip);
@@ -188,13 +283,13 @@ void do_translation(iface_info_t *iface, char *packet, int len, int dir)
         u16 pid;
         for (pid = NAT_PORT_MIN; pid <= NAT_PORT_MAX; ++pid) {
             if (!nat.assigned_ports[pid]) {
-                struct nat_mapping *new_entry = (struct nat_mapping *) malloc(sizeof(struct nat_mapping));
-                list_add_tail(&new_entry->list, head);
+                struct nat_mapping *new_entry = nat_alloc_mapping();
 
                 new_entry->remote_ip = raddr;
                 new_entry->remote_port = rport;
                 new_entry->external_ip = nat.external_iface->ip;
                 new_entry->external_port = pid;
+                nat.assigned_ports[pid] = 1;
                 new_entry->internal_ip = saddr;
                 new_entry->internal_port = sport;
 
@@ -204,7 +299,8 @@ void do_translation(iface_info_t *iface, char *packet, int len, int dir)
 					new_entry->conn.internal_ack = tcphdr->ack;
 				}
 
-                new_entry->update_time = time(NULL);
+                new_entry->update_time = timer_now() / 1000;
+                nat_start_mapping(new_entry);
                 pthread_mutex_unlock(&nat.lock);
 
                 iphdr->saddr = htonl(new_entry->external_ip);
@@ -218,8 +314,9 @@ void do_translation(iface_info_t *iface, char *packet, int len, int dir)
     }
 
     log(DEBUG, "No available port!\n");
+    metrics_drop(DROP_NAT_NO_PORT);
     icmp_send_packet(packet, len, ICMP_DEST_UNREACH, ICMP_HOST_UNREACH);
-    free(packet);
+    packet_free(packet);
 }
 
 void nat_translate_packet(iface_info_t *iface, char *packet, int len)
@@ -227,15 +324,17 @@ void nat_translate_packet(iface_info_t *iface, char *packet, int len)
 	int dir = get_packet_direction(packet);
 	if (dir == DIR_INVALID) {
 		log(ERROR, "invalid packet direction, drop it.");
+		metrics_drop(DROP_NAT_INVALID_DIR);
 		icmp_send_packet(packet, len, ICMP_DEST_UNREACH, ICMP_HOST_UNREACH);
-		free(packet);
+		packet_free(packet);
 		return ;
 	}
 
 	struct iphdr *ip = packet_to_ip_hdr(packet);
 	if (ip->protocol != IPPROTO_TCP) {
 		log(ERROR, "received non-TCP packet (0x%0hhx), drop it", ip->protocol);
-		free(packet);
+		metrics_drop(DROP_UNKNOWN_PROTO);
+		packet_free(packet);
 		return ;
 	}
 
@@ -251,32 +350,35 @@ static int is_flow_finished(struct nat_connection *conn)
             (conn->external_ack >= conn->internal_seq_end);
 }
 
-// nat timeout thread: find the finished flows, remove them and free port
-// resource
-void *nat_timeout()
+// the mapping has not been used for TCP_ESTABLISHED_TIMEOUT seconds (when the
+// timer was armed), or the flow is finished: remove it and free the port
+//
+// The timer is not re-armed by each packet, instead the idle time is checked
+// here, and the timer is armed again for the rest of the timeout if used.
+static void nat_mapping_expired(void *arg)
 {
-	while (1) {
-		//fprintf(stdout, "TODO: sweep finished flows periodically.\n");
-		sleep(1);
-		pthread_mutex_lock(&nat.lock);
-		time_t now = time(NULL);
-
-		for (int i = 0;i < HASH_8BITS;i++) {
-			struct nat_mapping *map_entry = NULL, *map_q = NULL;
-			list_for_each_entry_safe(map_entry, map_q, &(nat.nat_mapping_list[i]), list) {
-				if ((now - map_entry->update_time > TCP_ESTABLISHED_TIMEOUT) || is_flow_finished(&(map_entry->conn))) {
-					log(DEBUG, "remove map entry, port: %d\n", map_entry->external_port);
-					nat.assigned_ports[map_entry->external_port] = 0;
-					list_delete_entry(&(map_entry->list));
-					free(map_entry);
-				}
-			}
-		}
+	struct nat_mapping *entry = arg;
 
+	pthread_mutex_lock(&nat.lock);
+
+	// removed while the timer is running
+	if (entry->removed) {
+		nat_free_mapping(entry);
 		pthread_mutex_unlock(&nat.lock);
+		return ;
 	}
 
-	return NULL;
+	int idle = (int)(timer_now() / 1000 - entry->update_time);
+	if (idle > TCP_ESTABLISHED_TIMEOUT || is_flow_finished(&(entry->conn))) {
+		log(DEBUG, "remove map entry, port: %d\n", entry->external_port);
+		nat_unhash_mapping(entry);
+		nat_free_mapping(entry);
+	}
+	else {
+		mod_timer(&entry->timer, (TCP_ESTABLISHED_TIMEOUT + 1 - idle) * 1000);
+	}
+
+	pthread_mutex_unlock(&nat.lock);
 }
 
 int parse_config(const char *filename)
@@ -350,31 +452,32 @@ void nat_init(const char *config_file)
 {
 	memset(&nat, 0, sizeof(nat));
 
-	for (int i = 0; i < HASH_8BITS; i++)
-		init_list_head(&nat.nat_mapping_list[i]);
+	htable_init(&nat.mapping_in);
+	htable_init(&nat.mapping_out);
 
 	init_list_head(&nat.rules);
 
-	// seems unnecessary
-	memset(nat.assigned_ports, 0, sizeof(nat.assigned_ports));
+	// the memory of arena is zeroed
+	nat.arena = arena_create("nat", NAT_ARENA_SIZE);
+	nat.assigned_ports = arena_alloc(nat.arena, 65536, 64);
+	if (!nat.assigned_ports)
+		nat.assigned_ports = calloc(65536, sizeof(u8));
 
 	parse_config(config_file);
 
 	pthread_mutex_init(&nat.lock, NULL);
-
-	pthread_create(&nat.thread, NULL, nat_timeout, NULL);
 }
 
 void nat_exit()
 {
 	//fprintf(stdout, "TODO: release all resources allocated.\n");
-	for (int i = 0;i < HASH_8BITS;i++) {
-		struct nat_mapping *map_entry = NULL, *map_q = NULL;
-		list_for_each_entry_safe(map_entry, map_q, &(nat.nat_mapping_list[i]), list) {
-			list_delete_entry(&(map_entry->list));
-			free(map_entry);
-		}
+	struct nat_mapping *map_entry = NULL;
+	u64 pos;
+	htable_for_each(&nat.mapping_out, pos, map_entry) {
+		nat_remove_mapping(map_entry);
 	}
+	htable_destroy(&nat.mapping_in);
+	htable_destroy(&nat.mapping_out);
 
 	struct dnat_rule *rule = NULL, *rule_q = NULL;
 	list_for_each_entry_safe(rule, rule_q, &nat.rules, list) {
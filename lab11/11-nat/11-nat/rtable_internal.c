@@ -1,4 +1,5 @@
 #include "rtable.h"
+#include "vdev.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,38 +26,6 @@ typedef struct {
 // need to understand how it works, but only trust it will process like the function
 // name indicates.
 
-static void if_index_to_name(int if_index, char *if_name)
-{
-	int fd = socket(AF_INET, SOCK_DGRAM, 0); 
-	if (fd == -1) {
-		perror("Create socket failed.");
-		exit(-1);
-	}
-
-	struct ifreq ifr;
-	ifr.ifr_ifindex = if_index;
-
-	if (ioctl(fd, SIOCGIFNAME, &ifr, sizeof(ifr))) {
-		perror("Get interface name failed.");
-		exit(-1);
-	}
-
-	strcpy(if_name, ifr.ifr_name);
-}
-
-static iface_info_t *if_name_to_iface(const char *if_name)
-{
-	iface_info_t *iface = NULL;
-	list_for_each_entry(iface, &instance->iface_list, list) {
-		if (strcmp(iface->name, if_name) == 0)
-			return iface;
-	}
-
-	fprintf(stderr, "Could not find the desired interface "
-			"according to if_name '%s'\n", if_name);
-	return NULL;
-}
-
 static int get_unparsed_route_info(char *buf, int size)
 {
 	int fd = socket(PF_NETLINK, SOCK_RAW, NETLINK_ROUTE); 
@@ -124,7 +93,7 @@ static int parse_routing_info(char *buf, int len)
 
 		u32 dest = 0, mask = 0, gw = 0;
 		int flags = 0;
-		char if_name[16];
+		int if_index = 0;
 
 		// Inner loop: iterate all the attributes of one route entry
 		struct rtattr *rtap = (struct rtattr *)RTM_RTA(rtp);
@@ -143,7 +112,7 @@ static int parse_routing_info(char *buf, int len)
 					// tmp_entry.addr = *(u32 *)RTA_DATA(rtap);
 					break;
 				case RTA_OIF:
-					if_index_to_name(*((int *) RTA_DATA(rtap)), if_name);
+					if_index = *((int *) RTA_DATA(rtap));
 					break;
 				default:
 					break;
@@ -156,7 +125,7 @@ static int parse_routing_info(char *buf, int len)
 		if (mask == (u32)(-1))
 			flags |= RTF_HOST; 
 
-		iface_info_t *iface = if_name_to_iface(if_name);
+		iface_info_t *iface = ifindex_to_iface(if_index);
 		if (iface) {
 			// the desired interface
 			rt_entry_t *entry = new_rt_entry(dest, mask, gw, iface);
@@ -169,11 +138,40 @@ static int parse_routing_info(char *buf, int len)
 	return n;
 }
 
+// virtual interfaces have no routes in the kernel, the routes are derived
+// from their configuration: the directly connected networks, and the default
+// route if the gateway is set
+static int load_rtable_from_vdev()
+{
+	int n = 0;
+	iface_info_t *iface = NULL;
+	list_for_each_entry(iface, &instance->iface_list, list) {
+		if (iface->mask) {
+			add_rt_entry(new_rt_entry(iface->ip & iface->mask, iface->mask, 0, iface));
+			n += 1;
+		}
+		if (iface->vdev->gw) {
+			add_rt_entry(new_rt_entry(0, 0, iface->vdev->gw, iface));
+			n += 1;
+		}
+	}
+
+	return n;
+}
+
 void load_rtable_from_kernel()
 {
+	if (instance->vdev) {
+		int n = load_rtable_from_vdev();
+		publish_rtable();
+		fprintf(stdout, "Routing table of %d entries has been loaded.\n", n);
+		return ;
+	}
+
 	char buf[ROUTE_BATCH_SIZE];
 	int len = get_unparsed_route_info(buf, ROUTE_BATCH_SIZE);
 	int n = parse_routing_info(buf, len);
+	publish_rtable();
 
 	fprintf(stdout, "Routing table of %d entries has been loaded.\n", n);
 }
@@ -2,16 +2,51 @@
 #include "arp.h"
 #include "ether.h"
 #include "icmp.h"
+#include "packet_pool.h"
+#include "timer.h"
+#include "metrics.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <signal.h>
 
 static arpcache_t arpcache;
 
-// initialize IP->mac mapping, request list, lock and sweeping thread
+static void arpcache_entry_expired(void *arg);
+static void arpcache_req_expired(void *arg);
+
+static void arpcache_free_entry(struct rcu_head *head)
+{
+	free(list_entry(head, struct arp_cache_entry, rcu));
+}
+
+// remove the entry in the slot, which is freed after the lookups seeing it
+static void arpcache_unpublish(struct arp_cache_slot *slot)
+{
+	struct arp_cache_entry *entry = slot->entry;
+	if (!entry)
+		return ;
+
+	rcu_assign_pointer(slot->entry, NULL);
+	call_rcu(&entry->rcu, arpcache_free_entry);
+}
+
+// replace the entry in the slot with a new mapping, the entries published are
+// never changed, so that a lookup never sees a partly updated one
+static void arpcache_publish(struct arp_cache_slot *slot, u32 ip4, u8 mac[ETH_ALEN])
+{
+	struct arp_cache_entry *entry = malloc(sizeof(struct arp_cache_entry));
+	entry->ip4 = ip4;
+	memcpy(entry->mac, mac, ETH_ALEN);
+
+	struct arp_cache_entry *old = slot->entry;
+	rcu_assign_pointer(slot->entry, entry);
+	if (old)
+		call_rcu(&old->rcu, arpcache_free_entry);
+}
+
+// initialize IP->mac mapping, request list, lock and the timers of entries
 void arpcache_init()
 {
 	bzero(&arpcache, sizeof(arpcache_t));
@@ -20,7 +55,9 @@ void arpcache_init()
 
 	pthread_mutex_init(&arpcache.lock, NULL);
 
-	pthread_create(&arpcache.thread, NULL, arpcache_sweep, NULL);
+	for (int i = 0; i < MAX_ARP_SIZE; i++)
+		init_timer(&arpcache.slots[i].timer, arpcache_entry_expired, \
+				&arpcache.slots[i]);
 }
 
 // release all the resources when exiting
@@ -33,15 +70,21 @@ void arpcache_destroy()
 		struct cached_pkt *pkt_entry = NULL, *pkt_q;
 		list_for_each_entry_safe(pkt_entry, pkt_q, &(req_entry->cached_packets), list) {
 			list_delete_entry(&(pkt_entry->list));
-			free(pkt_entry->packet);
+			packet_free(pkt_entry->packet);
 			free(pkt_entry);
 		}
 
 		list_delete_entry(&(req_entry->list));
-		free(req_entry);
+		if (del_timer(&req_entry->timer))
+			free(req_entry);
+		else
+			req_entry->answered = 1;
 	}
 
-	pthread_kill(arpcache.thread, SIGTERM);
+	for (int i = 0; i < MAX_ARP_SIZE; i++) {
+		del_timer(&arpcache.slots[i].timer);
+		arpcache_unpublish(&arpcache.slots[i]);
+	}
 
 	pthread_mutex_unlock(&arpcache.lock);
 }
@@ -50,20 +93,25 @@ void arpcache_destroy()
 //
 // traverse the table to find whether there is an entry with the same IP
 // and mac address with the given arguments
+//
+// The entries are looked up without lock: each of them is published as a
+// whole, and freed only after a grace period once unpublished.
 int arpcache_lookup(u32 ip4, u8 mac[ETH_ALEN])
 {
 	//fprintf(stderr, "TODO: lookup ip address in arp cache.\n");
 
-	pthread_mutex_lock(&arpcache.lock);
+	int found = 0;
+	rcu_read_lock();
 	for(int i = 0;i < MAX_ARP_SIZE;i++){
-		if(arpcache.entries[i].valid && arpcache.entries[i].ip4 == ip4){
-			memcpy(mac, arpcache.entries[i].mac, ETH_ALEN);
-			pthread_mutex_unlock(&arpcache.lock);
-			return 1;
+		struct arp_cache_entry *entry = rcu_dereference(arpcache.slots[i].entry);
+		if(entry && entry->ip4 == ip4){
+			memcpy(mac, entry->mac, ETH_ALEN);
+			found = 1;
+			break;
 		}
 	}
-	pthread_mutex_unlock(&arpcache.lock);
-	return 0;
+	rcu_read_unlock();
+	return found;
 }
 
 // append the packet to arpcache
@@ -98,10 +146,12 @@ void arpcache_append_packet(iface_info_t *iface, u32 ip4, char *packet, int len)
 	init_list_head(&(req_entry->list));
 	req_entry->iface = iface;
 	req_entry->ip4 = ip4;
-	req_entry->sent = time(NULL);
 	req_entry->retries = 0;
+	req_entry->answered = 0;
 	init_list_head(&(req_entry->cached_packets));
 	list_add_tail(&req_entry->list, &(arpcache.req_list));
+	init_timer(&req_entry->timer, arpcache_req_expired, req_entry);
+	mod_timer(&req_entry->timer, ARP_REQUEST_INTERVAL * 1000);
 
 	struct cached_pkt *pkt = (struct cached_pkt *)malloc(sizeof(struct cached_pkt));
 	pkt->packet = packet;
@@ -121,11 +171,14 @@ void arpcache_insert(u32 ip4, u8 mac[ETH_ALEN])
 	//fprintf(stderr, "TODO: insert ip->mac entry, and send all the pending packets.\n");
 	pthread_mutex_lock(&arpcache.lock);
 	int i;
+	struct arp_cache_slot *slot;
 	for(i = 0;i < MAX_ARP_SIZE;i++){
 		// if the mapping of ip to mac already exist, update
-		if(arpcache.entries[i].valid && arpcache.entries[i].ip4 == ip4){ 
-			arpcache.entries[i].added = time(NULL);
-			memcpy(arpcache.entries[i].mac, mac, ETH_ALEN);
+		slot = &arpcache.slots[i];
+		if(slot->entry && slot->entry->ip4 == ip4){ 
+			mod_timer(&slot->timer, ARP_ENTRY_TIMEOUT * 1000);
+			if(memcmp(slot->entry->mac, mac, ETH_ALEN) != 0)
+				arpcache_publish(slot, ip4, mac);
 			pthread_mutex_unlock(&arpcache.lock);
 			return;
 		}
@@ -133,7 +186,7 @@ void arpcache_insert(u32 ip4, u8 mac[ETH_ALEN])
 
 	//find an empty entry
 	for(i = 0;i < MAX_ARP_SIZE;i++){
-		if(arpcache.entries[i].valid == 0){
+		if(arpcache.slots[i].entry == NULL){
 			break;
 		}
 	}
@@ -142,10 +195,9 @@ void arpcache_insert(u32 ip4, u8 mac[ETH_ALEN])
 		i = rand() % MAX_ARP_SIZE;
 	}
 	
-	arpcache.entries[i].valid = 1;
-	arpcache.entries[i].ip4 = ip4;
-	arpcache.entries[i].added = time(NULL);
-	memcpy(arpcache.entries[i].mac, mac, ETH_ALEN);
+	slot = &arpcache.slots[i];
+	mod_timer(&slot->timer, ARP_ENTRY_TIMEOUT * 1000);
+	arpcache_publish(slot, ip4, mac);
 
 	// send pending packets
 	struct arp_req *req_entry = NULL, *req_q;
@@ -160,7 +212,11 @@ void arpcache_insert(u32 ip4, u8 mac[ETH_ALEN])
 				free(pkt_entry);
 			}
 			list_delete_entry(&req_entry->list);
-			free(req_entry);
+			// the timer is running, which frees the request then
+			if (del_timer(&req_entry->timer))
+				free(req_entry);
+			else
+				req_entry->answered = 1;
 		}
 	}
 
@@ -168,60 +224,63 @@ void arpcache_insert(u32 ip4, u8 mac[ETH_ALEN])
 
 }
 
-// sweep arpcache periodically
+// the entry has been in the table for ARP_ENTRY_TIMEOUT seconds, remove it
+static void arpcache_entry_expired(void *arg)
+{
+	struct arp_cache_slot *slot = arg;
+
+	pthread_mutex_lock(&arpcache.lock);
+	// the entry could be refreshed while waiting for the lock
+	if (!timer_pending(&slot->timer))
+		arpcache_unpublish(slot);
+	pthread_mutex_unlock(&arpcache.lock);
+}
+
+// the arp request is sent out ARP_REQUEST_INTERVAL seconds ago, while the reply
+// has not been received
 //
-// For the IP->mac entry, if the entry has been in the table for more than 15
-// seconds, remove it from the table.
-// For the pending packets, if the arp request is sent out 1 second ago, while 
-// the reply has not been received, retransmit the arp request. If the arp
-// request has been sent 5 times without receiving arp reply, for each
-// pending packet, send icmp packet (DEST_HOST_UNREACHABLE), and drop these
-// packets.
-void *arpcache_sweep(void *arg) 
+// Retransmit the arp request. If the arp request has been sent 5 times without
+// receiving arp reply, for each pending packet, send icmp packet 
+// (DEST_HOST_UNREACHABLE), and drop these packets.
+static void arpcache_req_expired(void *arg)
 {
-	while (1) {
-		sleep(1);
-		pthread_mutex_lock(&arpcache.lock);
+	struct arp_req *req_entry = arg;
 
-		for (int i = 0; i < MAX_ARP_SIZE; i++) {
-			if ( arpcache.entries[i].valid && (time(NULL) - arpcache.entries[i].added > ARP_ENTRY_TIMEOUT) ) {
-				arpcache.entries[i].valid = 0;
-			}
-		}
+	pthread_mutex_lock(&arpcache.lock);
 
-		//For the pending packets
-		struct list_head temp_list;
-		init_list_head(&temp_list);
-
-		struct arp_req *req_entry = NULL, *req_q;
-		list_for_each_entry_safe(req_entry, req_q, &(arpcache.req_list), list) {
-			if (time(NULL) - req_entry->sent >= 1) {
-				req_entry->retries++;
-				req_entry->sent = time(NULL);
-				if(req_entry->retries > ARP_REQUEST_MAX_RETRIES){
-					struct cached_pkt *pkt_entry = NULL, *pkt_q;
-					//adding to temp_list to avoid deadlock
-					list_for_each_entry_safe(pkt_entry, pkt_q, &(req_entry->cached_packets), list) {
-						list_delete_entry(&pkt_entry->list);
-						list_add_tail(&pkt_entry->list, &temp_list);
-					}
-					list_delete_entry(&req_entry->list);
-					free(req_entry);
-				}
-				else{
-					arp_send_request(req_entry->iface, req_entry->ip4);
-				}
-			}
-		}
+	// answered while the timer is running
+	if (req_entry->answered) {
+		pthread_mutex_unlock(&arpcache.lock);
+		free(req_entry);
+		return ;
+	}
 
+	req_entry->retries++;
+	if (req_entry->retries <= ARP_REQUEST_MAX_RETRIES) {
+		mod_timer(&req_entry->timer, ARP_REQUEST_INTERVAL * 1000);
+		arp_send_request(req_entry->iface, req_entry->ip4);
 		pthread_mutex_unlock(&arpcache.lock);
+		return ;
+	}
 
-		struct cached_pkt *pkt_entry = NULL, *pkt_q;
-		list_for_each_entry_safe(pkt_entry, pkt_q, &temp_list, list){
-			icmp_send_packet(pkt_entry->packet, pkt_entry->len, ICMP_DEST_UNREACH, ICMP_HOST_UNREACH);
-			free(pkt_entry);
-		}
+	//adding to temp_list to avoid deadlock
+	struct list_head temp_list;
+	init_list_head(&temp_list);
+
+	struct cached_pkt *pkt_entry = NULL, *pkt_q;
+	list_for_each_entry_safe(pkt_entry, pkt_q, &(req_entry->cached_packets), list) {
+		list_delete_entry(&pkt_entry->list);
+		list_add_tail(&pkt_entry->list, &temp_list);
 	}
+	list_delete_entry(&req_entry->list);
+	free(req_entry);
 
-	return NULL;
+	pthread_mutex_unlock(&arpcache.lock);
+
+	list_for_each_entry_safe(pkt_entry, pkt_q, &temp_list, list){
+		metrics_drop(DROP_ARP_UNREACHABLE);
+		icmp_send_packet(pkt_entry->packet, pkt_entry->len, ICMP_DEST_UNREACH, ICMP_HOST_UNREACH);
+		packet_free(pkt_entry->packet);
+		free(pkt_entry);
+	}
 }
@@ -0,0 +1,573 @@
+// microbenchmarks of the primitives shared by the labs: checksum (with the
+// kernel picked by USTACK_CSUM), hash8 and hash16, the intrusive list, the
+// ring buffer, synch_wait, and htable
+//
+// Each benchmark is calibrated to run for at least the given time, and is
+// repeated BENCH_RUNS times, of which the median is reported in ns/op and TSC
+// cycles/op. The hardware counters (cycles, instructions, cache and branch
+// misses) are read by perf_event_open if the kernel permits, e.g. with
+// kernel.perf_event_paranoid <= 2, otherwise "counters" is null.
+//
+// usage: ./bench [-t ms] [filter], the results are written in JSON to stdout,
+// and only the benchmarks whose names contain filter are run. ./bench -c
+// checks the checksum kernels against the scalar reference instead.
+
+#include "types.h"
+#include "list.h"
+#include "hash.h"
+#include "checksum.h"
+#include "ring_buffer.h"
+#include "synch_wait.h"
+#include "htable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define BENCH_RUNS			5
+#define BENCH_MIN_TIME		100		// ms of each run by default
+#define NR_COUNTERS			4
+
+typedef void (*bench_func_t)(u64 iters);
+
+struct bench {
+	const char *name;
+	bench_func_t func;
+	int bytes;					// bytes processed by each op (0 if none)
+};
+
+static const char *counter_names[NR_COUNTERS] = {
+	"cycles", "instructions", "cache_misses", "branch_misses",
+};
+
+static const u64 counter_configs[NR_COUNTERS] = {
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_MISSES,
+	PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+static int perf_fds[NR_COUNTERS];
+static int perf_ok;
+
+static volatile u64 sink;		// results are folded in, not to be optimized out
+
+static u64 time_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline u64 rdtsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return time_ns();
+#endif
+}
+
+// open the counters of this thread in one group, which are read at once
+static void perf_init()
+{
+	perf_ok = 1;
+	for (int i = 0; i < NR_COUNTERS; i++) {
+		struct perf_event_attr attr;
+		bzero(&attr, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = counter_configs[i];
+		attr.disabled = (i == 0);
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP;
+
+		int group = (i == 0) ? -1 : perf_fds[0];
+		perf_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+		if (perf_fds[i] < 0) {
+			for (int j = 0; j < i; j++)
+				close(perf_fds[j]);
+			perf_ok = 0;
+			return ;
+		}
+	}
+}
+
+static void perf_start()
+{
+	if (!perf_ok)
+		return ;
+	ioctl(perf_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(perf_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static void perf_stop(u64 values[NR_COUNTERS])
+{
+	if (!perf_ok)
+		return ;
+	ioctl(perf_fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+	u64 buf[1 + NR_COUNTERS];
+	if (read(perf_fds[0], buf, sizeof(buf)) != sizeof(buf)) {
+		perf_ok = 0;
+		return ;
+	}
+	memcpy(values, buf + 1, sizeof(u64) * NR_COUNTERS);
+}
+
+// ---------------------------------------------------------------------------
+// checksum
+
+static char data[65536] __attribute__((aligned(64)));
+
+#define CHECKSUM_BENCH(len) \
+	static void bench_checksum_##len(u64 iters) \
+	{ \
+		u64 sum = 0; \
+		for (u64 i = 0; i < iters; i++) \
+			sum += checksum((u16 *)data, len, (u32)i); \
+		sink += sum; \
+	}
+
+CHECKSUM_BENCH(20)			// ip header
+CHECKSUM_BENCH(64)
+CHECKSUM_BENCH(1480)		// tcp segment of a full frame
+CHECKSUM_BENCH(16384)
+
+static char copy_buf[65536] __attribute__((aligned(64)));
+
+// copying the payload of a full frame, and summing it up in the same pass
+static void bench_csum_copy_1460(u64 iters)
+{
+	u64 sum = 0;
+	for (u64 i = 0; i < iters; i++)
+		sum += csum_partial_copy(copy_buf, data, 1460, (u32)i);
+	sink += sum;
+}
+
+// copying only, as the baseline of csum_partial_copy
+static void bench_memcpy_1460(u64 iters)
+{
+	for (u64 i = 0; i < iters; i++) {
+		memcpy(copy_buf, data, 1460);
+		__asm__ __volatile__("" : : "r"(copy_buf) : "memory");
+	}
+	sink += copy_buf[0];
+}
+
+// self-check of each checksum kernel supported by the cpu, against the sum
+// of 16-bit words that checksum() used to compute, over all the lengths up to
+// CHECK_MAX_LEN at each start offset of src and dst within a 64-bit word
+#define CHECK_MAX_LEN		2048
+
+static u16 csum_reference(const u8 *buf, int len, u32 sum)
+{
+	u64 s = sum;
+	for (; len >= 2; buf += 2, len -= 2) {
+		u16 v;
+		memcpy(&v, buf, 2);
+		s += v;
+	}
+	if (len)
+		s += *buf;
+	while (s >> 16)
+		s = (s >> 16) + (s & 0xffff);
+
+	return (u16)s;
+}
+
+static int check_checksum()
+{
+	static u8 dst[CHECK_MAX_LEN + 16];
+	int failed = 0;
+
+	for (int k = 0; k < csum_nr_kernels(); k++) {
+		int errors = 0;
+		// random bytes, and all ones to stress the carries
+		for (int fill = 0; fill < 2; fill++) {
+			for (int i = 0; i < CHECK_MAX_LEN + 16; i++)
+				data[i] = fill ? 0xff : rand();
+
+			for (int off = 0; off < 8; off++) {
+				for (int len = 0; len <= CHECK_MAX_LEN; len++) {
+					const u8 *src = (const u8 *)data + off;
+					u8 *to = dst + (off * 3) % 8;
+					u32 sum = fill ? 0xffffffff : rand();
+					u16 ref = csum_reference(src, len, sum);
+
+					memset(dst, 0x5a, sizeof(dst));
+					u16 v = csum_kernel_partial(k, src, len, sum);
+					u16 c = csum_kernel_partial_copy(k, to, src, len, sum);
+					if (v == ref && c == ref && memcmp(to, src, len) == 0 && \
+							to[len] == 0x5a)
+						continue;
+
+					if (errors++ < 5)
+						fprintf(stderr, "%s: len %d offset %d sum %08x: "
+								"expected %04x, csum_partial %04x, "
+								"csum_partial_copy %04x%s\n", \
+								csum_kernel_name(k), len, off, sum, ref, v, c, \
+								memcmp(to, src, len) || to[len] != 0x5a ? \
+								" (bad copy)" : "");
+				}
+			}
+		}
+
+		printf("%s: %s\n", csum_kernel_name(k), errors ? "FAILED" : "ok");
+		failed += errors;
+	}
+
+	return failed ? 1 : 0;
+}
+
+// ---------------------------------------------------------------------------
+// hash8 and hash16
+
+static void bench_hash8_6(u64 iters)
+{
+	u64 sum = 0;
+	for (u64 i = 0; i < iters; i++) {
+		data[0] = i;
+		sum += hash8(data, 6);
+	}
+	sink += sum;
+}
+
+static void bench_hash8_12(u64 iters)
+{
+	u64 sum = 0;
+	for (u64 i = 0; i < iters; i++) {
+		data[0] = i;
+		sum += hash8(data, 12);
+	}
+	sink += sum;
+}
+
+static void bench_hash16_12(u64 iters)
+{
+	u64 sum = 0;
+	for (u64 i = 0; i < iters; i++) {
+		data[0] = i;
+		sum += hash16(data, 12);
+	}
+	sink += sum;
+}
+
+static void bench_htable_hash_12(u64 iters)
+{
+	u64 sum = 0;
+	for (u64 i = 0; i < iters; i++) {
+		data[0] = i;
+		sum += htable_hash(data, 12);
+	}
+	sink += sum;
+}
+
+// ---------------------------------------------------------------------------
+// intrusive list
+
+#define LIST_LEN			1024
+
+struct list_item {
+	struct list_head list;
+	u64 value;
+};
+
+static struct list_item *list_items;
+
+// one op is adding an entry at the tail and deleting it from the head
+static void bench_list_add_delete(u64 iters)
+{
+	struct list_head head;
+	init_list_head(&head);
+	for (int i = 0; i < LIST_LEN; i++)
+		list_add_tail(&list_items[i].list, &head);
+
+	for (u64 i = 0; i < iters; i++) {
+		struct list_head *first = head.next;
+		list_delete_entry(first);
+		list_add_tail(first, &head);
+	}
+	sink += (list_entry(head.next, struct list_item, list))->value;
+}
+
+// one op is visiting one entry, of a list linked in random order
+static void bench_list_walk(u64 iters)
+{
+	int order[LIST_LEN];
+	for (int i = 0; i < LIST_LEN; i++)
+		order[i] = i;
+	for (int i = LIST_LEN - 1; i > 0; i--) {
+		int j = rand() % (i + 1), t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+
+	struct list_head head;
+	init_list_head(&head);
+	for (int i = 0; i < LIST_LEN; i++)
+		list_add_tail(&list_items[order[i]].list, &head);
+
+	u64 sum = 0;
+	for (u64 n = 0; n < iters; n += LIST_LEN) {
+		struct list_item *item;
+		list_for_each_entry(item, &head, list)
+			sum += item->value;
+	}
+	sink += sum;
+}
+
+// ---------------------------------------------------------------------------
+// ring buffer
+
+#define RING_SIZE			65536
+#define RING_CHUNK			1460
+
+// one op is writing a chunk and reading it back, wrapping around the ring
+static void bench_ring_buffer(u64 iters)
+{
+	struct ring_buffer *rbuf = alloc_ring_buffer(RING_SIZE);
+	char out[RING_CHUNK];
+
+	for (u64 i = 0; i < iters; i++) {
+		write_ring_buffer(rbuf, data, RING_CHUNK);
+		read_ring_buffer(rbuf, out, RING_CHUNK);
+	}
+	sink += out[0];
+	free_ring_buffer(rbuf);
+}
+
+// ---------------------------------------------------------------------------
+// synch_wait
+
+// one op is a wake_up without any sleeper
+static void bench_wake_up(u64 iters)
+{
+	struct synch_wait *wait = alloc_wait_struct();
+	for (u64 i = 0; i < iters; i++) {
+		wake_up(wait);
+		wait->notified = 0;
+	}
+	free_wait_struct(wait);
+}
+
+struct ping_pong {
+	struct synch_wait *ping;
+	struct synch_wait *pong;
+	u64 iters;
+};
+
+static void *pong_thread(void *arg)
+{
+	struct ping_pong *pp = arg;
+	for (u64 i = 0; i < pp->iters; i++) {
+		sleep_on(pp->ping);
+		wake_up(pp->pong);
+	}
+	return NULL;
+}
+
+// one op is a round trip of wake_up and sleep_on between two threads
+static void bench_sleep_wake(u64 iters)
+{
+	struct ping_pong pp = {
+		.ping = alloc_wait_struct(),
+		.pong = alloc_wait_struct(),
+		.iters = iters,
+	};
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, pong_thread, &pp) != 0) {
+		perror("Create thread failed");
+		exit(1);
+	}
+
+	for (u64 i = 0; i < iters; i++) {
+		wake_up(pp.ping);
+		sleep_on(pp.pong);
+	}
+
+	pthread_join(thread, NULL);
+	free_wait_struct(pp.ping);
+	free_wait_struct(pp.pong);
+}
+
+// ---------------------------------------------------------------------------
+// htable
+
+#define HTABLE_ENTRIES		65536
+
+static struct htable bench_table;
+static u64 *htable_keys;
+
+static int u64_eq(const void *entry, const void *key)
+{
+	return *(const u64 *)entry == *(const u64 *)key;
+}
+
+// one op is a lookup of a random key present in the table
+static void bench_htable_lookup(u64 iters)
+{
+	u64 sum = 0;
+	for (u64 i = 0; i < iters; i++) {
+		u64 *key = &htable_keys[(i * 40503) & (HTABLE_ENTRIES - 1)];
+		u64 *entry = htable_lookup(&bench_table, htable_hash(key, sizeof(u64)), \
+				key, u64_eq);
+		sum += *entry;
+	}
+	sink += sum;
+}
+
+static void htable_bench_init()
+{
+	htable_init(&bench_table);
+	htable_keys = malloc(sizeof(u64) * HTABLE_ENTRIES);
+	for (int i = 0; i < HTABLE_ENTRIES; i++) {
+		htable_keys[i] = ((u64)rand() << 32) | i;
+		htable_insert(&bench_table, htable_hash(&htable_keys[i], sizeof(u64)), \
+				&htable_keys[i]);
+	}
+}
+
+// ---------------------------------------------------------------------------
+
+static struct bench benches[] = {
+	{ "checksum/20", bench_checksum_20, 20 },
+	{ "checksum/64", bench_checksum_64, 64 },
+	{ "checksum/1480", bench_checksum_1480, 1480 },
+	{ "checksum/16384", bench_checksum_16384, 16384 },
+	{ "csum_copy/1460", bench_csum_copy_1460, 1460 },
+	{ "memcpy/1460", bench_memcpy_1460, 1460 },
+	{ "hash8/6", bench_hash8_6, 6 },
+	{ "hash8/12", bench_hash8_12, 12 },
+	{ "hash16/12", bench_hash16_12, 12 },
+	{ "htable_hash/12", bench_htable_hash_12, 12 },
+	{ "htable_lookup/65536", bench_htable_lookup, 0 },
+	{ "list/add_delete", bench_list_add_delete, 0 },
+	{ "list/walk_1024", bench_list_walk, 0 },
+	{ "ring_buffer/1460", bench_ring_buffer, RING_CHUNK },
+	{ "synch_wait/wake_up", bench_wake_up, 0 },
+	{ "synch_wait/ping_pong", bench_sleep_wake, 0 },
+};
+
+#define NR_BENCHES	(sizeof(benches) / sizeof(benches[0]))
+
+struct bench_result {
+	u64 iters;
+	double ns;
+	double cycles;
+	u64 counters[NR_COUNTERS];
+};
+
+static void run_once(struct bench *b, u64 iters, struct bench_result *r)
+{
+	r->iters = iters;
+	bzero(r->counters, sizeof(r->counters));
+
+	perf_start();
+	u64 start = time_ns(), tsc = rdtsc();
+	b->func(iters);
+	r->cycles = (double)(rdtsc() - tsc) / iters;
+	r->ns = (double)(time_ns() - start) / iters;
+	perf_stop(r->counters);
+}
+
+static int cmp_result(const void *a, const void *b)
+{
+	double x = ((struct bench_result *)a)->ns, y = ((struct bench_result *)b)->ns;
+	return (x > y) - (x < y);
+}
+
+static void run_bench(struct bench *b, u64 min_time, int first)
+{
+	// double the iterations until a run lasts long enough
+	u64 iters = 1;
+	struct bench_result r;
+	while (1) {
+		run_once(b, iters, &r);
+		if (r.ns * iters >= min_time * 1000000ULL || iters >= (1ULL << 40))
+			break;
+		iters *= 2;
+	}
+
+	struct bench_result runs[BENCH_RUNS];
+	for (int i = 0; i < BENCH_RUNS; i++)
+		run_once(b, iters, &runs[i]);
+	qsort(runs, BENCH_RUNS, sizeof(struct bench_result), cmp_result);
+	struct bench_result *m = &runs[BENCH_RUNS / 2];
+
+	printf("%s    {\"name\": \"%s\", \"iterations\": %lu, \"runs\": %d, "
+			"\"ns_per_op\": %.3f, \"ns_per_op_min\": %.3f, \"ns_per_op_max\": %.3f, "
+			"\"cycles_per_op\": %.3f", first ? "" : ",\n", b->name, iters, \
+			BENCH_RUNS, m->ns, runs[0].ns, runs[BENCH_RUNS-1].ns, m->cycles);
+	if (b->bytes)
+		printf(", \"bytes_per_op\": %d, \"gbytes_per_s\": %.3f", b->bytes, \
+				b->bytes / m->ns);
+
+	if (perf_ok) {
+		printf(", \"counters\": {");
+		for (int i = 0; i < NR_COUNTERS; i++)
+			printf("%s\"%s_per_op\": %.4f", i ? ", " : "", counter_names[i], \
+					(double)m->counters[i] / m->iters);
+		printf("}");
+	}
+	else {
+		printf(", \"counters\": null");
+	}
+	printf("}");
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	u64 min_time = BENCH_MIN_TIME;
+	const char *filter = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "ct:")) != -1) {
+		if (opt == 'c') {
+			return check_checksum();
+		}
+		else if (opt == 't') {
+			min_time = atoi(optarg);
+		}
+		else {
+			fprintf(stderr, "usage: %s [-c] [-t ms] [filter]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (optind < argc)
+		filter = argv[optind];
+
+	for (int i = 0; i < sizeof(data); i++)
+		data[i] = rand();
+	list_items = malloc(sizeof(struct list_item) * LIST_LEN);
+	for (int i = 0; i < LIST_LEN; i++)
+		list_items[i].value = i;
+	htable_bench_init();
+
+	perf_init();
+
+	printf("{\n  \"cpus\": %ld,\n  \"min_time_ms\": %lu,\n"
+			"  \"perf_counters\": %s,\n  \"checksum\": \"%s\",\n"
+			"  \"benchmarks\": [\n", sysconf(_SC_NPROCESSORS_ONLN), min_time, \
+			perf_ok ? "true" : "false", csum_impl_name());
+
+	int first = 1;
+	for (int i = 0; i < NR_BENCHES; i++) {
+		if (filter && !strstr(benches[i].name, filter))
+			continue;
+		run_bench(&benches[i], min_time, first);
+		first = 0;
+	}
+	printf("\n  ]\n}\n");
+
+	return 0;
+}
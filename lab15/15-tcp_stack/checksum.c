@@ -0,0 +1,334 @@
+#include "checksum.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// add with the end-around carry, as the one's complement sum wraps modulo
+// 2^64 - 1, which is congruent to the 16-bit one's complement sum
+static inline u64 csum_add64(u64 sum, u64 v)
+{
+	sum += v;
+	return sum + (sum < v);
+}
+
+static inline u64 load64(const u8 *p)
+{
+	u64 v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+// the scalar kernels, which also sum up the tails of the vectorized ones
+static u64 csum_scalar(const u8 *buf, int len, u64 sum)
+{
+	u64 s0 = sum, s1 = 0;
+	for (; len >= 16; buf += 16, len -= 16) {
+		s0 = csum_add64(s0, load64(buf));
+		s1 = csum_add64(s1, load64(buf + 8));
+	}
+	if (len >= 8) {
+		s0 = csum_add64(s0, load64(buf));
+		buf += 8;
+		len -= 8;
+	}
+	if (len & 4) {
+		u32 v;
+		memcpy(&v, buf, 4);
+		s1 = csum_add64(s1, v);
+		buf += 4;
+	}
+	if (len & 2) {
+		u16 v;
+		memcpy(&v, buf, 2);
+		s1 = csum_add64(s1, v);
+		buf += 2;
+	}
+	// an odd byte is the low one of its word, as in memory order
+	if (len & 1)
+		s1 = csum_add64(s1, *buf);
+
+	return csum_add64(s0, s1);
+}
+
+static u64 csum_copy_scalar(u8 *dst, const u8 *src, int len, u64 sum)
+{
+	u64 s0 = sum, s1 = 0;
+	for (; len >= 16; src += 16, dst += 16, len -= 16) {
+		u64 v0 = load64(src), v1 = load64(src + 8);
+		memcpy(dst, &v0, 8);
+		memcpy(dst + 8, &v1, 8);
+		s0 = csum_add64(s0, v0);
+		s1 = csum_add64(s1, v1);
+	}
+	u8 *tail = dst;
+	if (len & 8) {
+		memcpy(dst, src, 8);
+		src += 8;
+		dst += 8;
+	}
+	if (len & 4) {
+		memcpy(dst, src, 4);
+		src += 4;
+		dst += 4;
+	}
+	if (len & 2) {
+		memcpy(dst, src, 2);
+		src += 2;
+		dst += 2;
+	}
+	if (len & 1)
+		*dst = *src;
+
+	return csum_add64(s0, csum_scalar(tail, len, s1));
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// The vectorized kernels widen the 32-bit words of each vector into 64-bit
+// lanes, which could take 2^32 of them without overflow, so the carries are
+// only folded once at the end.
+
+static inline u64 csum_reduce_sse2(__m128i acc, u64 sum)
+{
+	u64 lanes[2];
+	_mm_storeu_si128((__m128i *)lanes, acc);
+	sum = csum_add64(sum, lanes[0]);
+	return csum_add64(sum, lanes[1]);
+}
+
+#define CSUM_ADD_SSE2(acc0, acc1, v) \
+	do { \
+		acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v, zero)); \
+		acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v, zero)); \
+	} while (0)
+
+static u64 csum_sse2(const u8 *buf, int len, u64 sum)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+
+	for (; len >= 64; buf += 64, len -= 64) {
+		__m128i v0 = _mm_loadu_si128((const __m128i *)buf);
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(buf + 16));
+		__m128i v2 = _mm_loadu_si128((const __m128i *)(buf + 32));
+		__m128i v3 = _mm_loadu_si128((const __m128i *)(buf + 48));
+		CSUM_ADD_SSE2(acc0, acc1, v0);
+		CSUM_ADD_SSE2(acc2, acc3, v1);
+		CSUM_ADD_SSE2(acc0, acc1, v2);
+		CSUM_ADD_SSE2(acc2, acc3, v3);
+	}
+	for (; len >= 16; buf += 16, len -= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)buf);
+		CSUM_ADD_SSE2(acc0, acc1, v);
+	}
+
+	acc0 = _mm_add_epi64(acc0, acc2);
+	acc1 = _mm_add_epi64(acc1, acc3);
+	sum = csum_reduce_sse2(acc0, sum);
+	sum = csum_reduce_sse2(acc1, sum);
+
+	return csum_scalar(buf, len, sum);
+}
+
+static u64 csum_copy_sse2(u8 *dst, const u8 *src, int len, u64 sum)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+
+	for (; len >= 32; src += 32, dst += 32, len -= 32) {
+		__m128i v0 = _mm_loadu_si128((const __m128i *)src);
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(src + 16));
+		_mm_storeu_si128((__m128i *)dst, v0);
+		_mm_storeu_si128((__m128i *)(dst + 16), v1);
+		CSUM_ADD_SSE2(acc0, acc1, v0);
+		CSUM_ADD_SSE2(acc2, acc3, v1);
+	}
+
+	acc0 = _mm_add_epi64(acc0, acc2);
+	acc1 = _mm_add_epi64(acc1, acc3);
+	sum = csum_reduce_sse2(acc0, sum);
+	sum = csum_reduce_sse2(acc1, sum);
+
+	return csum_copy_scalar(dst, src, len, sum);
+}
+
+__attribute__((target("avx2")))
+static inline u64 csum_reduce_avx2(__m256i acc, u64 sum)
+{
+	sum = csum_reduce_sse2(_mm256_castsi256_si128(acc), sum);
+	return csum_reduce_sse2(_mm256_extracti128_si256(acc, 1), sum);
+}
+
+#define CSUM_ADD_AVX2(acc0, acc1, v) \
+	do { \
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero)); \
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero)); \
+	} while (0)
+
+__attribute__((target("avx2")))
+static u64 csum_avx2(const u8 *buf, int len, u64 sum)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+
+	for (; len >= 128; buf += 128, len -= 128) {
+		__m256i v0 = _mm256_loadu_si256((const __m256i *)buf);
+		__m256i v1 = _mm256_loadu_si256((const __m256i *)(buf + 32));
+		__m256i v2 = _mm256_loadu_si256((const __m256i *)(buf + 64));
+		__m256i v3 = _mm256_loadu_si256((const __m256i *)(buf + 96));
+		CSUM_ADD_AVX2(acc0, acc1, v0);
+		CSUM_ADD_AVX2(acc2, acc3, v1);
+		CSUM_ADD_AVX2(acc0, acc1, v2);
+		CSUM_ADD_AVX2(acc2, acc3, v3);
+	}
+	for (; len >= 32; buf += 32, len -= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)buf);
+		CSUM_ADD_AVX2(acc0, acc1, v);
+	}
+
+	acc0 = _mm256_add_epi64(acc0, acc2);
+	acc1 = _mm256_add_epi64(acc1, acc3);
+	sum = csum_reduce_avx2(acc0, sum);
+	sum = csum_reduce_avx2(acc1, sum);
+
+	// the tail is summed up by the scalar kernel, which is tail called
+	// without the upper halves cleared by the compiler
+	_mm256_zeroupper();
+	return csum_scalar(buf, len, sum);
+}
+
+__attribute__((target("avx2")))
+static u64 csum_copy_avx2(u8 *dst, const u8 *src, int len, u64 sum)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+
+	for (; len >= 64; src += 64, dst += 64, len -= 64) {
+		__m256i v0 = _mm256_loadu_si256((const __m256i *)src);
+		__m256i v1 = _mm256_loadu_si256((const __m256i *)(src + 32));
+		_mm256_storeu_si256((__m256i *)dst, v0);
+		_mm256_storeu_si256((__m256i *)(dst + 32), v1);
+		CSUM_ADD_AVX2(acc0, acc1, v0);
+		CSUM_ADD_AVX2(acc2, acc3, v1);
+	}
+
+	acc0 = _mm256_add_epi64(acc0, acc2);
+	acc1 = _mm256_add_epi64(acc1, acc3);
+	sum = csum_reduce_avx2(acc0, sum);
+	sum = csum_reduce_avx2(acc1, sum);
+
+	// the tail is summed up by the scalar kernel, which is tail called
+	// without the upper halves cleared by the compiler
+	_mm256_zeroupper();
+	return csum_copy_scalar(dst, src, len, sum);
+}
+
+#endif
+
+struct csum_impl {
+	const char *name;
+	u64 (*sum)(const u8 *buf, int len, u64 sum);
+	u64 (*copy)(u8 *dst, const u8 *src, int len, u64 sum);
+};
+
+// ordered by width, each kernel is supported by the cpus of the next ones
+static const struct csum_impl csum_impls[] = {
+	{ "scalar", csum_scalar, csum_copy_scalar },
+#if defined(__x86_64__) || defined(__i386__)
+	{ "sse2", csum_sse2, csum_copy_sse2 },
+	{ "avx2", csum_avx2, csum_copy_avx2 },
+#endif
+};
+
+static const struct csum_impl *csum_impl;
+static int csum_nr_impls;			// number of the kernels supported by the cpu
+static pthread_once_t csum_once = PTHREAD_ONCE_INIT;
+
+// pick the widest kernel supported by the cpu, unless USTACK_CSUM names one
+// (scalar, sse2 or avx2) for comparison
+static void csum_init()
+{
+	csum_nr_impls = 1;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		csum_nr_impls = 2;
+	if (__builtin_cpu_supports("avx2"))
+		csum_nr_impls = 3;
+#endif
+
+	const struct csum_impl *impl = &csum_impls[csum_nr_impls - 1];
+	char *env = getenv("USTACK_CSUM");
+	if (env) {
+		for (int i = 0; i < csum_nr_impls; i++) {
+			if (strcmp(env, csum_impls[i].name) == 0)
+				impl = &csum_impls[i];
+		}
+	}
+
+	__atomic_store_n(&csum_impl, impl, __ATOMIC_RELEASE);
+}
+
+static inline const struct csum_impl *csum_get_impl()
+{
+	const struct csum_impl *impl = __atomic_load_n(&csum_impl, __ATOMIC_ACQUIRE);
+	if (!impl) {
+		pthread_once(&csum_once, csum_init);
+		impl = csum_impl;
+	}
+
+	return impl;
+}
+
+static inline u16 csum_fold(u64 sum)
+{
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	while (sum >> 16)
+		sum = (sum >> 16) + (sum & 0xffff);
+
+	return (u16)sum;
+}
+
+u16 csum_partial(const void *buf, int nbytes, u32 sum)
+{
+	return csum_fold(csum_get_impl()->sum(buf, nbytes, sum));
+}
+
+u16 csum_partial_copy(void *dst, const void *src, int nbytes, u32 sum)
+{
+	return csum_fold(csum_get_impl()->copy(dst, src, nbytes, sum));
+}
+
+const char *csum_impl_name()
+{
+	return csum_get_impl()->name;
+}
+
+// the kernels supported by the cpu, from the scalar one (0), which are called
+// directly by index to be checked against each other
+int csum_nr_kernels()
+{
+	pthread_once(&csum_once, csum_init);
+	return csum_nr_impls;
+}
+
+const char *csum_kernel_name(int kernel)
+{
+	return csum_impls[kernel].name;
+}
+
+u16 csum_kernel_partial(int kernel, const void *buf, int nbytes, u32 sum)
+{
+	return csum_fold(csum_impls[kernel].sum(buf, nbytes, sum));
+}
+
+u16 csum_kernel_partial_copy(int kernel, void *dst, const void *src, \
+		int nbytes, u32 sum)
+{
+	return csum_fold(csum_impls[kernel].copy(dst, src, nbytes, sum));
+}
@@ -3,6 +3,7 @@
 #include "rtable.h"
 #include "arp.h"
 #include "base.h"
+#include "packet_pool.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,7 +29,7 @@ void icmp_send_packet(const char *in_pkt, int len, u8 type, u8 code)
 	res_len = ETHER_HDR_SIZE + IP_BASE_HDR_SIZE + icmp_len;
 
 	//malloc
-	char *res = (char *)malloc(res_len);
+	char *res = packet_alloc(res_len);
 	memset(res, 0, res_len);
 	// init iph
 	struct iphdr *res_iph = packet_to_ip_hdr(res);
@@ -36,12 +37,16 @@ void icmp_send_packet(const char *in_pkt, int len, u8 type, u8 code)
 		ip_init_hdr(res_iph, ntohl(iph->daddr), ntohl(iph->saddr), IP_BASE_HDR_SIZE+icmp_len, IPPROTO_ICMP);
 	}
 	else{
+		rcu_read_lock();
 		rt_entry_t *match = longest_prefix_match(ntohl(iph->saddr));
 		if(match==NULL){
-			free(res);
+			rcu_read_unlock();
+			packet_free(res);
 			return ;
 		}
-		ip_init_hdr(res_iph, match->iface->ip, ntohl(iph->saddr), IP_BASE_HDR_SIZE+icmp_len, IPPROTO_ICMP);
+		u32 saddr = match->iface->ip;
+		rcu_read_unlock();
+		ip_init_hdr(res_iph, saddr, ntohl(iph->saddr), IP_BASE_HDR_SIZE+icmp_len, IPPROTO_ICMP);
 	}
 	// init icmp
 	char *res_ipdata = IP_DATA(res_iph);
@@ -58,5 +63,5 @@ void icmp_send_packet(const char *in_pkt, int len, u8 type, u8 code)
 	icmph->checksum = icmp_checksum(icmph,icmp_len);
 	//send
 	ip_send_packet(res, res_len);
-	free(res);
+	packet_free(res);
 }
@@ -0,0 +1,47 @@
+#ifndef __PACKET_POOL_H__
+#define __PACKET_POOL_H__
+
+#include "types.h"
+
+#define PACKET_BUF_SIZE		2048	// size of each buffer in the pool (aligned)
+#define PACKET_BUF_HDR		64		// space for struct packet_buf
+#define PACKET_HEADROOM		64		// reserved in front of each packet, where
+									// headers could be prepended in place
+#define PACKET_DATA_OFFSET	(PACKET_BUF_HDR + PACKET_HEADROOM)
+#define PACKET_MAX_LEN		(PACKET_BUF_SIZE - PACKET_DATA_OFFSET)
+#define PACKET_POOL_CHUNK	64		// number of buffers allocated at a time
+#define PACKET_POOL_ARENA_SIZE	(256UL << 20)	// address space reserved for
+												// the buffers of all the pools
+
+struct packet_pool;
+
+// header in front of each packet buffer
+//
+// Buffers are aligned to PACKET_BUF_SIZE, so the header of a packet is found
+// by masking its address.
+struct packet_buf {
+	struct packet_buf *next;	// link in the free list of the pool
+	struct packet_pool *pool;	// the pool it belongs to (NULL if too large
+								// to fit into the pool, malloc'ed instead)
+	int ref;					// reference count
+	int csum_valid;				// the checksums have been verified by the 
+								// device (only known with the offloads)
+};
+
+// per-thread pool of packet buffers
+//
+// Only the owner thread allocates from free_list, buffers released by other
+// threads are pushed into remote_free, and reclaimed when free_list is empty.
+struct packet_pool {
+	struct packet_buf *free_list;
+	struct packet_buf *remote_free;
+	int nr_bufs;				// number of buffers owned by this pool
+};
+
+char *packet_alloc(int len);
+void packet_get(const char *packet);
+void packet_free(const char *packet);
+void packet_set_csum_valid(const char *packet);
+int packet_csum_valid(const char *packet);
+
+#endif
@@ -43,6 +43,8 @@ struct tcphdr {
 
 #define TCP_DEFAULT_WINDOW 65535
 #define TCP_MSS (1514 - ETHER_HDR_SIZE - IP_BASE_HDR_SIZE - TCP_BASE_HDR_SIZE)
+// max payload of a super-segment, which is split by the device (USTACK_OFFLOAD)
+#define TCP_GSO_MAX_DATA (65535 - IP_BASE_HDR_SIZE - TCP_BASE_HDR_SIZE)
 
 // control block, representing all the necesary information of a packet
 struct tcp_cb {
@@ -55,6 +57,8 @@ struct tcp_cb {
 	u32 ack;		// ack number in tcp header
 	char *payload;		// pointer to tcp data
 	int pl_len;		// the length of tcp data
+	char *data;		// copy of tcp data made while verifying the checksum,
+				// taken by the receive buffer (or freed)
 	u32 rwnd;		// receiving window in tcp header
 	u8 flags;		// flags in tcp header
 	struct iphdr *ip;		// pointer to ip header
@@ -75,22 +79,47 @@ static inline struct tcphdr *packet_to_tcp_hdr(char *packet)
 	return (struct tcphdr *)((char *)ip + IP_HDR_SIZE(ip));
 }
 
-static inline u16 tcp_checksum(struct iphdr *ip, struct tcphdr *tcp)
+// sum of the pseudo header, in which the addresses are added in halves, not
+// to overflow
+static inline u32 tcp_pseudo_sum(struct iphdr *ip)
+{
+	u16 tcp_len = ntohs(ip->tot_len) - IP_HDR_SIZE(ip);
+	return (ip->saddr >> 16) + (ip->saddr & 0xffff) + (ip->daddr >> 16) + \
+		(ip->daddr & 0xffff) + htons(ip->protocol) + htons(tcp_len);
+}
+
+// checksum of the segment, of which only the first len bytes are summed up
+// here, and the rest (the payload) has been summed up as pl_sum by
+// csum_partial_copy when it was copied
+static inline u16 tcp_checksum_partial(struct iphdr *ip, struct tcphdr *tcp, \
+		int len, u16 pl_sum)
 {
 	u16 tmp = tcp->checksum;
 	tcp->checksum = 0;
 
-	u16 reserv_proto = ip->protocol;
-	u16 tcp_len = ntohs(ip->tot_len) - IP_HDR_SIZE(ip);
-
-	u32 sum = ip->saddr + ip->daddr + htons(reserv_proto) + htons(tcp_len);
-	u16 cksum = checksum((u16 *)tcp, (int)tcp_len, sum);
+	u16 cksum = checksum((u16 *)tcp, len, tcp_pseudo_sum(ip) + pl_sum);
 
 	tcp->checksum = tmp;
 
 	return cksum;
 }
 
+static inline u16 tcp_checksum(struct iphdr *ip, struct tcphdr *tcp)
+{
+	int tcp_len = ntohs(ip->tot_len) - IP_HDR_SIZE(ip);
+	return tcp_checksum_partial(ip, tcp, tcp_len, 0);
+}
+
+// checksum of an outgoing segment: with the offloads, only the pseudo header
+// is summed up (not complemented), and the device completes the checksum
+static inline u16 tcp_tx_checksum(struct iphdr *ip, struct tcphdr *tcp)
+{
+	if (!instance->offload)
+		return tcp_checksum(ip, tcp);
+
+	return ~checksum(NULL, 0, tcp_pseudo_sum(ip));
+}
+
 static inline u32 tcp_seq_end(struct iphdr *ip, struct tcphdr *tcp)
 {
 	int len = ntohs(ip->tot_len) - IP_HDR_SIZE(ip) - TCP_HDR_SIZE(tcp);
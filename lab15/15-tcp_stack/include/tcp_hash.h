@@ -1,28 +1,24 @@
 #ifndef __TCP_HASH_H__
 #define __TCP_HASH_H__
 
-#include "hash.h"
+#include "htable.h"
 #include "list.h"
 #include "tcp_sock.h"
 
-#define TCP_HASH_SIZE HASH_8BITS
-#define TCP_HASH_MASK (TCP_HASH_SIZE - 1)
-
 // the 3 tables in tcp_hash_table
 struct tcp_hash_table {
-	struct list_head established_table[TCP_HASH_SIZE];
-	struct list_head listen_table[TCP_HASH_SIZE];
-	struct list_head bind_table[TCP_HASH_SIZE];
+	struct htable established_table;	// (saddr, daddr, sport, dport) -> sock
+	struct htable listen_table;			// sport -> sock
+	struct htable bind_table;			// sport -> sock
 };
 
 // tcp hash function: if hashed into bind_table or listen_table, only use sport; 
 // otherwise, use all the 4 arguments
-static inline int tcp_hash_function(u32 saddr, u32 daddr, u16 sport, u16 dport)
+static inline u64 tcp_hash_function(u32 saddr, u32 daddr, u16 sport, u16 dport)
 {
-	int result = hash8((char *)&saddr, 4) ^ hash8((char *)&daddr, 4) ^ \
-				 hash8((char *)&sport, 2) ^ hash8((char *)&dport, 2);
+	u32 key[3] = { saddr, daddr, ((u32)sport << 16) | dport };
 
-	return result & TCP_HASH_MASK;
+	return htable_hash(key, sizeof(key));
 }
 
 #endif
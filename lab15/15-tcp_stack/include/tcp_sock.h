@@ -11,6 +11,8 @@
 
 #include <pthread.h>
 
+struct htable;
+
 #define PORT_MIN	12345
 #define PORT_MAX	23456
 
@@ -38,10 +40,12 @@ struct tcp_sock {
 	// decreased to zero, the tcp sock should be released
 	int ref_cnt;
 
-	// hash_list is used to hash tcp sock into listen_table or established_table, 
-	// bind_hash_list is used to hash into bind_table
-	struct list_head hash_list;
-	struct list_head bind_hash_list;
+	// hash_table is the table (listen_table or established_table) which tcp 
+	// sock is hashed into with hash (NULL if not hashed), bind_hashed 
+	// indicates whether it is hashed into bind_table
+	struct htable *hash_table;
+	u64 hash;
+	int bind_hashed;
 
 	// when a passively opened tcp sock receives a SYN packet, it mallocs a child 
 	// tcp sock to serve the incoming connection, which is pending in the 
@@ -130,6 +134,8 @@ typedef struct send_buffer_entry {
 	struct list_head list;
 	char *packet;
 	int len;
+	u32 acked;		// acknowledged up to (a super-segment is acknowledged 
+					// in pieces)
 } send_buffer_entry_t;
 
 typedef struct recv_ofo_buf_entry {
@@ -163,6 +169,7 @@ void tcp_send_reset(struct tcp_cb *cb);
 
 void tcp_send_control_packet(struct tcp_sock *tsk, u8 flags);
 void tcp_send_packet(struct tcp_sock *tsk, char *packet, int len);
+void tcp_send_packet_csum(struct tcp_sock *tsk, char *packet, int len, u16 pl_sum);
 int tcp_send_data(struct tcp_sock *tsk, char *buf, int len);
 
 void tcp_process(struct tcp_sock *tsk, struct tcp_cb *cb, char *packet);
@@ -1,7 +1,7 @@
 #ifndef __TCP_TIMER_H__
 #define __TCP_TIMER_H__
 
-#include "list.h"
+#include "timer.h"
 
 #include <stddef.h>
 
@@ -9,7 +9,7 @@ struct tcp_timer {
 	int type;	// time-wait: 0		retrans: 1
 	int timeout;	// in micro second
 	int retrans_time; //record retrans times
-	struct list_head list;
+	struct timer timer;	// armed in the timer wheel while enabled
 	int enable;
 };
 
@@ -19,22 +19,20 @@ struct tcp_sock;
 
 #define retranstimer_to_tcp_sock(t) \
 	(struct tcp_sock *)((char *)(t) - offsetof(struct tcp_sock, retrans_timer))
-#define TCP_TIMER_SCAN_INTERVAL 100000
 #define TCP_MSL			1000000
 #define TCP_TIMEWAIT_TIMEOUT	(2 * TCP_MSL)
 #define TCP_RETRANS_INTERVAL_INITIAL 100000
-#define TCP_RETRANS_SCAN_INTERVAL 10000
 #define MAX_RETRANS_NUM 6
 
-// the thread that scans timer_list periodically
-void *tcp_timer_thread(void *arg);
-// add the timer of tcp sock to timer_list
+void tcp_init_timers(struct tcp_sock *tsk);
+void tcp_del_timers(struct tcp_sock *tsk);
+
+// arm the timewait timer of tcp sock
 void tcp_set_timewait_timer(struct tcp_sock *);
 
 void tcp_set_retrans_timer(struct tcp_sock *tsk);
+void tcp_reset_retrans_timer(struct tcp_sock *tsk);
 void tcp_update_retrans_timer(struct tcp_sock *tsk);
 void tcp_unset_retrans_timer(struct tcp_sock *tsk);
 
-void *tcp_retrans_timer_thread(void *arg);
-
 #endif
@@ -0,0 +1,59 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include "types.h"
+#include "list.h"
+
+// timer service: a hierarchical timing wheel driven by a single timerfd, on
+// which each subsystem registers the timers of its own objects
+//
+// One tick of the wheel is 1 ms. Arming and cancelling a timer is O(1), and
+// the timer thread sleeps until the next timer expires, waking up only to run
+// (or cascade) the timers due, whatever the number of timers armed.
+//
+// The handlers are called by the timer thread without any lock of the wheel
+// held, so that they could take the locks of their subsystems, and re-arm or
+// cancel timers. A timer being cancelled by del_timer might have been taken
+// out of the wheel to run in the meanwhile (0 is returned then), the handler
+// must check the state of its object with the subsystem lock held, and the 
+// object could only be freed by whoever cancels the timer successfully.
+//
+// The timers run on the monotonic clock, or on a virtual clock with
+// USTACK_VCLOCK=1, which starts from 0 and never moves by itself: it is
+// fast-forwarded to the next event as soon as the current one is handled
+// (including the work of the threads woken up from timer_sleep), so that the
+// protocol timeouts of seconds take no real time, and the timers run in a 
+// deterministic order. A replay could rather drive it by timer_advance, e.g.
+// to the timestamps of the frames replayed. The virtual clock is only used 
+// with the virtual interfaces (USTACK_VDEV), as the peers on the live ones 
+// run on the real time.
+
+typedef void (*timer_handler_t)(void *arg);
+
+struct timer {
+	struct list_head list;		// link in a slot of the wheel
+	u64 expires;				// tick when the timer expires
+	int slot;					// index of the slot in the wheel (-1 if it is
+								// taken out to run)
+	int pending;				// whether the timer is armed
+	timer_handler_t func;		// called when the timer expires
+	void *arg;
+};
+
+void init_timer(struct timer *timer, timer_handler_t func, void *arg);
+void mod_timer(struct timer *timer, u64 timeout);
+int mod_timer_pending(struct timer *timer, u64 timeout);
+int del_timer(struct timer *timer);
+u64 timer_now();
+u64 timer_now_coarse();
+int timer_virtual_clock();
+void timer_sleep(u64 timeout);
+void timer_advance(u64 now);
+
+// whether the timer is armed and has not expired yet
+static inline int timer_pending(struct timer *timer)
+{
+	return __atomic_load_n(&timer->pending, __ATOMIC_RELAXED);
+}
+
+#endif
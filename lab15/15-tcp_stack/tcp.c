@@ -3,7 +3,10 @@
 #include "tcp_sock.h"
 
 #include "log.h"
+#include "packet_pool.h"
+#include "metrics.h"
 
+#include <stdlib.h>
 #include <arpa/inet.h>
 
 const char *tcp_state_str[] = { "CLOSED", "LISTEN", "SYN_RECV",
@@ -59,6 +62,7 @@ void tcp_cb_init(struct iphdr *ip, struct tcphdr *tcp, struct tcp_cb *cb)
 	cb->ack = ntohl(tcp->ack);
 	cb->payload = (char *)tcp + tcp->off * 4;
 	cb->pl_len = len;
+	cb->data = NULL;
 	cb->rwnd = ntohs(tcp->rwnd);
 	cb->flags = tcp->flags;
 }
@@ -67,15 +71,29 @@ void tcp_cb_init(struct iphdr *ip, struct tcphdr *tcp, struct tcp_cb *cb)
 // to process the packet.
 void handle_tcp_packet(char *packet, struct iphdr *ip, struct tcphdr *tcp)
 {
-	if (tcp_checksum(ip, tcp) != tcp->checksum) {
-		log(ERROR, "received tcp packet with invalid checksum, drop it.");
-		return ;
-	}
-
 	struct tcp_cb cb;
 	tcp_cb_init(ip, tcp, &cb);
 
+	// the device has verified it with the offloads, otherwise the payload is
+	// copied out for the receive buffer in the same pass as summed up
+	if (!packet_csum_valid(packet)) {
+		u16 pl_sum = 0;
+		if (cb.pl_len > 0) {
+			cb.data = malloc(cb.pl_len);
+			pl_sum = csum_partial_copy(cb.data, cb.payload, cb.pl_len, 0);
+		}
+
+		if (tcp_checksum_partial(ip, tcp, TCP_HDR_SIZE(tcp), pl_sum) != tcp->checksum) {
+			log(ERROR, "received tcp packet with invalid checksum, drop it.");
+			metrics_drop(DROP_BAD_CHECKSUM);
+			free(cb.data);
+			return ;
+		}
+	}
+
 	struct tcp_sock *tsk = tcp_sock_lookup(&cb);
 
 	tcp_process(tsk, &cb, packet);
+
+	free(cb.data);
 }
@@ -4,6 +4,7 @@
 
 #include "log.h"
 #include "ring_buffer.h"
+#include "metrics.h"
 
 #include <stdlib.h>
 
@@ -45,6 +46,7 @@ static inline int is_tcp_seq_valid(struct tcp_sock *tsk, struct tcp_cb *cb)
 	else {
 		fprintf(stderr, "%d %d %d\n",cb->seq, tsk->rcv_nxt, rcv_end);
 		log(ERROR, "received packet with invalid seq, drop it.");
+		metrics_drop(DROP_TCP_INVALID_SEQ);
 		return 0;
 	}
 }
@@ -166,10 +168,13 @@ void tcp_congestion_control(struct tcp_sock *tsk, struct tcp_cb *cb, char *packe
 // Process the incoming packet according to TCP state machine. 
 void tcp_process(struct tcp_sock *tsk, struct tcp_cb *cb, char *packet)
 {
+	latency_stage(LAT_TCP_PROCESS);
+
 	//fprintf(stdout, "TODO: implement %s please.\n", __FUNCTION__);
 
 	if (!tsk) {
 	    log(ERROR, "No process listening!!!\n");
+	    metrics_drop(DROP_TCP_NO_SOCK);
 		tcp_send_reset(cb);
         return;
 	}
@@ -203,7 +208,6 @@ void tcp_process(struct tcp_sock *tsk, struct tcp_cb *cb, char *packet)
 				tcp_set_state(child_tsk, TCP_SYN_RECV);
 
 				tcp_hash(child_tsk);
-				init_list_head(&child_tsk->bind_hash_list);
 				
 				log(DEBUG, "Pass " IP_FMT ":%hu <-> " IP_FMT ":%hu from process to listen_queue", 
 						HOST_IP_FMT_STR(child_tsk->sk_sip), child_tsk->sk_sport,
@@ -343,8 +347,7 @@ void tcp_process(struct tcp_sock *tsk, struct tcp_cb *cb, char *packet)
 				else{
 					tsk->rcv_nxt = cb->seq_end;
 					if (cb->ack > tsk->snd_una) {
-						tsk->retrans_timer.retrans_time = 0;
-						tsk->retrans_timer.timeout = TCP_RETRANS_INTERVAL_INITIAL;
+						tcp_reset_retrans_timer(tsk);
 					}
 					//log(DEBUG, "%d %d\n", tsk->snd_una, cb->ack);
 					tsk->snd_una = cb->ack;
@@ -0,0 +1,372 @@
+#include "vdev.h"
+#include "log.h"
+#include "packet_pool.h"
+#include "metrics.h"
+#include "timer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#define PCAP_MAGIC			0xa1b2c3d4	// microsecond timestamps
+#define PCAP_MAGIC_NSEC		0xa1b23c4d	// nanosecond timestamps
+#define PCAP_LINKTYPE_ETH	1
+#define PCAP_SNAPLEN		65535
+
+#define VDEV_BATCH			32			// frames replayed between tx batches
+
+struct pcap_file_hdr {
+	u32 magic;
+	u16 version_major;
+	u16 version_minor;
+	u32 thiszone;
+	u32 sigfigs;
+	u32 snaplen;
+	u32 linktype;
+};
+
+struct pcap_rec_hdr {
+	u32 ts_sec;
+	u32 ts_usec;
+	u32 incl_len;
+	u32 orig_len;
+};
+
+static inline u64 time_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// load all the frames of a pcap file into memory, so that the replay is not
+// slowed down by reading the file
+static void vdev_load_pcap(struct vdev *vdev, const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	if (!fp) {
+		log(ERROR, "could not open pcap file %s: %s", path, strerror(errno));
+		exit(1);
+	}
+
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	char *buf = malloc(size);
+	if (size < (long)sizeof(struct pcap_file_hdr) || \
+			fread(buf, 1, size, fp) != (size_t)size) {
+		log(ERROR, "could not read pcap file %s.", path);
+		exit(1);
+	}
+	fclose(fp);
+
+	struct pcap_file_hdr *fh = (struct pcap_file_hdr *)buf;
+	int swapped = 0;
+	if (fh->magic == __builtin_bswap32(PCAP_MAGIC) || \
+			fh->magic == __builtin_bswap32(PCAP_MAGIC_NSEC))
+		swapped = 1;
+	else if (fh->magic != PCAP_MAGIC && fh->magic != PCAP_MAGIC_NSEC) {
+		log(ERROR, "%s is not a pcap file.", path);
+		exit(1);
+	}
+
+	int nsec = fh->magic == PCAP_MAGIC_NSEC || \
+			fh->magic == __builtin_bswap32(PCAP_MAGIC_NSEC);
+
+	u32 linktype = swapped ? __builtin_bswap32(fh->linktype) : fh->linktype;
+	if (linktype != PCAP_LINKTYPE_ETH) {
+		log(ERROR, "%s is not a pcap file of ethernet frames.", path);
+		exit(1);
+	}
+
+	// count the frames first, then fill them in
+	for (int pass = 0; pass < 2; pass++) {
+		long off = sizeof(struct pcap_file_hdr);
+		int n = 0;
+		while (off + (long)sizeof(struct pcap_rec_hdr) <= size) {
+			struct pcap_rec_hdr *rh = (struct pcap_rec_hdr *)(buf + off);
+			u32 len = swapped ? __builtin_bswap32(rh->incl_len) : rh->incl_len;
+			off += sizeof(struct pcap_rec_hdr);
+			if (off + len > size)
+				break;
+
+			if (pass == 1) {
+				u32 sec = swapped ? __builtin_bswap32(rh->ts_sec) : rh->ts_sec;
+				u32 frac = swapped ? __builtin_bswap32(rh->ts_usec) : rh->ts_usec;
+				vdev->rx_frames[n].data = buf + off;
+				vdev->rx_frames[n].len = len;
+				vdev->rx_frames[n].ts = sec * 1000000ULL + (nsec ? frac / 1000 : frac);
+			}
+			off += len;
+			n += 1;
+		}
+
+		if (pass == 0) {
+			vdev->rx_nframes = n;
+			vdev->rx_frames = malloc(sizeof(struct vdev_frame) * (n + 1));
+		}
+	}
+}
+
+static FILE *vdev_open_pcap(const char *path)
+{
+	FILE *fp = fopen(path, "wb");
+	if (!fp) {
+		log(ERROR, "could not create pcap file %s: %s", path, strerror(errno));
+		exit(1);
+	}
+
+	struct pcap_file_hdr fh = {
+		.magic = PCAP_MAGIC,
+		.version_major = 2,
+		.version_minor = 4,
+		.snaplen = PCAP_SNAPLEN,
+		.linktype = PCAP_LINKTYPE_ETH,
+	};
+	fwrite(&fh, sizeof(fh), 1, fp);
+
+	return fp;
+}
+
+static int parse_mac(const char *str, u8 *mac)
+{
+	unsigned int m[ETH_ALEN];
+	if (sscanf(str, "%x:%x:%x:%x:%x:%x", &m[0], &m[1], &m[2], \
+				&m[3], &m[4], &m[5]) != ETH_ALEN)
+		return -1;
+
+	for (int i = 0; i < ETH_ALEN; i++)
+		mac[i] = m[i];
+
+	return 0;
+}
+
+// parse one entry of USTACK_VDEV into a virtual interface
+static iface_info_t *vdev_parse_iface(char *spec, int index)
+{
+	char *save = NULL;
+	char *name = strtok_r(spec, ",", &save);
+	if (!name || strlen(name) >= sizeof(((iface_info_t *)0)->name)) {
+		log(ERROR, "invalid virtual interface '%s'.", spec);
+		exit(1);
+	}
+
+	iface_info_t *iface = malloc(sizeof(iface_info_t));
+	bzero(iface, sizeof(iface_info_t));
+	struct vdev *vdev = malloc(sizeof(struct vdev));
+	bzero(vdev, sizeof(struct vdev));
+	pthread_mutex_init(&vdev->tx_lock, NULL);
+
+	init_list_head(&iface->list);
+	strcpy(iface->name, name);
+	iface->fd = -1;
+	iface->index = index;
+	iface->vdev = vdev;
+	u8 mac[ETH_ALEN] = { 0x02, 0, 0, 0, 0, index };
+	memcpy(iface->mac, mac, ETH_ALEN);
+
+	char *opt = NULL;
+	while ((opt = strtok_r(NULL, ",", &save))) {
+		char *val = strchr(opt, '=');
+		if (!val) {
+			log(ERROR, "invalid option '%s' of virtual interface %s.", opt, name);
+			exit(1);
+		}
+		*val++ = '\0';
+
+		if (strcmp(opt, "rx") == 0) {
+			vdev_load_pcap(vdev, val);
+		}
+		else if (strcmp(opt, "tx") == 0) {
+			vdev->tx_file = vdev_open_pcap(val);
+		}
+		else if (strcmp(opt, "ip") == 0) {
+			char *slash = strchr(val, '/');
+			int plen = 32;
+			if (slash) {
+				*slash = '\0';
+				plen = atoi(slash + 1);
+			}
+
+			struct in_addr addr;
+			if (inet_pton(AF_INET, val, &addr) != 1 || plen < 0 || plen > 32) {
+				log(ERROR, "invalid ip of virtual interface %s.", name);
+				exit(1);
+			}
+			iface->ip = ntohl(addr.s_addr);
+			iface->mask = plen ? 0xFFFFFFFF << (32 - plen) : 0;
+			strcpy(iface->ip_str, val);
+		}
+		else if (strcmp(opt, "mac") == 0) {
+			if (parse_mac(val, iface->mac) < 0) {
+				log(ERROR, "invalid mac of virtual interface %s.", name);
+				exit(1);
+			}
+		}
+		else if (strcmp(opt, "gw") == 0) {
+			struct in_addr addr;
+			if (inet_pton(AF_INET, val, &addr) != 1) {
+				log(ERROR, "invalid gw of virtual interface %s.", name);
+				exit(1);
+			}
+			vdev->gw = ntohl(addr.s_addr);
+		}
+		else {
+			log(ERROR, "unknown option '%s' of virtual interface %s.", opt, name);
+			exit(1);
+		}
+	}
+
+	return iface;
+}
+
+// create the virtual interfaces described by USTACK_VDEV, return the number
+// of interfaces (0 if USTACK_VDEV is not set)
+int vdev_init_ifaces()
+{
+	char *env = getenv("USTACK_VDEV");
+	if (!env || !*env)
+		return 0;
+
+	init_list_head(&instance->iface_list);
+
+	char *specs = strdup(env);
+	char *save = NULL;
+	char *spec = NULL;
+	for (spec = strtok_r(specs, ";", &save); spec; spec = strtok_r(NULL, ";", &save)) {
+		iface_info_t *iface = vdev_parse_iface(spec, instance->nifs + 1);
+		list_add_tail(&iface->list, &instance->iface_list);
+		instance->nifs += 1;
+	}
+	free(specs);
+
+	char dev_names[1024] = "";
+	iface_info_t *iface = NULL;
+	list_for_each_entry(iface, &instance->iface_list, list) {
+		sprintf(dev_names + strlen(dev_names), " %s", iface->name);
+	}
+	log(DEBUG, "replay on the following virtual interfaces: %s.", dev_names);
+
+	return instance->nifs;
+}
+
+// the sent frame is written into the tx pcap file, or only counted
+void vdev_send_packet(iface_info_t *iface, const char *packet, int len)
+{
+	struct vdev *vdev = iface->vdev;
+
+	pthread_mutex_lock(&vdev->tx_lock);
+	vdev->tx_packets += 1;
+	vdev->tx_bytes += len;
+	if (vdev->tx_file) {
+		struct timeval tv;
+		if (timer_virtual_clock()) {
+			u64 now = timer_now();
+			tv.tv_sec = now / 1000;
+			tv.tv_usec = (now % 1000) * 1000;
+		}
+		else
+			gettimeofday(&tv, NULL);
+		struct pcap_rec_hdr rh = {
+			.ts_sec = tv.tv_sec,
+			.ts_usec = tv.tv_usec,
+			.incl_len = len,
+			.orig_len = len,
+		};
+		fwrite(&rh, sizeof(rh), 1, vdev->tx_file);
+		fwrite(packet, 1, len, vdev->tx_file);
+	}
+	pthread_mutex_unlock(&vdev->tx_lock);
+}
+
+// replay the frames of all the virtual interfaces in round robin, hand them
+// to handler as if they were received, and report the throughput when done
+void vdev_run(packet_handler_t handler)
+{
+	char *env = getenv("USTACK_VDEV_RATE");
+	u64 rate = env ? strtoull(env, NULL, 10) : 0;
+	env = getenv("USTACK_VDEV_LOOPS");
+	int loops = env && atoi(env) > 0 ? atoi(env) : 1;
+
+	// on the virtual clock, each frame is replayed at its capture time (from
+	// the start of each loop), and the timers due before it run first
+	int vclock = timer_virtual_clock();
+
+	u64 replayed = 0, bytes = 0;
+	u64 start = time_ns();
+	for (int loop = 0; loop < loops; loop++) {
+		u64 vstart = timer_now();
+		iface_info_t *iface = NULL;
+		list_for_each_entry(iface, &instance->iface_list, list)
+			iface->vdev->rx_pos = 0;
+
+		int remaining = 1;
+		while (remaining) {
+			remaining = 0;
+
+			// the same as ustack_run, out of any critical section of rcu
+			tx_batch_begin();
+			for (int i = 0; i < VDEV_BATCH; i++) {
+				list_for_each_entry(iface, &instance->iface_list, list) {
+					struct vdev *vdev = iface->vdev;
+					if (vdev->rx_pos >= vdev->rx_nframes)
+						continue;
+
+					// wait until the time slot of this frame
+					if (rate) {
+						u64 due = start + replayed * 1000000000ULL / rate;
+						while (time_ns() < due)
+							;
+					}
+
+					struct vdev_frame *frame = &vdev->rx_frames[vdev->rx_pos++];
+					if (vclock) {
+						u64 first = vdev->rx_frames[0].ts;
+						timer_advance(vstart + (frame->ts > first ? \
+									(frame->ts - first) / 1000 : 0));
+					}
+
+					char *packet = packet_alloc(frame->len);
+					if (!packet)
+						continue;
+					memcpy(packet, frame->data, frame->len);
+
+					vdev->rx_packets += 1;
+					vdev->rx_bytes += frame->len;
+					replayed += 1;
+					metrics_iface_rx(iface, frame->len);
+					bytes += frame->len;
+
+					latency_rx_begin();
+					handler(iface, packet, frame->len);
+					latency_rx_end();
+					remaining = 1;
+				}
+			}
+			tx_batch_end();
+		}
+	}
+	u64 elapsed = time_ns() - start;
+	if (elapsed == 0)
+		elapsed = 1;
+
+	fprintf(stdout, "replayed %lu packets (%lu bytes) in %.6f s: %.3f Mpps, "
+			"%.1f ns/packet\n", replayed, bytes, elapsed / 1e9, \
+			replayed * 1e3 / elapsed, replayed ? (double)elapsed / replayed : 0);
+	if (vclock)
+		fprintf(stdout, "virtual clock at %.3f s\n", timer_now() / 1e3);
+
+	iface_info_t *iface = NULL;
+	list_for_each_entry(iface, &instance->iface_list, list) {
+		struct vdev *vdev = iface->vdev;
+		pthread_mutex_lock(&vdev->tx_lock);
+		fprintf(stdout, "%s: rx %lu packets %lu bytes, tx %lu packets %lu bytes\n", \
+				iface->name, vdev->rx_packets, vdev->rx_bytes, \
+				vdev->tx_packets, vdev->tx_bytes);
+		if (vdev->tx_file)
+			fflush(vdev->tx_file);
+		pthread_mutex_unlock(&vdev->tx_lock);
+	}
+}
@@ -10,6 +10,7 @@
 
 #include <arpa/inet.h>
 #include <poll.h>
+#include <sys/epoll.h>
 #include <ifaddrs.h>
 
 #include <netinet/in.h>
@@ -24,16 +25,40 @@
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 
+#include <pthread.h>
+
+// max number of events handled in one round of epoll_wait
+#define USTACK_MAX_EVENTS	64
+
+// max length of a GSO super-frame received with the offloads, i.e. the 
+// ethernet header and an IP packet of up to 64KB
+#define GSO_FRAME_MAX_LEN	(ETHER_HDR_SIZE + 65535)
+
+typedef struct iface_info iface_info_t;
+
 typedef struct {
 	struct list_head iface_list;	// the list of interfaces
 	int nifs;						// number of interfaces
-	struct pollfd *fds;				// structure used to poll packets among 
-								    // all the interfaces
+	int epfd;						// epoll instance watching all the interfaces, 
+									// with the iface as the event data
+	iface_info_t **ifindex_map;		// dense map from ifindex to interface
+	int max_ifindex;				// the largest ifindex in ifindex_map
+	int rx_ring;					// receive packets through the memory-mapped 
+									// ring (PACKET_RX_RING) instead of recvfrom
+	int tx_ring;					// send packets in batch through the 
+									// memory-mapped ring (PACKET_TX_RING)
+	int vdev;						// the interfaces are virtual ones (USTACK_VDEV)
+	int offload;					// frames carry a virtio_net_hdr (PACKET_VNET_HDR),
+									// checksums and TCP segmentation are offloaded
+	int busy_poll;					// spin on the interfaces without sleeping 
+									// in epoll_wait (USTACK_BUSY_POLL)
+	int *rx_cpus;					// cpus to pin the receiving threads
+	int nr_rx_cpus;					// number of entries in rx_cpus
 } ustack_t;
 
 extern ustack_t *instance;
 
-typedef struct {
+struct iface_info {
 	struct list_head list;		// list node used to link all interfaces
 
 	int fd;						// file descriptor for receiving & sending packets
@@ -43,9 +68,43 @@ typedef struct {
 	u32 mask;					// Network Mask (in host byte order)
 	char name[16];				// name of this interface
 	char ip_str[16];			// readable IP address
-} iface_info_t;
+	struct rx_ring *rx_ring;	// memory-mapped receive ring (NULL if disabled)
+	struct tx_ring *tx_ring;	// memory-mapped transmit ring (NULL if disabled)
+	struct vdev *vdev;			// virtual interface replaying pcap files 
+								// (NULL if it is a real one)
+};
+
+// TPACKET_V3 receive ring shared with kernel, the kernel fills frames into 
+// blocks and hands over a whole block at a time
+struct rx_ring {
+	char *map;					// start address of the mapped ring
+	int map_len;				// length of the mapped ring
+	int block_size;				// size of each block
+	int block_nr;				// number of blocks in the ring
+	int cur_block;				// the next block to be walked
+};
+
+// TPACKET_V3 transmit ring shared with kernel, packets are copied into free 
+// slots and sent out in batch by a single syscall
+struct tx_ring {
+	char *map;					// start address of the mapped ring
+	int map_len;				// length of the mapped ring
+	int frame_size;				// size of each slot
+	int frame_nr;				// number of slots in the ring
+	int head;					// the next slot to be filled
+	int pending;				// number of slots queued but not flushed
+	pthread_mutex_t lock;		// packets could be sent from several threads
+};
+
+typedef void (*packet_handler_t)(iface_info_t *iface, char *packet, int len);
 
 void init_ustack();
-iface_info_t *fd_to_iface(int fd);
+void pin_rx_thread(int index);
+iface_info_t *ifindex_to_iface(int index);
 void iface_send_packet(iface_info_t *iface, const char *packet, int len);
+int iface_recv_packet(iface_info_t *iface, packet_handler_t handler);
+int iface_recv_ring(iface_info_t *iface, packet_handler_t handler);
+void iface_flush_tx(iface_info_t *iface);
+void tx_batch_begin();
+void tx_batch_end();
 #endif
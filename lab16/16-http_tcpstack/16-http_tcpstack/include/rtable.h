@@ -5,6 +5,7 @@
 #include "types.h"
 
 #include "list.h"
+#include "rcu.h"
 
 // structure of ip forwarding table
 // note: 1, the table supports only ipv4 address;
@@ -20,7 +21,22 @@ typedef struct {
 	iface_info_t *iface;	// pointer to the interface structure
 } rt_entry_t;
 
+// the version of rtable looked up on the forwarding path
+//
+// rtable is only changed by one thread at a time (the loader before
+// ustack_run, or mOSPF with mospf_lock held), which is not seen by the
+// forwarding path until publish_rtable: a copy of the table is published then,
+// and the old copy is freed after a grace period, so that the lookups take no
+// lock and always see a whole version of the table.
+struct rtable_snapshot {
+	struct rcu_head rcu;
+	int size;
+	rt_entry_t entries[];	// sorted by the length of prefix, in descending 
+							// order, so that the first match is the longest
+};
+
 extern struct list_head rtable;
+extern struct rtable_snapshot *rtable_snapshot;
 
 void init_rtable();
 void load_static_rtable();
@@ -28,6 +44,7 @@ void clear_rtable();
 void add_rt_entry(rt_entry_t *entry);
 void remove_rt_entry(rt_entry_t *entry);
 void print_rtable();
+void publish_rtable();
 rt_entry_t *new_rt_entry(u32 dest, u32 mask, u32 gw, iface_info_t *iface);
 
 rt_entry_t *longest_prefix_match(u32 ip);
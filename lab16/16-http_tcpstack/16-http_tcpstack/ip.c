@@ -6,13 +6,29 @@
 #include "tcp.h"
 
 #include "log.h"
+#include "packet_pool.h"
+#include "metrics.h"
 
 #include <stdlib.h>
 
 
 void handle_ip_packet(iface_info_t *iface, char *packet, int len)
 {
+	latency_stage(LAT_IP);
+
+	// tot_len is trusted by the upper layers, which must not run past the 
+	// received frame
 	struct iphdr *ip = packet_to_ip_hdr(packet);
+	if (len < ETHER_HDR_SIZE + IP_BASE_HDR_SIZE || \
+			IP_HDR_SIZE(ip) < IP_BASE_HDR_SIZE || \
+			ntohs(ip->tot_len) < IP_HDR_SIZE(ip) || \
+			ntohs(ip->tot_len) > len - ETHER_HDR_SIZE) {
+		log(ERROR, "received malformed IP packet, drop it.");
+		metrics_drop(DROP_MALFORMED);
+		packet_free(packet);
+		return ;
+	}
+
 	u32 daddr = ntohl(ip->daddr);
 	if (daddr == iface->ip) {
 		if (ip->protocol == IPPROTO_ICMP) {
@@ -26,12 +42,15 @@ void handle_ip_packet(iface_info_t *iface, char *packet, int len)
 		}
 		else {
 			log(ERROR, "unsupported IP protocol (0x%x) packet.", ip->protocol);
+			metrics_drop(DROP_UNKNOWN_PROTO);
 		}
 
-		free(packet);
+		packet_free(packet);
 	}
 	else {
 		// ip_forward_packet(daddr, packet, len);
 		log(ERROR, "received packet with incorrect destination IP address.");
+		metrics_drop(DROP_NOT_LOCAL);
+		packet_free(packet);
 	}
 }
@@ -0,0 +1,144 @@
+#include "packet_pool.h"
+#include "log.h"
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+static __thread struct packet_pool *local_pool;
+
+// the buffers of all the pools are carved from one arena of hugepages, so
+// that the TLB covers many more of them
+static struct arena *packet_arena;
+static pthread_once_t packet_arena_once = PTHREAD_ONCE_INIT;
+
+static void packet_arena_init()
+{
+	packet_arena = arena_create("packet_pool", PACKET_POOL_ARENA_SIZE);
+	if (!packet_arena)
+		log(ERROR, "create arena of packet pool failed, use malloc instead.");
+}
+
+static inline struct packet_buf *packet_to_buf(const char *packet)
+{
+	return (struct packet_buf *)((unsigned long)packet & ~(PACKET_BUF_SIZE - 1UL));
+}
+
+static inline char *buf_to_packet(struct packet_buf *buf)
+{
+	return (char *)buf + PACKET_DATA_OFFSET;
+}
+
+// allocate a chunk of buffers into the free list of pool
+static int packet_pool_grow(struct packet_pool *pool)
+{
+	pthread_once(&packet_arena_once, packet_arena_init);
+
+	// malloc'ed when the arena is used up
+	char *chunk = arena_alloc(packet_arena, PACKET_BUF_SIZE * PACKET_POOL_CHUNK, \
+			PACKET_BUF_SIZE);
+	if (!chunk && posix_memalign((void **)&chunk, PACKET_BUF_SIZE, \
+				PACKET_BUF_SIZE * PACKET_POOL_CHUNK) != 0)
+		return -1;
+
+	for (int i = 0; i < PACKET_POOL_CHUNK; i++) {
+		struct packet_buf *buf = (struct packet_buf *)(chunk + i * PACKET_BUF_SIZE);
+		buf->pool = pool;
+		buf->next = pool->free_list;
+		pool->free_list = buf;
+	}
+	pool->nr_bufs += PACKET_POOL_CHUNK;
+
+	return 0;
+}
+
+static struct packet_pool *get_local_pool()
+{
+	if (!local_pool) {
+		local_pool = malloc(sizeof(struct packet_pool));
+		bzero(local_pool, sizeof(struct packet_pool));
+	}
+
+	return local_pool;
+}
+
+// allocate a buffer which could hold a packet of len bytes from the pool of
+// current thread, with reference count of 1
+char *packet_alloc(int len)
+{
+	struct packet_buf *buf = NULL;
+
+	if (len > PACKET_MAX_LEN) {
+		if (posix_memalign((void **)&buf, PACKET_BUF_SIZE, \
+					PACKET_DATA_OFFSET + len) != 0) {
+			log(ERROR, "allocate packet of %d bytes failed.", len);
+			return NULL;
+		}
+		buf->pool = NULL;
+		buf->ref = 1;
+		buf->csum_valid = 0;
+		return buf_to_packet(buf);
+	}
+
+	struct packet_pool *pool = get_local_pool();
+	if (!pool->free_list) {
+		// reclaim the buffers released by other threads at once
+		pool->free_list = __atomic_exchange_n(&pool->remote_free, NULL, \
+				__ATOMIC_ACQUIRE);
+		if (!pool->free_list && packet_pool_grow(pool) < 0) {
+			log(ERROR, "grow packet pool failed.");
+			return NULL;
+		}
+	}
+
+	buf = pool->free_list;
+	pool->free_list = buf->next;
+	buf->ref = 1;
+	buf->csum_valid = 0;
+
+	return buf_to_packet(buf);
+}
+
+// take another reference of the packet, which is shared by the holders
+void packet_get(const char *packet)
+{
+	struct packet_buf *buf = packet_to_buf(packet);
+	__atomic_add_fetch(&buf->ref, 1, __ATOMIC_RELAXED);
+}
+
+// drop a reference of the packet, the buffer is returned to its pool when the
+// last reference is dropped
+void packet_free(const char *packet)
+{
+	struct packet_buf *buf = packet_to_buf(packet);
+	if (__atomic_sub_fetch(&buf->ref, 1, __ATOMIC_ACQ_REL) > 0)
+		return ;
+
+	struct packet_pool *pool = buf->pool;
+	if (!pool) {
+		free(buf);
+	}
+	else if (pool == local_pool) {
+		buf->next = pool->free_list;
+		pool->free_list = buf;
+	}
+	else {
+		// the owner only takes the whole list away, so pushing is ABA-free
+		buf->next = __atomic_load_n(&pool->remote_free, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&pool->remote_free, &buf->next, \
+					buf, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+}
+
+// mark that the checksums of the received packet need not be verified again
+void packet_set_csum_valid(const char *packet)
+{
+	packet_to_buf(packet)->csum_valid = 1;
+}
+
+int packet_csum_valid(const char *packet)
+{
+	return packet_to_buf(packet)->csum_valid;
+}
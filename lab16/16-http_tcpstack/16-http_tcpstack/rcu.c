@@ -0,0 +1,147 @@
+#include "rcu.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+
+// the epoch is only advanced by synchronize_rcu, and starts from 1, as 0
+// stands for being out of any critical section
+u64 rcu_epoch = 1;
+
+__thread struct rcu_reader rcu_reader;
+
+static struct {
+	struct list_head readers;	// reader records of the registered threads
+	pthread_mutex_t lock;		// protects readers, and serializes the grace
+								// periods
+	pthread_key_t key;			// unregisters the thread when it exits
+
+	struct rcu_head *head;		// callbacks waiting for the next grace period
+	struct rcu_head **tail;
+	pthread_mutex_t cb_lock;
+	pthread_cond_t cb_cond;
+} rcu;
+
+static pthread_once_t rcu_once = PTHREAD_ONCE_INIT;
+
+static void *rcu_thread(void *arg);
+
+static void rcu_unregister_thread(void *arg)
+{
+	struct rcu_reader *reader = arg;
+
+	pthread_mutex_lock(&rcu.lock);
+	list_delete_entry(&reader->list);
+	pthread_mutex_unlock(&rcu.lock);
+}
+
+// the callbacks are run by a thread of their own, so that writers never wait
+// for a grace period, possibly with the lock of their table held
+static void rcu_init()
+{
+	init_list_head(&rcu.readers);
+	pthread_mutex_init(&rcu.lock, NULL);
+	pthread_key_create(&rcu.key, rcu_unregister_thread);
+
+	rcu.head = NULL;
+	rcu.tail = &rcu.head;
+	pthread_mutex_init(&rcu.cb_lock, NULL);
+	pthread_cond_init(&rcu.cb_cond, NULL);
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, rcu_thread, NULL) != 0) {
+		log(ERROR, "could not create the rcu thread.");
+		exit(1);
+	}
+	pthread_detach(thread);
+}
+
+// add the calling thread into the registry, which is done on its first
+// rcu_read_lock
+void rcu_register_thread()
+{
+	pthread_once(&rcu_once, rcu_init);
+
+	struct rcu_reader *reader = &rcu_reader;
+	pthread_mutex_lock(&rcu.lock);
+	list_add_tail(&reader->list, &rcu.readers);
+	reader->registered = 1;
+	pthread_mutex_unlock(&rcu.lock);
+
+	pthread_setspecific(rcu.key, reader);
+}
+
+// wait until all the critical sections entered before are left
+//
+// A reader in a critical section entered at an earlier epoch might hold a
+// reference to what has been unpublished, the others either have left, or
+// would see the new versions.
+void synchronize_rcu()
+{
+	pthread_once(&rcu_once, rcu_init);
+
+	pthread_mutex_lock(&rcu.lock);
+
+	// unpublishing must be seen before the new epoch
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	u64 epoch = __atomic_add_fetch(&rcu_epoch, 1, __ATOMIC_SEQ_CST);
+
+	struct rcu_reader *reader;
+	list_for_each_entry(reader, &rcu.readers, list) {
+		if (reader == &rcu_reader)
+			continue;
+
+		while (1) {
+			u64 e = __atomic_load_n(&reader->epoch, __ATOMIC_ACQUIRE);
+			if (e == 0 || e >= epoch)
+				break;
+			sched_yield();
+		}
+	}
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	pthread_mutex_unlock(&rcu.lock);
+}
+
+// call func(head) after a grace period, which usually frees the object head
+// is embedded in
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+	pthread_once(&rcu_once, rcu_init);
+
+	head->next = NULL;
+	head->func = func;
+
+	pthread_mutex_lock(&rcu.cb_lock);
+	*rcu.tail = head;
+	rcu.tail = &head->next;
+	pthread_cond_signal(&rcu.cb_cond);
+	pthread_mutex_unlock(&rcu.cb_lock);
+}
+
+// take all the callbacks queued, and run them after one grace period
+static void *rcu_thread(void *arg)
+{
+	while (1) {
+		pthread_mutex_lock(&rcu.cb_lock);
+		while (!rcu.head)
+			pthread_cond_wait(&rcu.cb_cond, &rcu.cb_lock);
+
+		struct rcu_head *head = rcu.head;
+		rcu.head = NULL;
+		rcu.tail = &rcu.head;
+		pthread_mutex_unlock(&rcu.cb_lock);
+
+		synchronize_rcu();
+
+		while (head) {
+			struct rcu_head *next = head->next;
+			head->func(head);
+			head = next;
+		}
+	}
+
+	return NULL;
+}
@@ -4,12 +4,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 struct list_head rtable;
+struct rtable_snapshot *rtable_snapshot;
+
+static pthread_mutex_t publish_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void init_rtable()
 {
 	init_list_head(&rtable);
+	rtable_snapshot = NULL;
 }
 
 rt_entry_t *new_rt_entry(u32 dest, u32 mask, u32 gw, iface_info_t *iface)
@@ -65,3 +70,44 @@ void print_rtable()
 	}
 	fprintf(stdout, "--------------------------------------------------------------------------------\n");
 }
+
+static void free_rtable_snapshot(struct rcu_head *head)
+{
+	free(list_entry(head, struct rtable_snapshot, rcu));
+}
+
+// publish a copy of rtable to the forwarding path
+//
+// The entries are sorted by insertion, which keeps the order in rtable among
+// those of the same prefix length, so that the match is the same as walking
+// rtable.
+void publish_rtable()
+{
+	pthread_mutex_lock(&publish_lock);
+
+	int n = 0;
+	rt_entry_t *entry = NULL;
+	list_for_each_entry(entry, &rtable, list)
+		n += 1;
+
+	struct rtable_snapshot *snapshot = malloc(sizeof(*snapshot) + \
+			n * sizeof(rt_entry_t));
+	snapshot->size = 0;
+
+	list_for_each_entry(entry, &rtable, list) {
+		int i = snapshot->size++;
+		while (i > 0 && snapshot->entries[i-1].mask < entry->mask) {
+			snapshot->entries[i] = snapshot->entries[i-1];
+			i -= 1;
+		}
+		snapshot->entries[i] = *entry;
+		init_list_head(&snapshot->entries[i].list);
+	}
+
+	struct rtable_snapshot *old = rtable_snapshot;
+	rcu_assign_pointer(rtable_snapshot, snapshot);
+	if (old)
+		call_rcu(&old->rcu, free_rtable_snapshot);
+
+	pthread_mutex_unlock(&publish_lock);
+}
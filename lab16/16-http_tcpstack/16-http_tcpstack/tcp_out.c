@@ -5,6 +5,7 @@
 
 #include "log.h"
 #include "list.h"
+#include "packet_pool.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -30,6 +31,18 @@ static void tcp_init_hdr(struct tcphdr *tcp, u16 sport, u16 dport, u32 seq, u32
 // header and ip header (remember to set the checksum in both header), and emit 
 // the packet by calling ip_send_packet.
 void tcp_send_packet(struct tcp_sock *tsk, char *packet, int len) 
+{
+	char *payload = packet + ETHER_HDR_SIZE + IP_BASE_HDR_SIZE + TCP_BASE_HDR_SIZE;
+	u16 pl_sum = 0;
+	if (!instance->offload)
+		pl_sum = csum_partial(payload, len - (payload - packet), 0);
+
+	tcp_send_packet_csum(tsk, packet, len, pl_sum);
+}
+
+// as tcp_send_packet, with the payload summed up as pl_sum (by
+// csum_partial_copy when it was filled), so that only the header is summed up
+void tcp_send_packet_csum(struct tcp_sock *tsk, char *packet, int len, u16 pl_sum)
 {
 	struct iphdr *ip = packet_to_ip_hdr(packet);
 	struct tcphdr *tcp = (struct tcphdr *)((char *)ip + IP_BASE_HDR_SIZE);
@@ -49,7 +62,10 @@ void tcp_send_packet(struct tcp_sock *tsk, char *packet, int len)
 	tcp_init_hdr(tcp, sport, dport, seq, ack, TCP_PSH|TCP_ACK, rwnd);
 	ip_init_hdr(ip, saddr, daddr, ip_tot_len, IPPROTO_TCP); 
 
-	tcp->checksum = tcp_checksum(ip, tcp);
+	if (instance->offload)
+		tcp->checksum = tcp_tx_checksum(ip, tcp);
+	else
+		tcp->checksum = tcp_checksum_partial(ip, tcp, TCP_BASE_HDR_SIZE, pl_sum);
 
 	ip->checksum = ip_checksum(ip);
 
@@ -70,7 +86,7 @@ void tcp_send_packet(struct tcp_sock *tsk, char *packet, int len)
 void tcp_send_control_packet(struct tcp_sock *tsk, u8 flags)
 {
 	int pkt_size = ETHER_HDR_SIZE + IP_BASE_HDR_SIZE + TCP_BASE_HDR_SIZE;
-	char *packet = malloc(pkt_size);
+	char *packet = packet_alloc(pkt_size);
 	if (!packet) {
 		log(ERROR, "malloc tcp control packet failed.");
 		return ;
@@ -85,7 +101,7 @@ void tcp_send_control_packet(struct tcp_sock *tsk, u8 flags)
 	tcp_init_hdr(tcp, tsk->sk_sport, tsk->sk_dport, tsk->snd_nxt, \
 			tsk->rcv_nxt, flags, tsk->rcv_wnd);
 
-	tcp->checksum = tcp_checksum(ip, tcp);
+	tcp->checksum = tcp_tx_checksum(ip, tcp);
 
 	if (flags & (TCP_SYN|TCP_FIN))
 		tsk->snd_nxt += 1;
@@ -105,7 +121,7 @@ void tcp_send_control_packet(struct tcp_sock *tsk, u8 flags)
 void tcp_send_reset(struct tcp_cb *cb)
 {
 	int pkt_size = ETHER_HDR_SIZE + IP_BASE_HDR_SIZE + TCP_BASE_HDR_SIZE;
-	char *packet = malloc(pkt_size);
+	char *packet = packet_alloc(pkt_size);
 	if (!packet) {
 		log(ERROR, "malloc tcp control packet failed.");
 		return ;
@@ -117,7 +133,7 @@ void tcp_send_reset(struct tcp_cb *cb)
 	u16 tot_len = IP_BASE_HDR_SIZE + TCP_BASE_HDR_SIZE;
 	ip_init_hdr(ip, cb->daddr, cb->saddr, tot_len, IPPROTO_TCP);
 	tcp_init_hdr(tcp, cb->dport, cb->sport, 0, cb->seq_end, TCP_RST|TCP_ACK, 0);
-	tcp->checksum = tcp_checksum(ip, tcp);
+	tcp->checksum = tcp_tx_checksum(ip, tcp);
 
 	ip_send_packet(packet, pkt_size);
 }
@@ -5,6 +5,7 @@
 #include "ip.h"
 #include "rtable.h"
 #include "log.h"
+#include "packet_pool.h"
 
 // TCP socks should be hashed into table for later lookup: Those which
 // occupy a port (either by *bind* or *connect*) should be hashed into
@@ -27,21 +28,12 @@ inline void tcp_set_state(struct tcp_sock *tsk, int state)
 	tsk->state = state;
 }
 
-// init tcp hash table and tcp timer
+// init tcp hash table
 void init_tcp_stack()
 {
-	for (int i = 0; i < TCP_HASH_SIZE; i++)
-		init_list_head(&tcp_established_sock_table[i]);
-
-	for (int i = 0; i < TCP_HASH_SIZE; i++)
-		init_list_head(&tcp_listen_sock_table[i]);
-
-	for (int i = 0; i < TCP_HASH_SIZE; i++)
-		init_list_head(&tcp_bind_sock_table[i]);
-
-	pthread_t timer_wait, timer_retrans;
-	pthread_create(&timer_wait, NULL, tcp_timer_thread, NULL);
-	pthread_create(&timer_retrans, NULL, tcp_retrans_timer_thread, NULL);
+	htable_init(&tcp_established_sock_table);
+	htable_init(&tcp_listen_sock_table);
+	htable_init(&tcp_bind_sock_table);
 }
 
 // allocate tcp sock, and initialize all the variables that can be determined
@@ -72,8 +64,7 @@ struct tcp_sock *alloc_tcp_sock()
 	tsk->wait_recv = alloc_wait_struct();
 	tsk->wait_send = alloc_wait_struct();
 
-	tsk->timewait.enable = 0;
-	tsk->retrans_timer.enable = 0;
+	tcp_init_timers(tsk);
 
 	log(DEBUG, "alloc a new tcp sock, ref_cnt = 1");
 	tsk->ref_cnt += 1;
@@ -97,6 +88,7 @@ void free_tcp_sock(struct tcp_sock *tsk)
 				HOST_IP_FMT_STR(tsk->sk_sip), tsk->sk_sport,
 				HOST_IP_FMT_STR(tsk->sk_dip), tsk->sk_dport);
 		
+		tcp_del_timers(tsk);
 		free_ring_buffer(tsk->rcv_buf);
 
 		free_wait_struct(tsk->wait_connect);
@@ -108,25 +100,31 @@ void free_tcp_sock(struct tcp_sock *tsk)
 	} 
 }
 
+// whether the tcp sock has the key (local, peer) of established_table
+static int tcp_sock_eq(const void *entry, const void *key)
+{
+	const struct tcp_sock *tsk = entry;
+	const struct sock_addr *addr = key;
+
+	return tsk->sk_sip == addr[0].ip && tsk->sk_sport == addr[0].port && \
+		tsk->sk_dip == addr[1].ip && tsk->sk_dport == addr[1].port;
+}
+
+// whether the tcp sock has the key (sport) of listen_table or bind_table
+static int tcp_sock_eq_port(const void *entry, const void *key)
+{
+	return ((const struct tcp_sock *)entry)->sk_sport == *(const u16 *)key;
+}
+
 // lookup tcp sock in established_table with key (saddr, daddr, sport, dport)
 struct tcp_sock *tcp_sock_lookup_established(u32 saddr, u32 daddr, u16 sport, u16 dport)
 {
 	//fprintf(stdout, "TODO: implement %s please.\n", __FUNCTION__);
 
-	int value = tcp_hash_function(saddr, daddr, sport, dport);
-	struct list_head *list = &tcp_established_sock_table[value];
-
-	struct tcp_sock *sock_p;
-	list_for_each_entry(sock_p, list, hash_list) {
-		if (
-			saddr == sock_p->sk_sip && daddr == sock_p->sk_dip &&
-			sport == sock_p->sk_sport && dport == sock_p->sk_dport
-		) {
-			return sock_p;
-		}
-	}
+	struct sock_addr key[2] = { { saddr, sport }, { daddr, dport } };
 
-	return NULL;
+	return htable_lookup(&tcp_established_sock_table, \
+			tcp_hash_function(saddr, daddr, sport, dport), key, tcp_sock_eq);
 }
 
 // lookup tcp sock in listen_table with key (sport)
@@ -136,17 +134,8 @@ struct tcp_sock *tcp_sock_lookup_listen(u32 saddr, u16 sport)
 {
 	//fprintf(stdout, "TODO: implement %s please.\n", __FUNCTION__);
 
-	int value = tcp_hash_function(0, 0, sport, 0);
-	struct list_head *list = &tcp_listen_sock_table[value];
-
-	struct tcp_sock *sock_p;
-	list_for_each_entry(sock_p, list, hash_list) {
-		if (sport == sock_p->sk_sport) {
-			return sock_p;
-		}
-	}
-
-	return NULL;
+	return htable_lookup(&tcp_listen_sock_table, tcp_hash_function(0, 0, sport, 0), \
+			&sport, tcp_sock_eq_port);
 }
 
 // lookup tcp sock in both established_table and listen_table
@@ -167,9 +156,8 @@ struct tcp_sock *tcp_sock_lookup(struct tcp_cb *cb)
 // hash tcp sock into bind_table, using sport as the key
 static int tcp_bind_hash(struct tcp_sock *tsk)
 {
-	int bind_hash_value = tcp_hash_function(0, 0, tsk->sk_sport, 0);
-	struct list_head *list = &tcp_bind_sock_table[bind_hash_value];
-	list_add_head(&tsk->bind_hash_list, list);
+	htable_insert(&tcp_bind_sock_table, tcp_hash_function(0, 0, tsk->sk_sport, 0), tsk);
+	tsk->bind_hashed = 1;
 
 	tsk->ref_cnt += 1;
 
@@ -179,8 +167,9 @@ static int tcp_bind_hash(struct tcp_sock *tsk)
 // unhash the tcp sock from bind_table
 void tcp_bind_unhash(struct tcp_sock *tsk)
 {
-	if (!list_empty(&tsk->bind_hash_list)) {
-		list_delete_entry(&tsk->bind_hash_list);
+	if (tsk->bind_hashed) {
+		htable_remove(&tcp_bind_sock_table, tcp_hash_function(0, 0, tsk->sk_sport, 0), tsk);
+		tsk->bind_hashed = 0;
 		free_tcp_sock(tsk);
 	}
 }
@@ -188,15 +177,8 @@ void tcp_bind_unhash(struct tcp_sock *tsk)
 // lookup bind_table to check whether sport is in use
 static int tcp_port_in_use(u16 sport)
 {
-	int value = tcp_hash_function(0, 0, sport, 0);
-	struct list_head *list = &tcp_bind_sock_table[value];
-	struct tcp_sock *tsk;
-	list_for_each_entry(tsk, list, bind_hash_list) {
-		if (tsk->sk_sport == sport)
-			return 1;
-	}
-
-	return 0;
+	return htable_lookup(&tcp_bind_sock_table, tcp_hash_function(0, 0, sport, 0), \
+			&sport, tcp_sock_eq_port) != NULL;
 }
 
 // find a free port by looking up bind_table
@@ -228,32 +210,29 @@ static int tcp_sock_set_sport(struct tcp_sock *tsk, u16 port)
 // TCP_STATE
 int tcp_hash(struct tcp_sock *tsk)
 {
-	struct list_head *list;
-	int hash;
+	struct htable *table;
+	u64 hash;
 
 	if (tsk->state == TCP_CLOSED)
 		return -1;
 
 	if (tsk->state == TCP_LISTEN) {
 		hash = tcp_hash_function(0, 0, tsk->sk_sport, 0);
-		list = &tcp_listen_sock_table[hash];
+		table = &tcp_listen_sock_table;
 	}
 	else {
-		int hash = tcp_hash_function(tsk->sk_sip, tsk->sk_dip, \
+		hash = tcp_hash_function(tsk->sk_sip, tsk->sk_dip, \
 				tsk->sk_sport, tsk->sk_dport); 
-		list = &tcp_established_sock_table[hash];
-
-		struct tcp_sock *tmp;
-		list_for_each_entry(tmp, list, hash_list) {
-			if (tsk->sk_sip == tmp->sk_sip &&
-					tsk->sk_dip == tmp->sk_dip &&
-					tsk->sk_sport == tmp->sk_sport &&
-					tsk->sk_dport == tmp->sk_dport)
-				return -1;
-		}
+		table = &tcp_established_sock_table;
+
+		struct sock_addr key[2] = { tsk->local, tsk->peer };
+		if (htable_lookup(table, hash, key, tcp_sock_eq))
+			return -1;
 	}
 
-	list_add_head(&tsk->hash_list, list);
+	htable_insert(table, hash, tsk);
+	tsk->hash_table = table;
+	tsk->hash = hash;
 	tsk->ref_cnt += 1;
 
 	return 0;
@@ -262,8 +241,9 @@ int tcp_hash(struct tcp_sock *tsk)
 // unhash tcp sock from established_table or listen_table
 void tcp_unhash(struct tcp_sock *tsk)
 {
-	if (!list_empty(&tsk->hash_list)) {
-		list_delete_entry(&tsk->hash_list);
+	if (tsk->hash_table) {
+		htable_remove(tsk->hash_table, tsk->hash, tsk);
+		tsk->hash_table = NULL;
 		free_tcp_sock(tsk);
 	}
 }
@@ -296,12 +276,15 @@ int tcp_sock_connect(struct tcp_sock *tsk, struct sock_addr *skaddr)
 	tsk->sk_dip = ntohl(skaddr->ip);
 	tsk->sk_dport = ntohs(skaddr->port);
 
+	rcu_read_lock();
 	rt_entry_t * rt = longest_prefix_match(tsk->sk_dip);
 	if (!rt) {
+		rcu_read_unlock();
 		log(ERROR, "cannot find route to dest_ip.");
 		return -1;
 	}
 	tsk->sk_sip = rt->iface->ip;
+	rcu_read_unlock();
 
 	err = tcp_sock_set_sport(tsk, 0);
 	if (err) {
@@ -458,16 +441,27 @@ int tcp_sock_write(struct tcp_sock *tsk, char *buf, int len) {
 	}
 
 	while (remain_len) {
-		send_len = min(remain_len, 1514 - ETHER_HDR_SIZE - IP_BASE_HDR_SIZE - TCP_BASE_HDR_SIZE);
+		// with the offloads, up to 64KB are sent as a super-segment, which is 
+		// split into frames of TCP_MSS by the device, while it is cut down to
+		// the sending window (in whole TCP_MSS) if the window is smaller
+		send_len = min(remain_len, instance->offload ? TCP_GSO_MAX_DATA : TCP_MSS);
+		if (send_len > TCP_MSS && tsk->snd_wnd < send_len)
+			send_len = tsk->snd_wnd > TCP_MSS ? tsk->snd_wnd / TCP_MSS * TCP_MSS : TCP_MSS;
 		if (tsk->snd_wnd < send_len) {
 			sleep_on(tsk->wait_send);
 		}
 		packet_len = send_len + ETHER_HDR_SIZE + IP_BASE_HDR_SIZE + TCP_BASE_HDR_SIZE;
-		char *packet = (char *)malloc(packet_len);
-		memcpy(packet + ETHER_HDR_SIZE + IP_BASE_HDR_SIZE + TCP_BASE_HDR_SIZE, buf + handled_len, send_len);
-		tcp_send_packet(tsk, packet, packet_len);
+		char *packet = packet_alloc(packet_len);
+		char *payload = packet + ETHER_HDR_SIZE + IP_BASE_HDR_SIZE + TCP_BASE_HDR_SIZE;
+		// the payload is summed up in the same pass as copied, unless the
+		// device does it
+		u16 pl_sum = 0;
+		if (instance->offload)
+			memcpy(payload, buf + handled_len, send_len);
+		else
+			pl_sum = csum_partial_copy(payload, buf + handled_len, send_len, 0);
+		tcp_send_packet_csum(tsk, packet, packet_len, pl_sum);
 
-		tsk->snd_wnd -= send_len;
 		remain_len -= send_len;
 		handled_len += send_len;
 	}
@@ -480,9 +474,10 @@ void tcp_send_buffer_add_packet(struct tcp_sock *tsk, char *packet, int len) {
     send_buffer_entry_t *send_buffer_entry = (send_buffer_entry_t *)malloc(sizeof(send_buffer_entry_t));
     memset(send_buffer_entry, 0, sizeof(send_buffer_entry_t));
 
-    send_buffer_entry->packet = (char *)malloc(len);
+    // hold a reference of the packet being sent, instead of a copy of it
+    packet_get(packet);
+    send_buffer_entry->packet = packet;
     send_buffer_entry->len = len;
-    memcpy(send_buffer_entry->packet, packet, len);
 
     init_list_head(&send_buffer_entry->list);
 
@@ -497,14 +492,16 @@ void tcp_update_send_buffer(struct tcp_sock *tsk, u32 ack) {
 	pthread_mutex_lock(&tsk->send_buf_lock);
 
     list_for_each_entry_safe(send_buffer_entry, send_buffer_entry_q, &tsk->send_buf, list) {
+        struct iphdr *ip = packet_to_ip_hdr(send_buffer_entry->packet);
         struct tcphdr *tcp = packet_to_tcp_hdr(send_buffer_entry->packet);
-        u32 seq = ntohl(tcp->seq);
+        u32 seq_end = tcp_seq_end(ip, tcp);
 
-        // If the sequence number is less than the acknowledgment number, delete the entry
-        if (less_than_32b(seq, ack)) {
+        // If the whole packet is acknowledged, delete the entry (a super-segment
+        // is acknowledged in pieces, one for each frame split by the device)
+        if (less_or_equal_32b(seq_end, ack)) {
 			//log(DEBUG, "delete %d %d\n", seq, ack);
             list_delete_entry(&send_buffer_entry->list);
-            free(send_buffer_entry->packet);
+            packet_free(send_buffer_entry->packet);
             free(send_buffer_entry);
         }
     }
@@ -524,7 +521,7 @@ int tcp_retrans_send_buffer(struct tcp_sock *tsk) {
     // Retrieve the first send buffer entry
     send_buffer_entry_t *first_send_buffer_entry = list_entry(tsk->send_buf.next, send_buffer_entry_t, list);
 
-    char *packet = (char *)malloc(first_send_buffer_entry->len);
+    char *packet = packet_alloc(first_send_buffer_entry->len);
 
     // Copy the packet data and update TCP sequence and acknowledgment numbers
     memcpy(packet, first_send_buffer_entry->packet, first_send_buffer_entry->len);
@@ -532,7 +529,7 @@ int tcp_retrans_send_buffer(struct tcp_sock *tsk) {
     struct tcphdr *tcp = packet_to_tcp_hdr(packet);
 
     tcp->ack = htonl(tsk->rcv_nxt);
-    tcp->checksum = tcp_checksum(ip, tcp);
+    tcp->checksum = tcp_tx_checksum(ip, tcp);
     ip->checksum = ip_checksum(ip);
 
     // Calculate TCP data length and update TCP send window
@@ -558,8 +555,15 @@ int tcp_recv_ofo_buffer_add_packet(struct tcp_sock *tsk, struct tcp_cb *cb) {
     recv_ofo_entry->seq = cb->seq;
 	recv_ofo_entry->seq_end = cb->seq_end;
     recv_ofo_entry->len = cb->pl_len;
-    recv_ofo_entry->data = (char *)malloc(cb->pl_len);
-    memcpy(recv_ofo_entry->data, cb->payload, cb->pl_len);
+    // take the copy made when the checksum was verified, if any
+    if (cb->data) {
+        recv_ofo_entry->data = cb->data;
+        cb->data = NULL;
+    }
+    else {
+        recv_ofo_entry->data = (char *)malloc(cb->pl_len);
+        memcpy(recv_ofo_entry->data, cb->payload, cb->pl_len);
+    }
 
     init_list_head(&recv_ofo_entry->list);
 
@@ -567,6 +571,8 @@ int tcp_recv_ofo_buffer_add_packet(struct tcp_sock *tsk, struct tcp_cb *cb) {
     recv_ofo_buf_entry_t *entry, *entry_q;
     list_for_each_entry_safe (entry, entry_q, &tsk->rcv_ofo_buf, list) {
         if (recv_ofo_entry->seq == entry->seq) {
+            free(recv_ofo_entry->data);
+            free(recv_ofo_entry);
             return 1; // same seq, do not add
         }
         if (less_than_32b(recv_ofo_entry->seq, entry->seq)) {
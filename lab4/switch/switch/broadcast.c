@@ -1,18 +1,29 @@
 #include "base.h"
 #include <stdio.h>
+#include <stdlib.h>
 
 // XXX ifaces are stored in instace->iface_list
 extern ustack_t *instance;
 
-extern void iface_send_packet(iface_info_t *iface, const char *packet, int len);
+// the ports a frame is flooded to are the same for every frame received on a
+// port, so they are listed once for each port instead of walking iface_list
+// for each frame
+void init_flood_ports()
+{
+	iface_info_t *iface, *iface_entry;
+	list_for_each_entry(iface, &instance->iface_list, list) {
+		iface->flood_ports = malloc(sizeof(iface_info_t *) * instance->nifs);
+		iface->nr_flood_ports = 0;
+		list_for_each_entry(iface_entry, &instance->iface_list, list) {
+			if (iface_entry != iface)
+				iface->flood_ports[iface->nr_flood_ports++] = iface_entry;
+		}
+	}
+}
 
 void broadcast_packet(iface_info_t *iface, const char *packet, int len)
 {
 	// TODO: broadcast packet 
 	// fprintf(stdout, "TODO: broadcast packet.\n");
-	iface_info_t *iface_entry;
-	list_for_each_entry(iface_entry, &instance -> iface_list, list) {
-		if (iface_entry -> fd != iface -> fd)
-			iface_send_packet(iface_entry, packet, len);
-	}
+	iface_flood_packet(iface->flood_ports, iface->nr_flood_ports, packet, len);
 }
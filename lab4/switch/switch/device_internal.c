@@ -1,49 +1,490 @@
+#define _GNU_SOURCE
+
 #include "base.h"
 #include "ether.h"
 #include "log.h"
+#include "packet_pool.h"
+#include "vdev.h"
+#include "xsk.h"
+#include "metrics.h"
+#include "rcu.h"
+#include "vlan.h"
 
 #include <stdlib.h>
+#include <sched.h>
+#include <linux/filter.h>
+#include <sys/mman.h>
+
+#define RX_RING_BLOCK_SIZE	(1 << 16)	// size of each block in rx ring
+#define RX_RING_BLOCK_NR	64			// number of blocks in rx ring
+#define RX_RING_FRAME_SIZE	2048		// (nominal) size of each frame
+#define RX_RING_BLOCK_TMO	1			// retire a partly filled block after 1ms
+
+#define TX_RING_BLOCK_SIZE	(1 << 16)	// size of each block in tx ring
+#define TX_RING_BLOCK_NR	8			// number of blocks in tx ring
+#define TX_RING_FRAME_SIZE	2048		// size of each slot in tx ring
+#define TX_RING_BATCH		64			// flush the tx ring once so many queued
+#define TX_QUEUE_LEN		64			// flush a tx queue once so many queued
+
+// the frame data follows the (aligned) tpacket3_hdr in each tx slot
+#define TX_RING_DATA_OFFSET	(TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
 
 ustack_t *instance;
 
-iface_info_t *fd_to_iface(int fd)
+// whether the packets sent by this thread are deferred until tx_batch_end
+static __thread int tx_batching;
+
+// packets deferred by a thread toward one interface, which are sent out by one
+// sendmmsg (or queued into the tx ring under one lock) when flushed
+//
+// The packets are held by reference instead of copied, so only those from the
+// packet pool (i.e. the received ones) could be sent in a batch.
+struct tx_queue {
+	struct list_head list;		// link in the queues with packets of the thread
+	int n;						// number of packets queued
+	const char *packets[TX_QUEUE_LEN];
+	int lens[TX_QUEUE_LEN];
+};
+
+static __thread struct tx_queue *tx_queues;	// queue of each ifindex
+static __thread struct list_head tx_dirty;	// the queues with packets
+
+// get the interface according to ifindex, NULL if it is not one of ours
+iface_info_t *ifindex_to_iface(int index)
+{
+	if (index <= 0 || index > instance->max_ifindex)
+		return NULL;
+
+	return instance->ifindex_map[index];
+}
+
+// kick kernel to send out all the packets queued in the tx ring of iface
+void iface_flush_tx(iface_info_t *iface)
 {
+	if (iface->xsk) {
+		xsk_flush_tx(iface);
+		return ;
+	}
+
+	struct tx_ring *ring = iface->tx_ring;
+	if (!ring || !__atomic_load_n(&ring->pending, __ATOMIC_RELAXED))
+		return ;
+
+	pthread_mutex_lock(&ring->lock);
+	ring->pending = 0;
+	pthread_mutex_unlock(&ring->lock);
+
+	if (send(iface->fd, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN)
+		perror("Flush tx ring failed");
+}
+
+// defer the packets sent by this thread, until tx_batch_end is called
+void tx_batch_begin()
+{
+	tx_batching = 1;
+}
+
+static void tx_queue_flush(iface_info_t *iface, struct tx_queue *q);
+
+// stop deferring, flush the packets queued by this thread toward each 
+// interface, and the tx ring of each interface
+void tx_batch_end()
+{
+	tx_batching = 0;
+
+	if (tx_queues) {
+		struct tx_queue *q, *next;
+		list_for_each_entry_safe(q, next, &tx_dirty, list)
+			tx_queue_flush(instance->ifindex_map[q - tx_queues], q);
+	}
+
+	if (!instance->tx_ring && !instance->xdp)
+		return ;
+
 	iface_info_t *iface = NULL;
 	list_for_each_entry(iface, &instance->iface_list, list) {
-		if (iface->fd == fd)
-			return iface;
+		iface_flush_tx(iface);
 	}
+}
 
-	log(ERROR, "Could not find the desired interface according to fd %d", fd);
+static inline int tx_slot_free(struct tpacket3_hdr *hdr)
+{
+	u32 status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+	return status == TP_STATUS_AVAILABLE || status == TP_STATUS_WRONG_FORMAT;
+}
 
-	return NULL;
+// copy the n packets into free slots of the tx ring of iface, under one lock, 
+// return the number of packets copied (the rest could not fit into the ring)
+//
+// The slots are sent out immediately, unless this thread is in a tx batch 
+// (the packets are handled in ustack_run) which will be flushed when the 
+// batch ends, or TX_RING_BATCH packets have been queued.
+static int iface_queue_packets(iface_info_t *iface, const char **packets, \
+		const int *lens, int n)
+{
+	struct tx_ring *ring = iface->tx_ring;
+	int i;
+
+	pthread_mutex_lock(&ring->lock);
+	for (i = 0; i < n; i++) {
+		if (lens[i] > ring->frame_size - TX_RING_DATA_OFFSET)
+			break;
+
+		struct tpacket3_hdr *hdr = (struct tpacket3_hdr *) \
+			(ring->map + ring->head * ring->frame_size);
+		if (!tx_slot_free(hdr)) {
+			// all the slots are in use, kick kernel to send them out without 
+			// waiting (we are in the middle of a batch), and fall back to 
+			// sendto if no slot is freed yet
+			pthread_mutex_unlock(&ring->lock);
+			iface_flush_tx(iface);
+			pthread_mutex_lock(&ring->lock);
+
+			hdr = (struct tpacket3_hdr *)(ring->map + ring->head * ring->frame_size);
+			if (!tx_slot_free(hdr))
+				break;
+		}
+
+		memcpy((char *)hdr + TX_RING_DATA_OFFSET, packets[i], lens[i]);
+		hdr->tp_len = lens[i];
+		hdr->tp_next_offset = 0;
+		__atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+		ring->head = (ring->head + 1) % ring->frame_nr;
+		ring->pending += 1;
+	}
+	int pending = ring->pending;
+	pthread_mutex_unlock(&ring->lock);
+
+	if (i > 0 && (!tx_batching || pending >= TX_RING_BATCH))
+		iface_flush_tx(iface);
+
+	return i;
+}
+
+static void init_tx_addr(iface_info_t *iface, struct sockaddr_ll *addr, \
+		const char *packet)
+{
+	memset(addr, 0, sizeof(struct sockaddr_ll));
+	addr->sll_family = AF_PACKET;
+	addr->sll_ifindex = iface->index;
+	addr->sll_halen = ETH_ALEN;
+	addr->sll_protocol = htons(ETH_P_ARP);
+	struct ether_header *eh = (struct ether_header *)packet;
+	memcpy(addr->sll_addr, eh->ether_dhost, ETH_ALEN);
+}
+
+// send out the packets queued toward iface, into the tx ring if enabled, or by
+// one sendmmsg, and drop the references to them
+static void tx_queue_flush(iface_info_t *iface, struct tx_queue *q)
+{
+	int n = 0;
+	if (iface->tx_ring)
+		n = iface_queue_packets(iface, q->packets, q->lens, q->n);
+
+	if (n < q->n) {
+		// the frames are sent as they are, the address of the first one 
+		// serves them all
+		struct sockaddr_ll addr;
+		init_tx_addr(iface, &addr, q->packets[n]);
+
+		struct mmsghdr msgs[TX_QUEUE_LEN];
+		struct iovec iovs[TX_QUEUE_LEN];
+		int nmsgs = q->n - n;
+		bzero(msgs, sizeof(struct mmsghdr) * nmsgs);
+		for (int i = 0; i < nmsgs; i++) {
+			iovs[i].iov_base = (void *)q->packets[n + i];
+			iovs[i].iov_len = q->lens[n + i];
+			msgs[i].msg_hdr.msg_name = &addr;
+			msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_ll);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int sent = 0;
+		while (sent < nmsgs) {
+			int ret = sendmmsg(iface->fd, msgs + sent, nmsgs - sent, 0);
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				perror("Send raw packets failed");
+				for (; sent < nmsgs; sent++)
+					metrics_drop(DROP_TX_ERROR);
+				break;
+			}
+			sent += ret;
+		}
+	}
+
+	for (int i = 0; i < q->n; i++)
+		packet_free(q->packets[i]);
+	q->n = 0;
+	list_delete_entry(&q->list);
+}
+
+// defer the packet toward iface into the queue of this thread, holding a
+// reference to it
+static void tx_queue_packet(iface_info_t *iface, const char *packet, int len)
+{
+	if (!tx_queues) {
+		int size = sizeof(struct tx_queue) * (instance->max_ifindex + 1);
+		tx_queues = malloc(size);
+		bzero(tx_queues, size);
+		init_list_head(&tx_dirty);
+	}
+
+	struct tx_queue *q = &tx_queues[iface->index];
+	if (q->n == 0)
+		list_add_tail(&q->list, &tx_dirty);
+
+	packet_get(packet);
+	q->packets[q->n] = packet;
+	q->lens[q->n] = len;
+	if (++q->n == TX_QUEUE_LEN)
+		tx_queue_flush(iface, q);
 }
 
 void iface_send_packet(iface_info_t *iface, const char *packet, int len)
 {
+	metrics_iface_tx(iface, len);
+
+	if (iface->vdev) {
+		vdev_send_packet(iface, packet, len);
+		return ;
+	}
+
+	if (iface->xsk) {
+		if (xsk_send_packet(iface, packet, len, !tx_batching) < 0)
+			metrics_drop(DROP_TX_ERROR);
+		return ;
+	}
+
+	// the packets of this thread toward each interface are sent in batch
+	if (tx_batching) {
+		tx_queue_packet(iface, packet, len);
+		return ;
+	}
+
+	if (iface->tx_ring && iface_queue_packets(iface, &packet, &len, 1) == 1)
+		return ;
+
 	struct sockaddr_ll addr;
-	memset(&addr, 0, sizeof(struct sockaddr_ll));
-	addr.sll_family = AF_PACKET;
-	addr.sll_ifindex = iface->index;
-	addr.sll_halen = ETH_ALEN;
-	addr.sll_protocol = htons(ETH_P_ARP);
-	struct ether_header *eh = (struct ether_header *)packet;
-	memcpy(addr.sll_addr, eh->ether_dhost, ETH_ALEN);
+	init_tx_addr(iface, &addr, packet);
 
 	if (sendto(iface->fd, packet, len, 0, (const struct sockaddr *)&addr,
 				sizeof(struct sockaddr_ll)) < 0) {
 		perror("Send raw packet failed");
+		metrics_drop(DROP_TX_ERROR);
+	}
+}
+
+// send the packet out of each of the n interfaces
+//
+// In a tx batch, the one buffer is referenced by the tx queues of all of them
+// (see tx_queue) without copies, and each queue is flushed by one syscall, so
+// flooding does not cost a syscall for each port and each frame.
+void iface_flood_packet(iface_info_t **ifaces, int n, const char *packet, int len)
+{
+	if (!tx_batching || instance->vdev || instance->xdp) {
+		for (int i = 0; i < n; i++)
+			iface_send_packet(ifaces[i], packet, len);
+		return ;
+	}
+
+	for (int i = 0; i < n; i++) {
+		metrics_iface_tx(ifaces[i], len);
+		tx_queue_packet(ifaces[i], packet, len);
+	}
+}
+
+// walk all the blocks handed over by kernel in the rx ring (of iface), hand 
+// each frame to handler, and return the blocks to kernel
+//
+// The frame is copied into a buffer from the packet pool, as handler owns the 
+// packet and may cache it after the block is returned.
+static int recv_ring(iface_info_t *iface, struct rx_ring *ring, \
+		packet_handler_t handler)
+{
+	int n = 0;
+
+	while (1) {
+		struct tpacket_block_desc *bd = (struct tpacket_block_desc *) \
+			(ring->map + ring->cur_block * ring->block_size);
+		if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) \
+					& TP_STATUS_USER))
+			break;
+
+		int num_pkts = bd->hdr.bh1.num_pkts;
+		struct tpacket3_hdr *hdr = (struct tpacket3_hdr *) \
+			((char *)bd + bd->hdr.bh1.offset_to_first_pkt);
+		for (int i = 0; i < num_pkts; i++) {
+			struct sockaddr_ll *sll = (struct sockaddr_ll *) \
+				((char *)hdr + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+			// XXX: the same as recvfrom, outgoing packets are captured as well
+			if (sll->sll_pkttype != PACKET_OUTGOING) {
+				int len = hdr->tp_snaplen;
+				char *packet = packet_alloc(len + VLAN_HLEN);
+				if (packet) {
+					memcpy(packet, (char *)hdr + hdr->tp_mac, len);
+					// put back the vlan tag stripped by the kernel
+					if (instance->vlan && (hdr->tp_status & TP_STATUS_VLAN_VALID) \
+							&& len >= 2 * ETH_ALEN) {
+						packet = vlan_push_tag(packet, hdr->hv1.tp_vlan_tci);
+						len += VLAN_HLEN;
+					}
+					metrics_iface_rx(iface, len);
+					latency_rx_begin();
+					handler(iface, packet, len);
+					latency_rx_end();
+					n += 1;
+				}
+				else {
+					metrics_drop(DROP_NO_BUFFER);
+				}
+			}
+
+			hdr = (struct tpacket3_hdr *)((char *)hdr + hdr->tp_next_offset);
+		}
+
+		__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, \
+				__ATOMIC_RELEASE);
+		ring->cur_block = (ring->cur_block + 1) % ring->block_nr;
+	}
+
+	return n;
+}
+
+// receive the packets in the rx ring of iface
+int iface_recv_ring(iface_info_t *iface, packet_handler_t handler)
+{
+	return recv_ring(iface, iface->rx_ring, handler);
+}
+
+// set up the TPACKET_V3 rings on socket sd, and map them into user space, the 
+// rx (tx) ring is skipped if rx (tx) is NULL
+static int setup_packet_rings(int sd, struct rx_ring **rx, struct tx_ring **tx)
+{
+	int version = TPACKET_V3;
+	if (setsockopt(sd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+		perror("setsockopt() PACKET_VERSION failed!");
+		return -1;
 	}
+
+	struct tpacket_req3 req;
+	int rx_len = 0, tx_len = 0;
+	if (rx) {
+		bzero(&req, sizeof(req));
+		req.tp_block_size = RX_RING_BLOCK_SIZE;
+		req.tp_block_nr = RX_RING_BLOCK_NR;
+		req.tp_frame_size = RX_RING_FRAME_SIZE;
+		req.tp_frame_nr = (RX_RING_BLOCK_SIZE / RX_RING_FRAME_SIZE) * RX_RING_BLOCK_NR;
+		req.tp_retire_blk_tov = RX_RING_BLOCK_TMO;
+		if (setsockopt(sd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+			perror("setsockopt() PACKET_RX_RING failed!");
+			return -1;
+		}
+		rx_len = RX_RING_BLOCK_SIZE * RX_RING_BLOCK_NR;
+	}
+
+	if (tx) {
+		bzero(&req, sizeof(req));
+		req.tp_block_size = TX_RING_BLOCK_SIZE;
+		req.tp_block_nr = TX_RING_BLOCK_NR;
+		req.tp_frame_size = TX_RING_FRAME_SIZE;
+		req.tp_frame_nr = (TX_RING_BLOCK_SIZE / TX_RING_FRAME_SIZE) * TX_RING_BLOCK_NR;
+		if (setsockopt(sd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+			perror("setsockopt() PACKET_TX_RING failed!");
+			return -1;
+		}
+		tx_len = TX_RING_BLOCK_SIZE * TX_RING_BLOCK_NR;
+	}
+
+	// rx ring and tx ring are mapped in one area, rx ring goes first
+	char *map = mmap(NULL, rx_len + tx_len, PROT_READ | PROT_WRITE, \
+			MAP_SHARED | MAP_LOCKED | MAP_POPULATE, sd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap() packet rings failed!");
+		return -1;
+	}
+
+	if (rx) {
+		struct rx_ring *ring = malloc(sizeof(struct rx_ring));
+		bzero(ring, sizeof(struct rx_ring));
+		ring->map = map;
+		ring->map_len = rx_len;
+		ring->block_size = RX_RING_BLOCK_SIZE;
+		ring->block_nr = RX_RING_BLOCK_NR;
+		*rx = ring;
+	}
+
+	if (tx) {
+		struct tx_ring *ring = malloc(sizeof(struct tx_ring));
+		bzero(ring, sizeof(struct tx_ring));
+		ring->map = map + rx_len;
+		ring->map_len = tx_len;
+		ring->frame_size = TX_RING_FRAME_SIZE;
+		ring->frame_nr = tx_len / TX_RING_FRAME_SIZE;
+		pthread_mutex_init(&ring->lock, NULL);
+		*tx = ring;
+	}
+
+	return 0;
+}
+
+// frames sent by ourselves are dropped, all the others are forwarded by the
+// switch, whatever their ether types are
+static struct sock_filter rx_filter[] = {
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 1, 0),
+	BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+	BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+// attach rx_filter to socket sd, so that the unwanted frames are dropped in
+// kernel, without waking us up or copying them to userspace
+static int attach_rx_filter(int sd)
+{
+	struct sock_fprog prog = {
+		.len = sizeof(rx_filter) / sizeof(struct sock_filter),
+		.filter = rx_filter,
+	};
+	if (setsockopt(sd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+		perror("setsockopt() SO_ATTACH_FILTER failed!");
+		return -1;
+	}
+
+	// the vlan tags stripped from the frames are received as auxdata
+	int on = 1;
+	if (instance->vlan && \
+			setsockopt(sd, SOL_PACKET, PACKET_AUXDATA, &on, sizeof(on)) < 0) {
+		perror("setsockopt() PACKET_AUXDATA failed!");
+		return -1;
+	}
+
+#ifdef PACKET_IGNORE_OUTGOING
+	// the outgoing frames are not even cloned for this socket (since linux
+	// 4.20), otherwise they are dropped by rx_filter
+	int one = 1;
+	if (setsockopt(sd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one)) < 0)
+		log(DEBUG, "PACKET_IGNORE_OUTGOING is not supported: %s", strerror(errno));
+#endif
+
+	return 0;
 }
 
 int open_device(const char *dname)
 {
-	int sd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	// no frame is received before binding with ETH_P_ALL, so that none of
+	// them slips in before the filter is attached
+	int sd = socket(AF_PACKET, SOCK_RAW, 0);
 	if (sd < 0) { 
 		perror("creating SOCK_RAW failed!");
 		return -1;
 	}
 
+	if (attach_rx_filter(sd) < 0)
+		return -1;
+
 	struct ifreq ifr;
 	bzero(&ifr, sizeof(struct ifreq));
 	strcpy(ifr.ifr_name, dname);
@@ -56,6 +497,7 @@ int open_device(const char *dname)
 	bzero(&sll, sizeof(sll));
 	sll.sll_family = AF_PACKET;
 	sll.sll_ifindex = ifr.ifr_ifindex;
+	sll.sll_protocol = htons(ETH_P_ALL);
 
 	if (bind((int)sd, (struct sockaddr *) &sll, sizeof(sll)) < 0) {
 		perror("binding to device failed!");
@@ -83,12 +525,88 @@ int open_device(const char *dname)
 	return sd;
 }
 
+// join socket sd into the PACKET_FANOUT_HASH group of id, or a new group 
+// allocated by kernel if id is -1, return the id of the group
+static int join_fanout_group(int sd, int id)
+{
+	int arg = PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG;
+	if (id < 0)
+		arg = (arg | PACKET_FANOUT_FLAG_UNIQUEID) << 16;
+	else
+		arg = (arg << 16) | id;
+
+	if (setsockopt(sd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0) {
+		perror("setsockopt() PACKET_FANOUT failed!");
+		return -1;
+	}
+
+	socklen_t len = sizeof(arg);
+	if (getsockopt(sd, SOL_PACKET, PACKET_FANOUT, &arg, &len) < 0) {
+		perror("getsockopt() PACKET_FANOUT failed!");
+		return -1;
+	}
+
+	return arg & 0xffff;
+}
+
+// open one socket for each worker on iface (the socket of iface is used by the
+// first worker), and join them into one fanout group, or only hand the socket
+// of iface to its owner with port_workers
+static void setup_worker_socks(iface_info_t *iface)
+{
+	iface->wsocks = malloc(sizeof(struct worker_sock) * instance->nworkers);
+	bzero(iface->wsocks, sizeof(struct worker_sock) * instance->nworkers);
+
+	if (instance->port_workers) {
+		for (int i = 0; i < instance->nworkers; i++)
+			iface->wsocks[i].fd = -1;
+		iface->wsocks[iface->worker].fd = iface->fd;
+		iface->wsocks[iface->worker].rx_ring = iface->rx_ring;
+		return ;
+	}
+
+	int id = -1;
+	for (int i = 0; i < instance->nworkers; i++) {
+		struct worker_sock *ws = &iface->wsocks[i];
+		if (i == 0) {
+			ws->fd = iface->fd;
+			ws->rx_ring = iface->rx_ring;
+		}
+		else {
+			ws->fd = open_device(iface->name);
+			if (ws->fd < 0 || (instance->rx_ring && \
+						setup_packet_rings(ws->fd, &ws->rx_ring, NULL) < 0)) {
+				log(ERROR, "could not open socket of worker %d on %s.", \
+						i, iface->name);
+				exit(1);
+			}
+		}
+
+		id = join_fanout_group(ws->fd, id);
+		if (id < 0) {
+			log(ERROR, "could not join fanout group on %s.", iface->name);
+			exit(1);
+		}
+	}
+}
+
 int read_iface_info(iface_info_t *iface)
 {
 	int fd = open_device(iface->name);
 
 	iface->fd = fd;
 
+	if (instance->rx_ring || instance->tx_ring) {
+		if (setup_packet_rings(fd, instance->rx_ring ? &iface->rx_ring : NULL, \
+					instance->tx_ring ? &iface->tx_ring : NULL) < 0) {
+			log(ERROR, "could not set up packet rings on %s.", iface->name);
+			exit(1);
+		}
+	}
+
+	if (instance->nworkers > 0)
+		setup_worker_socks(iface);
+
 	int s = socket(AF_INET, SOCK_DGRAM, 0);
 	struct ifreq ifr;
 	strcpy(ifr.ifr_name, iface->name);
@@ -120,6 +638,13 @@ int read_iface_info(iface_info_t *iface)
 	iface->mask = ntohl(*(u32 *)&mask);
 #endif
 
+	// the frames are received and sent through the AF_XDP socket instead, 
+	// the packet socket is only used to read the information above
+	if (instance->xdp) {
+		close(fd);
+		fd = iface->fd = xsk_open(iface);
+	}
+
 	return fd;
 }
 
@@ -159,21 +684,170 @@ static void find_available_ifaces()
 	log(DEBUG, "find the following interfaces: %s.", dev_names);
 }
 
+// ifindex is small and dense, so the interface of an ifindex (e.g. the output
+// interface of a route) is found by indexing instead of lookup
+static void init_ifindex_map()
+{
+	iface_info_t *iface = NULL;
+	list_for_each_entry(iface, &instance->iface_list, list) {
+		if (iface->index > instance->max_ifindex)
+			instance->max_ifindex = iface->index;
+	}
+
+	instance->ifindex_map = malloc(sizeof(iface_info_t *) * (instance->max_ifindex + 1));
+	bzero(instance->ifindex_map, sizeof(iface_info_t *) * (instance->max_ifindex + 1));
+	list_for_each_entry(iface, &instance->iface_list, list)
+		instance->ifindex_map[iface->index] = iface;
+}
+
 void init_all_ifaces()
 {
+	// USTACK_VDEV replaces the interfaces with virtual ones replaying pcap 
+	// files, which are driven by vdev_run instead of epoll
+	if (vdev_init_ifaces() > 0) {
+		instance->vdev = 1;
+		instance->xdp = 0;
+		instance->nworkers = instance->port_workers = 0;
+		init_ifindex_map();
+		return ;
+	}
+
 	find_available_ifaces();
 
-	instance->fds = malloc(sizeof(struct pollfd) * instance->nifs);
-	bzero(instance->fds, sizeof(struct pollfd) * instance->nifs);
+	// one worker for each port, unless fewer workers are asked for, which 
+	// take the ports in round robin
+	if (instance->port_workers && \
+			(!instance->nworkers || instance->nworkers > instance->nifs))
+		instance->nworkers = instance->nifs;
+
+	instance->epfd = epoll_create1(0);
+	if (instance->epfd < 0) {
+		perror("Create epoll instance failed");
+		exit(1);
+	}
 
 	iface_info_t *iface = NULL;
 	int i = 0;
 	list_for_each_entry(iface, &instance->iface_list, list) {
+		if (instance->port_workers)
+			iface->worker = i++ % instance->nworkers;
 		int fd = read_iface_info(iface);
-		instance->fds[i].fd = fd;
-		instance->fds[i].events |= POLLIN;
 
-		i += 1;
+		struct epoll_event ev;
+		bzero(&ev, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = iface;
+		if (epoll_ctl(instance->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			perror("Add interface to epoll instance failed");
+			exit(1);
+		}
+	}
+
+	init_ifindex_map();
+}
+
+// parse a list of cpus like "2,4-7" into set, return the number of cpus in it
+// (-1 if the list is invalid)
+static int parse_cpu_list(const char *str, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+
+	const char *p = str;
+	while (*p) {
+		char *end = NULL;
+		long first = strtol(p, &end, 10), last = first;
+		if (end == p)
+			return -1;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p)
+				return -1;
+		}
+		if (first < 0 || last < first || last >= CPU_SETSIZE)
+			return -1;
+
+		for (long cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, set);
+
+		if (*end == ',')
+			end += 1;
+		else if (*end)
+			return -1;
+		p = end;
+	}
+
+	return CPU_COUNT(set);
+}
+
+// pin the calling thread, which receives the packets as the index-th worker 
+// (0 for ustack_run), to one of USTACK_RX_CPUS in round robin
+void pin_rx_thread(int index)
+{
+	if (!instance->nr_rx_cpus)
+		return ;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	int cpu = instance->rx_cpus[index % instance->nr_rx_cpus];
+	CPU_SET(cpu, &set);
+	int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (err) {
+		log(ERROR, "could not pin the receiving thread to cpu %d: %s", \
+				cpu, strerror(err));
+		exit(1);
+	}
+
+	log(DEBUG, "receiving thread %d is pinned to cpu %d.", index, cpu);
+}
+
+// USTACK_RX_CPUS=LIST pins the receiving threads to the cpus, and 
+// USTACK_HELPER_CPUS=LIST pins all the other threads
+//
+// The calling thread is pinned to the helper cpus here, which is inherited by
+// the threads created afterwards (sweeping, timers, log and metrics...), and
+// the receiving threads pin themselves again by pin_rx_thread. Without 
+// USTACK_HELPER_CPUS, the helpers run on any cpu but the receiving ones.
+static void init_cpu_affinity()
+{
+	cpu_set_t rx, helpers;
+
+	char *env = getenv("USTACK_RX_CPUS");
+	if (env) {
+		if (parse_cpu_list(env, &rx) <= 0) {
+			log(ERROR, "invalid cpu list '%s' of USTACK_RX_CPUS.", env);
+			exit(1);
+		}
+		instance->rx_cpus = malloc(sizeof(int) * CPU_COUNT(&rx));
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &rx))
+				instance->rx_cpus[instance->nr_rx_cpus++] = cpu;
+	}
+
+	env = getenv("USTACK_HELPER_CPUS");
+	if (env) {
+		if (parse_cpu_list(env, &helpers) <= 0) {
+			log(ERROR, "invalid cpu list '%s' of USTACK_HELPER_CPUS.", env);
+			exit(1);
+		}
+	}
+	else if (instance->nr_rx_cpus) {
+		if (pthread_getaffinity_np(pthread_self(), sizeof(helpers), &helpers))
+			return ;
+		for (int i = 0; i < instance->nr_rx_cpus; i++)
+			CPU_CLR(instance->rx_cpus[i], &helpers);
+		// nothing left for the helpers, let them share the receiving cpus
+		if (CPU_COUNT(&helpers) == 0)
+			return ;
+	}
+	else {
+		return ;
+	}
+
+	int err = pthread_setaffinity_np(pthread_self(), sizeof(helpers), &helpers);
+	if (err) {
+		log(ERROR, "could not pin the helper threads: %s", strerror(err));
+		exit(1);
 	}
 }
 
@@ -184,5 +858,221 @@ void init_ustack()
 	bzero(instance, sizeof(ustack_t));
 	init_list_head(&instance->iface_list);
 
+	init_cpu_affinity();
+
+	// USTACK_RX_RING=1 switches the receive path to the memory-mapped ring
+	char *rx_ring = getenv("USTACK_RX_RING");
+	instance->rx_ring = rx_ring && atoi(rx_ring);
+	// USTACK_TX_RING=1 queues the packets to send into the memory-mapped ring, 
+	// which are flushed in batch
+	char *tx_ring = getenv("USTACK_TX_RING");
+	instance->tx_ring = tx_ring && atoi(tx_ring);
+	// USTACK_PORT_WORKERS=1 gives each worker the ports of its own, one worker
+	// per port (or per group of ports with USTACK_WORKERS=N), so each port is
+	// received by one thread without fanout
+	char *port_workers = getenv("USTACK_PORT_WORKERS");
+	instance->port_workers = port_workers && atoi(port_workers);
+	// USTACK_WORKERS=N (N > 1) spreads the packets among N forwarding workers,
+	// while with USTACK_PORT_WORKERS, a single worker (N = 1) owns all the ports
+	char *workers = getenv("USTACK_WORKERS");
+	if (workers && (atoi(workers) > 1 || \
+				(instance->port_workers && atoi(workers) > 0)))
+		instance->nworkers = atoi(workers);
+	// USTACK_XDP=1 receives and sends the frames through AF_XDP sockets, 
+	// each interface is bound with a single socket
+	char *xdp = getenv("USTACK_XDP");
+	instance->xdp = xdp && atoi(xdp);
+	if (instance->xdp && (instance->rx_ring || instance->tx_ring || \
+				instance->nworkers || instance->port_workers)) {
+		log(INFO, "the packet rings and workers are not used with USTACK_XDP.");
+		instance->rx_ring = instance->tx_ring = instance->nworkers = 0;
+		instance->port_workers = 0;
+	}
+	// USTACK_BUSY_POLL=1 spins on the interfaces instead of sleeping until
+	// packets arrive, which saves the wake-up latency at the cost of a cpu
+	char *busy_poll = getenv("USTACK_BUSY_POLL");
+	instance->busy_poll = busy_poll && atoi(busy_poll);
+	// USTACK_VLAN makes the switch vlan-aware (see vlan.h), whose tags are 
+	// then received along with the frames
+	char *vlan = getenv("USTACK_VLAN");
+	instance->vlan = vlan && *vlan;
+
 	init_all_ifaces();
+
+	metrics_init();
+}
+
+static packet_handler_t worker_handler;
+
+// receive a frame (of at most ETH_FRAME_LEN bytes, plus the vlan tag) from fd
+// into *packet by recvmsg, and put back the vlan tag stripped by the kernel,
+// which moves the start of the frame into the headroom
+static int recv_vlan_frame(int fd, char **packet, struct sockaddr_ll *addr)
+{
+	struct iovec iov = {
+		.iov_base = *packet,
+		.iov_len = ETH_FRAME_LEN + VLAN_HLEN,
+	};
+	char control[CMSG_SPACE(sizeof(struct tpacket_auxdata))];
+	struct msghdr msg;
+	bzero(&msg, sizeof(msg));
+	msg.msg_name = addr;
+	msg.msg_namelen = sizeof(struct sockaddr_ll);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	int len = recvmsg(fd, &msg, 0);
+	if (len < 2 * ETH_ALEN)
+		return len;
+
+	struct cmsghdr *cmsg;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_PACKET || cmsg->cmsg_type != PACKET_AUXDATA)
+			continue;
+
+		struct tpacket_auxdata *aux = (struct tpacket_auxdata *)CMSG_DATA(cmsg);
+		if (aux->tp_status & TP_STATUS_VLAN_VALID) {
+			*packet = vlan_push_tag(*packet, aux->tp_vlan_tci);
+			len += VLAN_HLEN;
+		}
+	}
+
+	return len;
+}
+
+// receive one packet from the socket fd of iface, and hand it to handler, 
+// return the number of packets handled
+static int recv_packet(iface_info_t *iface, int fd, packet_handler_t handler)
+{
+	struct sockaddr_ll addr;
+	socklen_t addr_len = sizeof(addr);
+
+	char *packet = packet_alloc(ETH_FRAME_LEN + VLAN_HLEN);
+	if (!packet) {
+		metrics_drop(DROP_NO_BUFFER);
+		return 0;
+	}
+
+	int len;
+	if (instance->vlan)
+		len = recv_vlan_frame(fd, &packet, &addr);
+	else
+		len = recvfrom(fd, packet, ETH_FRAME_LEN, 0, \
+				(struct sockaddr *)&addr, &addr_len);
+	if (len <= 0) {
+		log(ERROR, "receive packet error: %s", strerror(errno));
+		metrics_drop(DROP_RX_ERROR);
+		packet_free(packet);
+	}
+	else if (addr.sll_pkttype == PACKET_OUTGOING) {
+		// XXX: Linux raw socket will capture both incoming and outgoing 
+		// packets, while we only care about the incoming ones.
+		packet_free(packet);
+	}
+	else {
+		metrics_iface_rx(iface, len);
+		latency_rx_begin();
+		handler(iface, packet, len);
+		latency_rx_end();
+		return 1;
+	}
+
+	return 0;
+}
+
+// receive one packet from the socket of iface, and hand it to handler, return
+// the number of packets handled
+int iface_recv_packet(iface_info_t *iface, packet_handler_t handler)
+{
+	return recv_packet(iface, iface->fd, handler);
+}
+
+// the loop of each worker, which is the same as ustack_run except that only 
+// the sockets of this worker are watched
+//
+// The packets of a flow are received by one worker, either by the fanout hash
+// or by the port, and sent in the order received, as each worker queues the
+// packets toward each port of its own (see tx_queue).
+//
+// XXX: workers handle packets concurrently, so the shared tables must be safe
+// for concurrent access: mac_port_map is looked up under rcu (see mac.h),
+// and its updates are serialized by its lock.
+static void *worker_loop(void *arg)
+{
+	int id = (int)(long)arg;
+	pin_rx_thread(id);
+
+	struct epoll_event events[USTACK_MAX_EVENTS];
+	int epfd = epoll_create1(0);
+	if (epfd < 0) {
+		perror("Create epoll instance failed");
+		exit(1);
+	}
+
+	iface_info_t *iface = NULL;
+	list_for_each_entry(iface, &instance->iface_list, list) {
+		// the port is owned by another worker
+		if (iface->wsocks[id].fd < 0)
+			continue;
+
+		struct epoll_event ev;
+		bzero(&ev, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = iface;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, iface->wsocks[id].fd, &ev) < 0) {
+			perror("Add worker socket to epoll instance failed");
+			exit(1);
+		}
+	}
+
+	int timeout = instance->busy_poll ? 0 : -1;
+	while (1) {
+		int ready = epoll_wait(epfd, events, USTACK_MAX_EVENTS, timeout);
+		if (ready < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Epoll failed!");
+			break;
+		}
+
+		metrics_poll(ready);
+		if (ready == 0)
+			continue;
+
+		rcu_read_lock();
+		tx_batch_begin();
+		for (int i = 0; i < ready; i++) {
+			iface = (iface_info_t *)events[i].data.ptr;
+			struct worker_sock *ws = &iface->wsocks[id];
+			if (ws->rx_ring)
+				recv_ring(iface, ws->rx_ring, worker_handler);
+			else
+				recv_packet(iface, ws->fd, worker_handler);
+		}
+		tx_batch_end();
+		rcu_read_unlock();
+	}
+
+	return NULL;
+}
+
+// start the workers to receive and handle packets, the calling thread runs 
+// as the first worker and never returns
+void ustack_run_workers(packet_handler_t handler)
+{
+	worker_handler = handler;
+
+	for (int i = 1; i < instance->nworkers; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, worker_loop, (void *)(long)i) != 0) {
+			log(ERROR, "could not create worker %d.", i);
+			exit(1);
+		}
+	}
+
+	log(DEBUG, "forwarding with %d workers%s.", instance->nworkers, \
+			instance->port_workers ? " owning the ports" : "");
+	worker_loop((void *)0);
 }
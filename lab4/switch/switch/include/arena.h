@@ -0,0 +1,46 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// memory arenas backed by 2 MB hugepages, for the packet buffers and the
+// large tables which are accessed randomly, and thrash the TLB with 4 KB pages
+//
+// Each arena reserves its whole size of address space when created: with
+// explicit hugepages (MAP_HUGETLB) if enough of them are configured in
+// /proc/sys/vm/nr_hugepages, otherwise with normal pages advised to be backed
+// by transparent hugepages (MADV_HUGEPAGE), which are only populated when
+// touched. Memory is allocated by bumping a pointer and never freed, which
+// suits the buffers and tables living as long as the process. When an arena
+// is used up, arena_alloc returns NULL, and the caller falls back to malloc.
+//
+// USTACK_HUGEPAGES=0 maps the arenas with normal pages only, for comparison.
+
+#define ARENA_HUGEPAGE_SIZE		(2UL << 20)
+
+enum arena_backing {
+	ARENA_HUGETLB = 0,			// explicit hugepages
+	ARENA_THP,					// transparent hugepages
+	ARENA_NORMAL,				// normal pages
+};
+
+struct arena {
+	const char *name;			// subsystem owning the arena
+	char *base;
+	size_t size;				// reserved, in multiple of hugepages
+	size_t used;				// allocated from the start
+	enum arena_backing backing;
+	pthread_mutex_t lock;
+	struct arena *next;			// link in the list of all arenas
+};
+
+struct arena *arena_create(const char *name, size_t size);
+void *arena_alloc(struct arena *arena, size_t size, size_t align);
+size_t arena_resident(struct arena *arena);
+struct arena *arena_list();
+const char *arena_backing_str(enum arena_backing backing);
+void arena_report(FILE *fp);
+
+#endif
@@ -9,24 +9,26 @@
 
 enum log_level { DEBUG = 0, INFO, WARNING, ERROR };
 
-static enum log_level this_log_level = DEBUG;
-
-static const char *log_level_str[] = { "DEBUG", "INFO", "WARNING", "ERROR" };
-
-#ifdef LOG_DEBUG
-	#define log_it(fmt, level_str, ...) \
-		fprintf(stderr, "[%s:%u] %s: " fmt  "\n", __FILE__, __LINE__, \
-				level_str, ##__VA_ARGS__)
-#else
-	#define log_it(fmt, level_str, ...) \
-		fprintf(stderr, "%s: " fmt "\n", level_str, ##__VA_ARGS__)
+// log records below LOG_LEVEL are eliminated at compile time, e.g. build with
+// `make LOG_LEVEL=INFO` to drop all the DEBUG logs
+#ifndef LOG_LEVEL
+#define LOG_LEVEL DEBUG
 #endif
 
+// log() does not format or write anything itself: the format and arguments
+// are stored as a binary record into the ring of the calling thread, and a
+// background thread formats and writes the records to stderr (see log.c).
+//
+// The format must be a string literal, since only the pointer is kept.
 #define log(level, fmt, ...) \
 	do { \
-		if (level < this_log_level) \
+		if (level < LOG_LEVEL) \
 			break; \
-		log_it(fmt, log_level_str[level], ##__VA_ARGS__); \
+		log_write(level, __FILE__, __LINE__, fmt, ##__VA_ARGS__); \
 	} while (0)
 
+void log_write(int level, const char *file, int line, const char *fmt, ...) \
+	__attribute__((format(printf, 4, 5)));
+int log_flush();
+
 #endif
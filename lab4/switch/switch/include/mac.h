@@ -2,35 +2,56 @@
 #define __MAC_H__
 
 #include "base.h"
-#include "hash.h"
+#include "htable.h"
 #include "list.h"
+#include "timer.h"
+#include "rcu.h"
 
 #include <pthread.h>
 #include <unistd.h>
 
 #define MAC_PORT_TIMEOUT 30
+// slots of the aging wheel, one for each second the entries are due in
+#define MAC_AGING_SLOTS (MAC_PORT_TIMEOUT + 2)
+
+// The entries are looked up under rcu without any lock, and the learning
+// from a known host on the same port only reads its entry (as long as the
+// timestamp in seconds does not change), so that forwarding never writes the
+// shared table, nor takes any lock, unless a host is learned or moved. The
+// iface and visited of an entry are changed in place by atomic stores, and the
+// entries removed are freed after a grace period.
+
+// the hosts are learned within each vlan (vid is 0 if the switch is not
+// vlan-aware), the key is hashed as a whole
+struct mac_port_key {
+	u16 vid;
+	uint8_t mac[ETH_ALEN];
+};
 
 struct mac_port_entry {
-	struct list_head list;
-	uint8_t mac[ETH_ALEN];
+	struct mac_port_key key;
 	iface_info_t *iface;
-	time_t visited;
+	time_t visited;			// in s of the coarse timer clock
+	struct list_head aging_list;	// link in the slot of the aging wheel
+	struct rcu_head rcu;
 };
 
 typedef struct mac_port_entry mac_port_entry_t;
 
 typedef struct {
-	struct list_head hash_table[HASH_8BITS];
-	pthread_mutex_t lock;
-	pthread_t thread;
+	struct htable table;		// (vid, mac) -> entry
+	pthread_mutex_t lock;		// serializes the writers
+	// each entry is in the slot of the second it is due in, i.e.
+	// MAC_PORT_TIMEOUT + 1 seconds after it was visited when put there
+	struct list_head aging[MAC_AGING_SLOTS];
+	time_t aging_clk;		// the next second to age
+	struct timer aging_timer;	// ages the slots due every second
 } mac_port_map_t;
 
-void *sweeping_mac_port_thread(void *);
 void init_mac_port_table();
 void destory_mac_port_table();
 void dump_mac_port_table();
-iface_info_t *lookup_port(uint8_t mac[ETH_ALEN]);
-void insert_mac_port(uint8_t mac[ETH_ALEN], iface_info_t *iface);
-int sweep_aged_mac_port_entry();
+iface_info_t *lookup_port(u16 vid, uint8_t mac[ETH_ALEN]);
+void insert_mac_port(u16 vid, uint8_t mac[ETH_ALEN], iface_info_t *iface);
 
 #endif
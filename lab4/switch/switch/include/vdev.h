@@ -0,0 +1,50 @@
+#ifndef __VDEV_H__
+#define __VDEV_H__
+
+#include "base.h"
+
+#include <stdio.h>
+
+// virtual interfaces, which replay frames from pcap files and write the sent
+// frames into pcap files (or only count them), so that the stack could be
+// driven without packet sockets, root or the mininet topology
+//
+// They are configured by USTACK_VDEV, one interface per ';'-separated entry:
+//
+//   USTACK_VDEV="s1-eth1,rx=in.pcap;s1-eth2,tx=out.pcap;s1-eth3"
+//
+// with the following ','-separated options after the interface name:
+//   rx=FILE       pcap file replayed as the received frames
+//   tx=FILE       pcap file the sent frames are written into, they are only
+//                 counted if not set
+//   mac=XX:..:XX  mac address, 02:00:00:00:00:<index> by default
+//
+// USTACK_VDEV_RATE=PPS paces the replay (as fast as possible by default), and
+// USTACK_VDEV_LOOPS=N replays the pcap files N times. With USTACK_VCLOCK=1,
+// the replay drives the virtual clock of the timers by the capture time of
+// the frames, and the sent frames are stamped with it.
+
+// a frame loaded from the rx pcap file
+struct vdev_frame {
+	char *data;
+	int len;
+	u64 ts;							// capture time, in us
+};
+
+struct vdev {
+	struct vdev_frame *rx_frames;	// frames to replay (NULL if no rx file)
+	int rx_nframes;					// number of frames to replay
+	int rx_pos;						// next frame to replay
+	FILE *tx_file;					// pcap file of sent frames (NULL if only
+									// counting them)
+	pthread_mutex_t tx_lock;		// serialize the writers of tx_file
+
+	u64 rx_packets, rx_bytes;
+	u64 tx_packets, tx_bytes;
+};
+
+int vdev_init_ifaces();
+void vdev_send_packet(iface_info_t *iface, const char *packet, int len);
+void vdev_run(packet_handler_t handler);
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef __VLAN_H__
+#define __VLAN_H__
+
+#include "base.h"
+
+#include <string.h>
+
+#define ETH_P_8021Q		0x8100			// 802.1Q tagged frame
+#define VLAN_HLEN		4				// length of the 802.1Q tag
+#define VLAN_N_VID		4096			// number of vlan ids
+#define VLAN_VID_MASK	0x0fff			// vid in the tci
+#define VLAN_DEFAULT	1				// vlan of the ports not configured
+
+// ethernet header with the 802.1Q tag, inserted in front of the ether type
+struct vlan_ether_header {
+	u8 ether_dhost[ETH_ALEN];			// destination mac address
+	u8 ether_shost[ETH_ALEN];			// source mac address
+	u16 tpid;							// ETH_P_8021Q
+	u16 tci;							// priority (3 bits), DEI and vid
+	u16 ether_type;						// protocol format
+} __attribute__((packed));
+
+#define VLAN_ETHER_HDR_SIZE sizeof(struct vlan_ether_header)
+
+// USTACK_VLAN="PORT,OPT=VAL[,...];..." makes the switch vlan-aware, where
+// the options of each port are
+//   access=VID		the port is an access port of vlan VID
+//   trunk=LIST		the port is a trunk of the vlans in LIST, e.g. 10:20-29
+//   native=VID		the untagged frames on the trunk are of vlan VID
+// The ports not configured are access ports of VLAN_DEFAULT, and the untagged
+// frames on a trunk without native vlan are dropped. The priority-tagged frames
+// (vid 0) are accepted as the untagged ones.
+//
+// The frames are learned and forwarded within their vlan, and flooded to the
+// other member ports of it only. A frame is sent tagged through a trunk
+// (unless of its native vlan), and untagged through the other ports. The tags
+// stripped by the kernel (rx vlan offload) are put back when received.
+
+// the ports a frame of a vlan received on one of its members is flooded to,
+// by the format they send it in
+struct vlan_flood {
+	iface_info_t **untagged;
+	int nr_untagged;
+	iface_info_t **tagged;
+	int nr_tagged;
+};
+
+// vlan with at least one member port
+struct vlan {
+	u16 vid;
+	struct vlan_flood *flood;			// by ifindex of the ingress port
+};
+
+static inline int vlan_is_member(iface_info_t *iface, u16 vid)
+{
+	return (iface->vlans[vid / 64] >> (vid % 64)) & 1;
+}
+
+// whether the frames of vlan vid are sent tagged through iface
+static inline int vlan_is_tagged(iface_info_t *iface, u16 vid)
+{
+	return iface->trunk && vid != iface->pvid;
+}
+
+// tag the untagged frame in place, by moving the mac addresses into the
+// headroom of its buffer, return the start of the tagged frame
+static inline char *vlan_push_tag(char *packet, u16 tci)
+{
+	memmove(packet - VLAN_HLEN, packet, 2 * ETH_ALEN);
+	packet -= VLAN_HLEN;
+
+	struct vlan_ether_header *vh = (struct vlan_ether_header *)packet;
+	vh->tpid = htons(ETH_P_8021Q);
+	vh->tci = htons(tci);
+
+	return packet;
+}
+
+void init_vlans();
+int vlan_recv_packet(iface_info_t *iface, char *packet, int len);
+void vlan_send_packet(iface_info_t *iface, u16 vid, char *packet, int len);
+void vlan_flood_packet(iface_info_t *iface, u16 vid, const char *packet, int len);
+
+#endif
@@ -1,5 +1,6 @@
 #include "mac.h"
 #include "log.h"
+#include "timer.h"
 
 #include <pthread.h>
 #include <stdlib.h>
@@ -7,83 +8,126 @@
 
 mac_port_map_t mac_port_map;
 
+static void mac_port_aging(void *arg);
+
+static int mac_port_entry_eq(const void *entry, const void *key)
+{
+	return memcmp(&((mac_port_entry_t *)entry)->key, key, \
+			sizeof(struct mac_port_key)) == 0;
+}
+
+static inline void mac_port_key_init(struct mac_port_key *key, u16 vid, \
+		u8 mac[ETH_ALEN])
+{
+	key->vid = vid;
+	memcpy(key->mac, mac, ETH_ALEN);
+}
+
+static void mac_port_entry_free(struct rcu_head *head)
+{
+	free(list_entry(head, mac_port_entry_t, rcu));
+}
+
 // initialize mac_port table
 void init_mac_port_table()
 {
 	bzero(&mac_port_map, sizeof(mac_port_map_t));
 
-	for (int i = 0; i < HASH_8BITS; i++) {
-		init_list_head(&mac_port_map.hash_table[i]);
-	}
+	htable_init(&mac_port_map.table);
 
 	pthread_mutex_init(&mac_port_map.lock, NULL);
 
-	pthread_create(&mac_port_map.thread, NULL, sweeping_mac_port_thread, NULL);
+	for (int i = 0; i < MAC_AGING_SLOTS; i++)
+		init_list_head(&mac_port_map.aging[i]);
+	mac_port_map.aging_clk = timer_now_coarse() / 1000;
+	init_timer(&mac_port_map.aging_timer, mac_port_aging, NULL);
 }
 
 // destroy mac_port table
 void destory_mac_port_table()
 {
+	del_timer(&mac_port_map.aging_timer);
+
 	pthread_mutex_lock(&mac_port_map.lock);
-	mac_port_entry_t *entry, *q;
-	for (int i = 0; i < HASH_8BITS; i++) {
-		list_for_each_entry_safe(entry, q, &mac_port_map.hash_table[i], list) {
-			list_delete_entry(&entry->list);
-			free(entry);
-		}
+	mac_port_entry_t *entry;
+	u64 pos;
+	htable_for_each(&mac_port_map.table, pos, entry) {
+		htable_remove(&mac_port_map.table, htable_hash(&entry->key, sizeof(struct mac_port_key)), entry);
+		list_delete_entry(&entry->aging_list);
+		call_rcu(&entry->rcu, mac_port_entry_free);
 	}
+	htable_destroy(&mac_port_map.table);
 	pthread_mutex_unlock(&mac_port_map.lock);
 }
 
-// lookup the mac address in mac_port table
-iface_info_t *lookup_port(u8 mac[ETH_ALEN])
+// lookup the mac address of vlan vid in mac_port table
+iface_info_t *lookup_port(u16 vid, u8 mac[ETH_ALEN])
 {
 	// TODO: implement the lookup process here
 	//fprintf(stdout, "TODO: implement the lookup process here.\n");
-	int idx = (int)hash8((char*)mac, ETH_ALEN);
-	mac_port_entry_t *entry;
-	pthread_mutex_lock(&mac_port_map.lock);
+	struct mac_port_key key;
+	mac_port_key_init(&key, vid, mac);
+	u64 hash = htable_hash(&key, sizeof(key));
+	iface_info_t *iface = NULL;
+	rcu_read_lock();
 
-	list_for_each_entry(entry, &(mac_port_map.hash_table[idx]), list){
-		if (memcmp(entry->mac, mac, ETH_ALEN) == 0) {
-			pthread_mutex_unlock(&mac_port_map.lock);
-			return entry->iface;
-		}
-	}
+	mac_port_entry_t *entry = htable_lookup_rcu(&mac_port_map.table, hash, &key, \
+			mac_port_entry_eq);
+	if (entry)
+		iface = __atomic_load_n(&entry->iface, __ATOMIC_RELAXED);
 
-	pthread_mutex_unlock(&mac_port_map.lock);
+	rcu_read_unlock();
 
-	return NULL;
+	return iface;
 }
 
-// insert the mac -> iface mapping into mac_port table
-void insert_mac_port(u8 mac[ETH_ALEN], iface_info_t *iface)
+// insert the (vid, mac) -> iface mapping into mac_port table
+void insert_mac_port(u16 vid, u8 mac[ETH_ALEN], iface_info_t *iface)
 {
 	// TODO: implement the insertion process here
 	//fprintf(stdout, "TODO: implement the insertion process here.\n");
-	int idx = (int)hash8((char*)mac, ETH_ALEN);
+	struct mac_port_key key;
+	mac_port_key_init(&key, vid, mac);
+	u64 hash = htable_hash(&key, sizeof(key));
 	mac_port_entry_t *entry;
-	time_t now = time(NULL);
-	pthread_mutex_lock(&(mac_port_map.lock));
+	time_t now = timer_now_coarse() / 1000;
+
+	// most of the packets are from known hosts on the same port, whose entry
+	// is only written once a second, when its timestamp changes
+	rcu_read_lock();
+	entry = htable_lookup_rcu(&mac_port_map.table, hash, &key, mac_port_entry_eq);
+	if (entry && __atomic_load_n(&entry->iface, __ATOMIC_RELAXED) == iface) {
+		if (__atomic_load_n(&entry->visited, __ATOMIC_RELAXED) != now)
+			__atomic_store_n(&entry->visited, now, __ATOMIC_RELAXED);
+		rcu_read_unlock();
+		return ;
+	}
+	rcu_read_unlock();
 
-	list_for_each_entry(entry, &(mac_port_map.hash_table[idx]), list){
-		if (memcmp(entry->mac, mac, ETH_ALEN) == 0) {
-			if(entry->iface!=iface)
-				entry->iface = iface;
-			entry->visited = now;
-			pthread_mutex_unlock(&mac_port_map.lock);
+	pthread_mutex_lock(&mac_port_map.lock);
 
-			return ;
-		}
+	entry = htable_lookup(&mac_port_map.table, hash, &key, mac_port_entry_eq);
+	if (entry) {
+		// the host has moved to another port
+		if (entry->iface != iface)
+			__atomic_store_n(&entry->iface, iface, __ATOMIC_RELAXED);
+		__atomic_store_n(&entry->visited, now, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&mac_port_map.lock);
+
+		return ;
 	}
 	mac_port_entry_t *new = malloc(sizeof(mac_port_entry_t));
 	new->iface = iface;
 	new->visited = now;
-	for(int i=0;i<ETH_ALEN;i++)
-		new->mac[i] = mac[i];
-
-	list_add_head(&new->list, &(mac_port_map.hash_table[idx]));
-	pthread_mutex_unlock(&(mac_port_map.lock));
+	new->key = key;
+	list_add_tail(&new->aging_list, \
+			&mac_port_map.aging[(now + MAC_PORT_TIMEOUT + 1) % MAC_AGING_SLOTS]);
+	if (!timer_pending(&mac_port_map.aging_timer))
+		mod_timer(&mac_port_map.aging_timer, 1000);
+
+	// the entry is filled before published by the insertion
+	htable_insert(&mac_port_map.table, hash, new);
+	pthread_mutex_unlock(&mac_port_map.lock);
 
 	return ;
 }
@@ -92,56 +136,72 @@ void insert_mac_port(u8 mac[ETH_ALEN], iface_info_t *iface)
 void dump_mac_port_table()
 {
 	mac_port_entry_t *entry = NULL;
-	time_t now = time(NULL);
+	time_t now = timer_now_coarse() / 1000;
 
 	fprintf(stdout, "dumping the mac_port table:\n");
 	pthread_mutex_lock(&mac_port_map.lock);
-	for (int i = 0; i < HASH_8BITS; i++) {
-		list_for_each_entry(entry, &mac_port_map.hash_table[i], list) {
-			fprintf(stdout, ETHER_STRING " -> %s, %d\n", ETHER_FMT(entry->mac), \
-					entry->iface->name, (int)(now - entry->visited));
-		}
+	u64 pos;
+	htable_for_each(&mac_port_map.table, pos, entry) {
+		fprintf(stdout, ETHER_STRING " (vlan %d) -> %s, %d\n", \
+				ETHER_FMT(entry->key.mac), entry->key.vid, entry->iface->name, \
+				(int)(now - entry->visited));
 	}
 
 	pthread_mutex_unlock(&mac_port_map.lock);
 }
 
-// sweeping mac_port table, remove the entry which has not been visited in the
-// last 30 seconds.
-int sweep_aged_mac_port_entry()
+// age the slots of the seconds that are due, every second while the table is
+// not empty
+//
+// An entry is put in the slot of MAC_PORT_TIMEOUT + 1 seconds after it was
+// visited. Visiting it only refreshes its timestamp, which is checked lazily
+// here: the entry is removed if it has not been visited since then, or moved
+// to the slot of its new deadline otherwise. Hence aging costs at most one
+// check per entry every MAC_PORT_TIMEOUT seconds, from a single timer, and
+// holds the lock (taken by learning, never by forwarding) for one slot at a
+// time.
+static void mac_port_aging(void *arg)
 {
-	// TODO: implement the sweeping process here
-	//fprintf(stdout, "TODO: implement the sweeping process here.\n");
-	int n = 0;
-	mac_port_entry_t *entry, *q;
-	time_t now = time(NULL);
+	time_t now = timer_now_coarse() / 1000;
 
+	// the timer was stopped while the table was empty, every slot is aged
+	// once in catching up
 	pthread_mutex_lock(&mac_port_map.lock);
-
-	for(int i=0;i<HASH_8BITS;i++){
-		list_for_each_entry_safe(entry, q, &mac_port_map.hash_table[i], list){
-			if((int)(now - entry->visited) > MAC_PORT_TIMEOUT){
-				list_delete_entry(&entry->list);
-				free(entry);
-				n++;
+	if (mac_port_map.aging_clk + MAC_AGING_SLOTS <= now)
+		mac_port_map.aging_clk = now - MAC_AGING_SLOTS + 1;
+
+	while (mac_port_map.aging_clk <= now) {
+		struct list_head *slot = \
+				&mac_port_map.aging[mac_port_map.aging_clk % MAC_AGING_SLOTS];
+		mac_port_entry_t *entry, *q;
+		list_for_each_entry_safe(entry, q, slot, aging_list) {
+			time_t visited = __atomic_load_n(&entry->visited, __ATOMIC_RELAXED);
+			if (now - visited > MAC_PORT_TIMEOUT) {
+				log(DEBUG, "aged entry " ETHER_STRING " in mac_port table is removed.", \
+						ETHER_FMT(entry->key.mac));
+				htable_remove(&mac_port_map.table, \
+						htable_hash(&entry->key, sizeof(struct mac_port_key)), entry);
+				list_delete_entry(&entry->aging_list);
+				call_rcu(&entry->rcu, mac_port_entry_free);
+			}
+			else {
+				struct list_head *due = &mac_port_map.aging[ \
+						(visited + MAC_PORT_TIMEOUT + 1) % MAC_AGING_SLOTS];
+				if (due != slot) {
+					list_delete_entry(&entry->aging_list);
+					list_add_tail(&entry->aging_list, due);
+				}
 			}
 		}
-	}
-	pthread_mutex_unlock(&mac_port_map.lock);
-
-	return n;
-}
+		mac_port_map.aging_clk++;
 
-// sweeping mac_port table periodically, by calling sweep_aged_mac_port_entry
-void *sweeping_mac_port_thread(void *nil)
-{
-	while (1) {
-		sleep(1);
-		int n = sweep_aged_mac_port_entry();
-
-		if (n > 0)
-			log(DEBUG, "%d aged entries in mac_port table are removed.", n);
+		// let the learning in between the slots
+		pthread_mutex_unlock(&mac_port_map.lock);
+		pthread_mutex_lock(&mac_port_map.lock);
 	}
 
-	return NULL;
+	if (mac_port_map.table.size > 0)
+		mod_timer(&mac_port_map.aging_timer, 1000);
+
+	pthread_mutex_unlock(&mac_port_map.lock);
 }
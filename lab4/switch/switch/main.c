@@ -1,9 +1,15 @@
 #include "base.h"
 #include "ether.h"
 #include "mac.h"
+#include "vlan.h"
 #include "utils.h"
 
 #include "log.h"
+#include "packet_pool.h"
+#include "vdev.h"
+#include "xsk.h"
+#include "metrics.h"
+#include "rcu.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,91 +20,123 @@
 // broadcast it.
 // 2. put the src mac -> iface mapping into mac hash table.
 // 3. release the memory of ``packet''
+// If the switch is vlan-aware, all of them are within the vlan of the packet.
 
 // Note: the log & fprintf here are only used for debug, which should be commented 
 // out for better performance.
 void handle_packet(iface_info_t *iface, char *packet, int len)
 {
+	latency_stage(LAT_DISPATCH);
+
 	// TODO: implement the packet forwarding process here
 	//fprintf(stdout, "TODO: implement the packet forwarding process here.\n");
 
 	struct ether_header *eh = (struct ether_header *)packet;
 	//log(DEBUG, "the dst mac address is " ETHER_STRING ".\n", ETHER_FMT(eh->ether_dhost));
 
-	iface_info_t * dest_iface = lookup_port(eh->ether_dhost);
+	int vid = 0;
+	if (instance->vlan && (vid = vlan_recv_packet(iface, packet, len)) < 0) {
+		metrics_drop(DROP_VLAN_FILTERED);
+		packet_free(packet);
+		return ;
+	}
+
+	iface_info_t * dest_iface = lookup_port(vid, eh->ether_dhost);
+
+	// the source is learned before forwarding, which may tag or untag the
+	// packet in place
+	// log(DEBUG, "Insert into mac_port_map: " ETHER_STRING " -> %s.", ETHER_FMT(eh->ether_shost), iface->name);
+	insert_mac_port(vid, eh->ether_shost, iface);
+
 	if (dest_iface) {
 		// log(DEBUG, "Send this packet to %s.", dest_iface->name);
-		iface_send_packet(dest_iface, packet, len);
+		if (instance->vlan)
+			vlan_send_packet(dest_iface, vid, packet, len);
+		else
+			iface_send_packet(dest_iface, packet, len);
 	} else {
 		// log(DEBUG, "Broadcast this packet.");
-		broadcast_packet(iface, packet, len);
+		if (instance->vlan)
+			vlan_flood_packet(iface, vid, packet, len);
+		else
+			broadcast_packet(iface, packet, len);
 	}
 
-	// log(DEBUG, "Insert into mac_port_map: " ETHER_STRING " -> %s.", ETHER_FMT(eh->ether_shost), iface->name);
-	insert_mac_port(eh->ether_shost, iface);
-
-	free(packet);
+	packet_free(packet);
 }
 
 // run user stack, receive packet on each interface, and handle those packet
 // like normal switch
 void ustack_run()
 {
-	struct sockaddr_ll addr;
-	socklen_t addr_len = sizeof(addr);
-	char buf[ETH_FRAME_LEN];
-	int len;
+	struct epoll_event events[USTACK_MAX_EVENTS];
+
+	pin_rx_thread(0);
 
+	if (instance->vdev) {
+		vdev_run(handle_packet);
+		return ;
+	}
+
+	if (instance->nworkers > 0) {
+		// packets are received and handled by the workers in parallel
+		ustack_run_workers(handle_packet);
+		return ;
+	}
+
+	// busy polling never sleeps in epoll_wait
+	int timeout = instance->busy_poll ? 0 : -1;
 	while (1) {
-		int ready = poll(instance->fds, instance->nifs, -1);
+		int ready = epoll_wait(instance->epfd, events, USTACK_MAX_EVENTS, timeout);
 		if (ready < 0) {
-			perror("Poll failed!");
+			if (errno == EINTR)
+				continue;
+			perror("Epoll failed!");
 			break;
 		}
-		else if (ready == 0)
+
+		metrics_poll(ready);
+		if (ready == 0)
 			continue;
 
-		for (int i = 0; i < instance->nifs; i++) {
-			if (instance->fds[i].revents & POLLIN) {
-				len = recvfrom(instance->fds[i].fd, buf, ETH_FRAME_LEN, 0, \
-						(struct sockaddr*)&addr, &addr_len);
-				if (len <= 0) {
-					log(ERROR, "receive packet error: %s", strerror(errno));
-				}
-				else if (addr.sll_pkttype == PACKET_OUTGOING) {
-					// XXX: Linux raw socket will capture both incoming and
-					// outgoing packets, while we only care about the incoming ones.
-
-					// log(DEBUG, "received packet which is sent from the "
-					// 		"interface itself, drop it.");
-				}
-				else {
-					iface_info_t *iface = fd_to_iface(instance->fds[i].fd);
-					if (!iface) 
-						continue;
-
-					char *packet = malloc(len);
-					if (!packet) {
-						log(ERROR, "malloc failed when receiving packet.");
-						continue;
-					}
-					memcpy(packet, buf, len);
-					handle_packet(iface, packet, len);
-				}
+		// packets sent while handling received ones are flushed in batch, 
+		// before waiting in epoll again, and the whole batch is handled in 
+		// one critical section of rcu
+		rcu_read_lock();
+		tx_batch_begin();
+		for (int i = 0; i < ready; i++) {
+			// each interface is registered with itself as the event data
+			iface_info_t *iface = (iface_info_t *)events[i].data.ptr;
+			if (iface->xsk) {
+				xsk_recv(iface, handle_packet);
+			}
+			else if (instance->rx_ring) {
+				iface_recv_ring(iface, handle_packet);
+			}
+			else {
+				// receive into a buffer from the packet pool directly, along with
+				// the vlan tag stripped by the kernel
+				iface_recv_packet(iface, handle_packet);
 			}
 		}
+		tx_batch_end();
+		rcu_read_unlock();
 	}
 }
 
 int main(int argc, const char **argv)
 {
-	if (getuid() && geteuid()) {
+	if (getuid() && geteuid() && !getenv("USTACK_VDEV")) {
 		printf("Permission denied, should be superuser!\n");
 		exit(1);
 	}
 
 	init_ustack();
 
+	init_flood_ports();
+
+	init_vlans();
+
 	init_mac_port_table();
 
 	ustack_run();
@@ -0,0 +1,297 @@
+#include "vlan.h"
+#include "log.h"
+#include "packet_pool.h"
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static struct vlan *vlans[VLAN_N_VID];	// NULL if the vlan has no member
+
+static iface_info_t *name_to_iface(const char *name)
+{
+	iface_info_t *iface = NULL;
+	list_for_each_entry(iface, &instance->iface_list, list) {
+		if (strcmp(iface->name, name) == 0)
+			return iface;
+	}
+
+	return NULL;
+}
+
+static int parse_vid(const char *str)
+{
+	char *end = NULL;
+	long vid = strtol(str, &end, 10);
+	if (end == str || *end || vid < 1 || vid >= VLAN_N_VID - 1)
+		return -1;
+
+	return vid;
+}
+
+static void vlan_add_member(iface_info_t *iface, int vid)
+{
+	iface->vlans[vid / 64] |= 1ULL << (vid % 64);
+}
+
+// parse a list of vlans like "10:20-29" into the members of iface
+static int parse_trunk_vlans(iface_info_t *iface, char *list)
+{
+	char *save = NULL;
+	char *item = NULL;
+	for (item = strtok_r(list, ":", &save); item; item = strtok_r(NULL, ":", &save)) {
+		int first, last;
+		char *dash = strchr(item, '-');
+		if (dash) {
+			*dash = '\0';
+			first = parse_vid(item);
+			last = parse_vid(dash + 1);
+		}
+		else {
+			first = last = parse_vid(item);
+		}
+		if (first < 0 || last < first)
+			return -1;
+
+		for (int vid = first; vid <= last; vid++)
+			vlan_add_member(iface, vid);
+	}
+
+	return 0;
+}
+
+// parse one entry of USTACK_VLAN into the configuration of its port
+static void vlan_parse_port(char *spec)
+{
+	char *save = NULL;
+	char *name = strtok_r(spec, ",", &save);
+	iface_info_t *iface = name ? name_to_iface(name) : NULL;
+	if (!iface) {
+		log(ERROR, "unknown port '%s' in USTACK_VLAN.", name ? name : "");
+		exit(1);
+	}
+
+	bzero(iface->vlans, sizeof(u64) * VLAN_N_VID / 64);
+	iface->pvid = 0;
+
+	char *opt = NULL;
+	while ((opt = strtok_r(NULL, ",", &save))) {
+		char *val = strchr(opt, '=');
+		if (!val) {
+			log(ERROR, "invalid option '%s' of port %s.", opt, name);
+			exit(1);
+		}
+		*val++ = '\0';
+
+		int vid = 0;
+		if (strcmp(opt, "access") == 0 || strcmp(opt, "native") == 0) {
+			if ((vid = parse_vid(val)) < 0) {
+				log(ERROR, "invalid vlan '%s' of port %s.", val, name);
+				exit(1);
+			}
+			iface->trunk = iface->trunk || strcmp(opt, "native") == 0;
+			iface->pvid = vid;
+			vlan_add_member(iface, vid);
+		}
+		else if (strcmp(opt, "trunk") == 0) {
+			if (parse_trunk_vlans(iface, val) < 0) {
+				log(ERROR, "invalid vlans '%s' of port %s.", val, name);
+				exit(1);
+			}
+			iface->trunk = 1;
+		}
+		else {
+			log(ERROR, "unknown option '%s' of port %s.", opt, name);
+			exit(1);
+		}
+	}
+
+	if (iface->trunk && iface->pvid == 0)
+		log(DEBUG, "untagged frames on trunk %s are dropped.", name);
+}
+
+// list the member ports of vlan vid but iface which send the frames of it in
+// the given format
+static int vlan_list_ports(iface_info_t *iface, u16 vid, int tagged, \
+		iface_info_t ***ports)
+{
+	*ports = malloc(sizeof(iface_info_t *) * instance->nifs);
+	int n = 0;
+
+	iface_info_t *port = NULL;
+	list_for_each_entry(port, &instance->iface_list, list) {
+		if (port != iface && vlan_is_member(port, vid) && \
+				vlan_is_tagged(port, vid) == tagged)
+			(*ports)[n++] = port;
+	}
+
+	return n;
+}
+
+// the flood lists of each member port of vlan vid, listed once instead of
+// for each frame, as the ports of init_flood_ports
+static struct vlan *vlan_create(u16 vid)
+{
+	struct vlan *vlan = malloc(sizeof(struct vlan));
+	vlan->vid = vid;
+	vlan->flood = malloc(sizeof(struct vlan_flood) * (instance->max_ifindex + 1));
+	bzero(vlan->flood, sizeof(struct vlan_flood) * (instance->max_ifindex + 1));
+
+	iface_info_t *iface = NULL;
+	list_for_each_entry(iface, &instance->iface_list, list) {
+		if (!vlan_is_member(iface, vid))
+			continue;
+
+		struct vlan_flood *flood = &vlan->flood[iface->index];
+		flood->nr_untagged = vlan_list_ports(iface, vid, 0, &flood->untagged);
+		flood->nr_tagged = vlan_list_ports(iface, vid, 1, &flood->tagged);
+	}
+
+	return vlan;
+}
+
+// set up the vlans configured by USTACK_VLAN, if the switch is vlan-aware
+// (otherwise all the ports are in one broadcast domain)
+void init_vlans()
+{
+	char *env = getenv("USTACK_VLAN");
+	if (!instance->vlan || !env)
+		return ;
+
+	iface_info_t *iface = NULL;
+	list_for_each_entry(iface, &instance->iface_list, list) {
+		iface->vlans = malloc(sizeof(u64) * VLAN_N_VID / 64);
+		bzero(iface->vlans, sizeof(u64) * VLAN_N_VID / 64);
+		iface->pvid = VLAN_DEFAULT;
+		vlan_add_member(iface, VLAN_DEFAULT);
+	}
+
+	char *specs = strdup(env);
+	char *save = NULL;
+	char *spec = NULL;
+	for (spec = strtok_r(specs, ";", &save); spec; spec = strtok_r(NULL, ";", &save))
+		vlan_parse_port(spec);
+	free(specs);
+
+	int nr_vlans = 0;
+	for (int vid = 1; vid < VLAN_N_VID - 1; vid++) {
+		list_for_each_entry(iface, &instance->iface_list, list) {
+			if (vlan_is_member(iface, vid)) {
+				vlans[vid] = vlan_create(vid);
+				nr_vlans += 1;
+				break;
+			}
+		}
+	}
+
+	log(DEBUG, "switching within %d vlans.", nr_vlans);
+}
+
+// return the vlan of the frame received on iface, or -1 if it is not accepted
+// by iface, i.e. tagged on an access port, untagged on a trunk without native
+// vlan, or of a vlan iface is not a member of
+//
+// A priority-tagged frame (vid 0) is classified to the pvid of iface as an 
+// untagged one, and the vid of its tag is set in place, so that the tag is 
+// rewritten or popped when sent.
+int vlan_recv_packet(iface_info_t *iface, char *packet, int len)
+{
+	struct vlan_ether_header *vh = (struct vlan_ether_header *)packet;
+	int vid = iface->pvid;
+
+	if (vh->tpid == htons(ETH_P_8021Q)) {
+		if (len < VLAN_ETHER_HDR_SIZE)
+			return -1;
+
+		u16 tci = ntohs(vh->tci);
+		if ((tci & VLAN_VID_MASK) == 0)
+			vh->tci = htons((tci & ~VLAN_VID_MASK) | vid);
+		else if (iface->trunk)
+			vid = tci & VLAN_VID_MASK;
+		else
+			return -1;
+	}
+
+	if (vid == 0 || !vlan_is_member(iface, vid))
+		return -1;
+
+	return vid;
+}
+
+// untag the tagged frame in place
+static inline char *vlan_pop_tag(char *packet)
+{
+	memmove(packet + VLAN_HLEN, packet, 2 * ETH_ALEN);
+	return packet + VLAN_HLEN;
+}
+
+static inline int vlan_frame_tagged(const char *packet)
+{
+	return ((struct vlan_ether_header *)packet)->tpid == htons(ETH_P_8021Q);
+}
+
+// send the frame of vlan vid out of iface, tagging or untagging it in place
+// as iface sends the frames of vid
+void vlan_send_packet(iface_info_t *iface, u16 vid, char *packet, int len)
+{
+	int tagged = vlan_frame_tagged(packet);
+	if (!vlan_is_member(iface, vid)) {
+		metrics_drop(DROP_VLAN_FILTERED);
+		return ;
+	}
+
+	if (tagged && !vlan_is_tagged(iface, vid)) {
+		packet = vlan_pop_tag(packet);
+		len -= VLAN_HLEN;
+	}
+	else if (!tagged && vlan_is_tagged(iface, vid)) {
+		packet = vlan_push_tag(packet, vid);
+		len += VLAN_HLEN;
+	}
+
+	iface_send_packet(iface, packet, len);
+}
+
+// flood the frame of vlan vid received on iface to the other member ports
+//
+// The ports sending the frame in its format share the buffer, and the others
+// share one copy of it, tagged or untagged.
+void vlan_flood_packet(iface_info_t *iface, u16 vid, const char *packet, int len)
+{
+	struct vlan_flood *flood = &vlans[vid]->flood[iface->index];
+	int tagged = vlan_frame_tagged(packet);
+
+	iface_info_t **same = tagged ? flood->tagged : flood->untagged;
+	int nr_same = tagged ? flood->nr_tagged : flood->nr_untagged;
+	iface_info_t **other = tagged ? flood->untagged : flood->tagged;
+	int nr_other = tagged ? flood->nr_untagged : flood->nr_tagged;
+
+	if (nr_same > 0)
+		iface_flood_packet(same, nr_same, packet, len);
+	if (nr_other == 0)
+		return ;
+
+	int copy_len = tagged ? len - VLAN_HLEN : len + VLAN_HLEN;
+	char *copy = packet_alloc(copy_len);
+	if (!copy) {
+		metrics_drop(DROP_NO_BUFFER);
+		return ;
+	}
+
+	if (tagged) {
+		memcpy(copy, packet, 2 * ETH_ALEN);
+		memcpy(copy + 2 * ETH_ALEN, packet + 2 * ETH_ALEN + VLAN_HLEN, \
+				len - 2 * ETH_ALEN - VLAN_HLEN);
+	}
+	else {
+		struct vlan_ether_header *vh = (struct vlan_ether_header *)copy;
+		memcpy(copy, packet, 2 * ETH_ALEN);
+		vh->tpid = htons(ETH_P_8021Q);
+		vh->tci = htons(vid);
+		memcpy(copy + 2 * ETH_ALEN + VLAN_HLEN, packet + 2 * ETH_ALEN, \
+				len - 2 * ETH_ALEN);
+	}
+
+	iface_flood_packet(other, nr_other, copy, copy_len);
+	packet_free(copy);
+}
@@ -3,6 +3,7 @@
 #include "log.h"
 
 #include <stdlib.h>
+#include <linux/filter.h>
 
 ustack_t *instance;
 
@@ -36,14 +37,56 @@ void iface_send_packet(iface_info_t *iface, const char *packet, int len)
 	}
 }
 
+// frames sent by ourselves are dropped, and only the frames destined to the
+// STP multicast address (01:80:C2:00:00:00) are kept
+static struct sock_filter rx_filter[] = {
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 5, 0),
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0),				// ether_dhost[0..3]
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x0180C200, 0, 3),
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4),				// ether_dhost[4..5]
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x0000, 0, 1),
+	BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+	BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+// attach rx_filter to socket sd, so that the unwanted frames are dropped in
+// kernel, without waking us up or copying them to userspace
+static int attach_rx_filter(int sd)
+{
+	struct sock_fprog prog = {
+		.len = sizeof(rx_filter) / sizeof(struct sock_filter),
+		.filter = rx_filter,
+	};
+	if (setsockopt(sd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+		perror("setsockopt() SO_ATTACH_FILTER failed!");
+		return -1;
+	}
+
+#ifdef PACKET_IGNORE_OUTGOING
+	// the outgoing frames are not even cloned for this socket (since linux
+	// 4.20), otherwise they are dropped by rx_filter
+	int one = 1;
+	if (setsockopt(sd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one)) < 0)
+		log(DEBUG, "PACKET_IGNORE_OUTGOING is not supported: %s", strerror(errno));
+#endif
+
+	return 0;
+}
+
 int open_device(const char *dname)
 {
-	int sd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	// no frame is received before binding with ETH_P_ALL, so that none of
+	// them slips in before the filter is attached
+	int sd = socket(AF_PACKET, SOCK_RAW, 0);
 	if (sd < 0) { 
 		perror("creating SOCK_RAW failed!");
 		return -1;
 	}
 
+	if (attach_rx_filter(sd) < 0)
+		return -1;
+
 	struct ifreq ifr;
 	bzero(&ifr, sizeof(struct ifreq));
 	strcpy(ifr.ifr_name, dname);
@@ -56,6 +99,7 @@ int open_device(const char *dname)
 	bzero(&sll, sizeof(sll));
 	sll.sll_family = AF_PACKET;
 	sll.sll_ifindex = ifr.ifr_ifindex;
+	sll.sll_protocol = htons(ETH_P_ALL);
 
 	if (bind((int)sd, (struct sockaddr *) &sll, sizeof(sll)) < 0) {
 		perror("binding to device failed!");
@@ -43,7 +43,6 @@ struct stp {
 	stp_port_t ports[STP_MAX_PORTS];
 
 	pthread_mutex_t lock;
-	pthread_t timer_thread;
 };
 
 void stp_init(struct list_head *iface_list);
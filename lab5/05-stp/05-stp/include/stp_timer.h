@@ -2,26 +2,26 @@
 #define __STP_TIMER_H__
 
 #include "types.h"
-#include "list.h"
+#include "timer.h"
 
-#include <sys/time.h>
+#include <pthread.h>
 
 typedef void (*timeout_handler)(void *arg);
 
 typedef struct {
-	struct list_head list;
+	struct timer timer;		// expires at time + timeout
 	bool active;
 	long long int time;		// time when the timer is set active
 	int timeout;
 	timeout_handler func;
 	void *arg;
+	pthread_mutex_t *lock;	// held when calling func
 } stp_timer_t;
 
 long long int time_tick_now();
-void stp_init_timer(stp_timer_t *timer, \
+void stp_init_timer(stp_timer_t *timer, pthread_mutex_t *lock, \
 		int timeout, timeout_handler func, void *arg);
 void stp_start_timer(stp_timer_t *timer, long long int time);
 void stp_stop_timer(stp_timer_t *timer);
-void stp_timer_run_once(long long int now);
 
 #endif
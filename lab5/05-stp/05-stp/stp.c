@@ -121,23 +121,6 @@ static void stp_port_init(stp_port_t *p)
 	p->designated_cost = stp->root_path_cost;
 }
 
-void *stp_timer_routine(void *arg)
-{
-	while (true) {
-		long long int now = time_tick_now();
-
-		pthread_mutex_lock(&stp->lock);
-
-		stp_timer_run_once(now);
-
-		pthread_mutex_unlock(&stp->lock);
-
-		usleep(100);
-	}
-
-	return NULL;
-}
-
 // judge if port p's config is superior to another
 // true -> superior
 // false-> not
@@ -350,7 +333,9 @@ void stp_init(struct list_head *iface_list)
 	stp->root_path_cost = 0;
 	stp->root_port = NULL;
 
-	stp_init_timer(&stp->hello_timer, STP_HELLO_TIME, \
+	pthread_mutex_init(&stp->lock, NULL);
+
+	stp_init_timer(&stp->hello_timer, &stp->lock, STP_HELLO_TIME, \
 			stp_handle_hello_timeout, (void *)stp);
 
 	stp_start_timer(&stp->hello_timer, time_tick_now());
@@ -373,15 +358,14 @@ void stp_init(struct list_head *iface_list)
 		stp->nports += 1;
 	}
 
-	pthread_mutex_init(&stp->lock, NULL);
-	pthread_create(&stp->timer_thread, NULL, stp_timer_routine, NULL);
-
 	signal(SIGTERM, stp_handle_signal);
 }
 
 void stp_destroy()
 {
-	pthread_kill(stp->timer_thread, SIGKILL);
+	pthread_mutex_lock(&stp->lock);
+	stp_stop_timer(&stp->hello_timer);
+	pthread_mutex_unlock(&stp->lock);
 
 	for (int i = 0; i < stp->nports; i++) {
 		stp_port_t *port = &stp->ports[i];
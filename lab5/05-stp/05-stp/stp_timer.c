@@ -1,70 +1,50 @@
 #include "stp_timer.h"
 
-#include "log.h"
-
-bool timer_list_initialized = false;
-
-struct list_head timer_list;
-
-// one tick is 1/256 second
+// one tick is 1/256 second, of the timer clock (which might be virtual)
 long long int time_tick_now()
 {
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	
-	return (long long int)(now.tv_sec) * 256 + now.tv_usec * 256 / 1000000;
+	return (long long int)timer_now() * 256 / 1000;
 }
 
-void stp_init_timer(stp_timer_t *timer, \
-		int timeout, timeout_handler func, void *arg) 
+// the handler is called with the lock held, if the stp timer is not stopped
+// or restarted in the meanwhile
+static void stp_timer_expired(void *arg)
 {
-	if (!timer_list_initialized) {
-		init_list_head(&timer_list);
-		timer_list_initialized = true;
+	stp_timer_t *timer = arg;
+
+	pthread_mutex_lock(timer->lock);
+	if (timer->active && !timer_pending(&timer->timer)) {
+		timer->active = false;
+		timer->func(timer->arg);
 	}
+	pthread_mutex_unlock(timer->lock);
+}
 
-	init_list_head(&timer->list);
+void stp_init_timer(stp_timer_t *timer, pthread_mutex_t *lock, \
+		int timeout, timeout_handler func, void *arg) 
+{
+	init_timer(&timer->timer, stp_timer_expired, timer);
 
 	timer->active = false;
 	timer->timeout = timeout;
 	timer->func = func;
 	timer->arg = arg;
-
-	list_add_tail(&timer->list, &timer_list);
+	timer->lock = lock;
 }
 
 void stp_start_timer(stp_timer_t *timer, long long int time)
 {
 	timer->active = true;
 	timer->time = time;
+
+	long long int remaining = time + timer->timeout - time_tick_now();
+	if (remaining < 0)
+		remaining = 0;
+	mod_timer(&timer->timer, remaining * 1000 / 256);
 }
 
 void stp_stop_timer(stp_timer_t *timer)
 {
 	timer->active = false;
-}
-
-bool stp_check_timer(stp_timer_t *timer, long long int now)
-{
-	if (timer->active) {
-		if (now >= timer->time + timer->timeout) {
-			timer->active = false;
-			return true;
-		}
-	}
-	return false;
-}
-
-void stp_timer_run_once(long long int now)
-{
-	if (!timer_list_initialized) {
-		log(ERROR, "no timer in the list.");
-		return ;
-	}
-
-	stp_timer_t *timer;
-	list_for_each_entry(timer, &timer_list, list) {
-		if (stp_check_timer(timer, now))
-			timer->func(timer->arg);
-	}
+	del_timer(&timer->timer);
 }
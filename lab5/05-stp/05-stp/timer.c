@@ -0,0 +1,465 @@
+#include "timer.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+
+// WHEEL_LEVELS levels of WHEEL_SIZE slots: the slots of level 0 are 1 tick
+// each, and those of level n are WHEEL_SIZE times of level n - 1, i.e.
+// timers expiring in 2^24 ms (4.6 hours) are held, farther ones are put in
+// the last slot and re-added when cascaded
+#define WHEEL_BITS		6
+#define WHEEL_SIZE		(1 << WHEEL_BITS)
+#define WHEEL_MASK		(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS	4
+#define WHEEL_MAX		((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+#define NO_EVENT		UINT64_MAX
+
+static struct {
+	struct list_head slots[WHEEL_LEVELS * WHEEL_SIZE];
+	u64 bitmap[WHEEL_LEVELS];	// non-empty slots of each level
+	u64 clk;					// the next tick to run
+	u64 armed;					// expiry of the timerfd (NO_EVENT if disarmed)
+	int running;				// whether the timers are being run
+	int tfd;					// timerfd waken up at the next event
+	pthread_mutex_t lock;
+
+	int virtual;				// whether on the virtual clock
+	u64 now;					// current tick of the virtual clock
+	int driven;					// whether the virtual clock is advanced by
+								// timer_advance, instead of fast-forwarded
+	int awake;					// number of sleepers woken up, which have not
+								// gone to sleep again
+	pthread_cond_t cond;		// signals the changes of the virtual clock
+} wheel;
+
+static pthread_once_t wheel_once = PTHREAD_ONCE_INIT;
+
+static __thread int sleeper_awake;	// whether this thread is counted in awake
+
+static void wheel_init();
+
+// in ms of the monotonic clock
+static u64 clock_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+// current tick, of the monotonic or the virtual clock
+u64 timer_now()
+{
+	pthread_once(&wheel_once, wheel_init);
+	if (wheel.virtual)
+		return __atomic_load_n(&wheel.now, __ATOMIC_RELAXED);
+
+	return clock_now();
+}
+
+// current tick as timer_now, but from the coarse monotonic clock, which is
+// only updated by the kernel every few ms, and read without the TSC, for the
+// timestamps taken per packet which are only compared in seconds
+u64 timer_now_coarse()
+{
+	pthread_once(&wheel_once, wheel_init);
+	if (wheel.virtual)
+		return __atomic_load_n(&wheel.now, __ATOMIC_RELAXED);
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+// whether the timers run on the virtual clock
+int timer_virtual_clock()
+{
+	pthread_once(&wheel_once, wheel_init);
+	return wheel.virtual;
+}
+
+static void wheel_add(struct timer *timer)
+{
+	u64 expires = timer->expires;
+	if (expires < wheel.clk)
+		expires = wheel.clk;
+	else if (expires - wheel.clk > WHEEL_MAX)
+		expires = wheel.clk + WHEEL_MAX;
+
+	u64 delta = expires - wheel.clk;
+	int level = 0;
+	while (level < WHEEL_LEVELS - 1 && delta >> (WHEEL_BITS * (level + 1)))
+		level += 1;
+
+	int idx = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	timer->slot = level * WHEEL_SIZE + idx;
+	list_add_tail(&timer->list, &wheel.slots[timer->slot]);
+	wheel.bitmap[level] |= 1ULL << idx;
+}
+
+static void wheel_remove(struct timer *timer)
+{
+	list_delete_entry(&timer->list);
+	if (timer->slot >= 0 && list_empty(&wheel.slots[timer->slot]))
+		wheel.bitmap[timer->slot / WHEEL_SIZE] &= ~(1ULL << (timer->slot % WHEEL_SIZE));
+}
+
+// the earliest tick from clk on, when a slot is to run (level 0) or to be
+// cascaded (other levels)
+static u64 wheel_next()
+{
+	u64 next = NO_EVENT;
+
+	for (int level = 0; level < WHEEL_LEVELS; level++) {
+		u64 bitmap = wheel.bitmap[level];
+		if (!bitmap)
+			continue;
+
+		// the first slot of this level starting from clk on, and the first
+		// non-empty one from there (in rotation)
+		int shift = WHEEL_BITS * level;
+		u64 start = (wheel.clk + (1ULL << shift) - 1) >> shift;
+		int idx = start & WHEEL_MASK;
+		u64 rotated = idx ? (bitmap >> idx) | (bitmap << (WHEEL_SIZE - idx)) : bitmap;
+		u64 tick = (start + __builtin_ctzll(rotated)) << shift;
+		if (tick < next)
+			next = tick;
+	}
+
+	return next;
+}
+
+// move the timers in the slot of the level down to the lower levels
+static void wheel_cascade(int level, int idx)
+{
+	struct list_head *slot = &wheel.slots[level * WHEEL_SIZE + idx];
+	struct list_head timers;
+	init_list_head(&timers);
+
+	if (list_empty(slot))
+		return ;
+	list_insert(&timers, slot->prev, slot);
+	list_delete_entry(slot);
+	init_list_head(slot);
+	wheel.bitmap[level] &= ~(1ULL << idx);
+
+	while (!list_empty(&timers)) {
+		struct timer *timer = list_entry(timers.next, struct timer, list);
+		list_delete_entry(&timer->list);
+		wheel_add(timer);
+	}
+}
+
+// arm the timerfd at the next event
+static void wheel_arm()
+{
+	u64 next = wheel_next();
+	if (next == wheel.armed)
+		return ;
+
+	struct itimerspec its;
+	bzero(&its, sizeof(its));
+	if (next != NO_EVENT) {
+		its.it_value.tv_sec = next / 1000;
+		its.it_value.tv_nsec = (next % 1000) * 1000000;
+	}
+	if (timerfd_settime(wheel.tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		perror("Arm timerfd failed");
+		exit(1);
+	}
+	wheel.armed = next;
+}
+
+// run all the timers expiring until now, with the lock held, which is
+// released when calling each handler
+static void wheel_run(u64 now)
+{
+	while (wheel.clk <= now) {
+		u64 tick = wheel_next();
+		if (tick > now) {
+			wheel.clk = now + 1;
+			break;
+		}
+
+		wheel.clk = tick;
+		for (int level = 1; level < WHEEL_LEVELS; level++) {
+			int shift = WHEEL_BITS * level;
+			if (tick & ((1ULL << shift) - 1))
+				break;
+			wheel_cascade(level, (tick >> shift) & WHEEL_MASK);
+		}
+		// timers armed by the handlers of this tick go to the next one
+		wheel.clk = tick + 1;
+
+		int idx = tick & WHEEL_MASK;
+		struct list_head *slot = &wheel.slots[idx];
+		struct list_head expired;
+		init_list_head(&expired);
+		if (list_empty(slot))
+			continue;
+		list_insert(&expired, slot->prev, slot);
+		list_delete_entry(slot);
+		init_list_head(slot);
+		wheel.bitmap[0] &= ~(1ULL << idx);
+
+		struct timer *timer = NULL;
+		list_for_each_entry(timer, &expired, list)
+			timer->slot = -1;
+
+		while (!list_empty(&expired)) {
+			timer = list_entry(expired.next, struct timer, list);
+			list_delete_entry(&timer->list);
+			__atomic_store_n(&timer->pending, 0, __ATOMIC_RELAXED);
+
+			timer_handler_t func = timer->func;
+			void *arg = timer->arg;
+			pthread_mutex_unlock(&wheel.lock);
+			func(arg);
+			pthread_mutex_lock(&wheel.lock);
+		}
+	}
+}
+
+// advance the virtual clock to now (if later), stopping at each event on the
+// way, so that the handlers see the time they expire at
+static void vclock_advance(u64 now)
+{
+	wheel.running = 1;
+	u64 next;
+	while ((next = wheel_next()) <= now) {
+		if (next > wheel.now)
+			__atomic_store_n(&wheel.now, next, __ATOMIC_RELAXED);
+		wheel_run(wheel.now);
+	}
+	if (now > wheel.now)
+		__atomic_store_n(&wheel.now, now, __ATOMIC_RELAXED);
+	wheel_run(wheel.now);
+	wheel.running = 0;
+	pthread_cond_broadcast(&wheel.cond);
+}
+
+// the timer changed might be the next event: re-arm the timerfd if it is
+// earlier, or let the virtual clock check it
+static void wheel_kick(u64 expires)
+{
+	if (wheel.virtual)
+		pthread_cond_broadcast(&wheel.cond);
+	// the timer thread arms the timerfd by itself after running the timers,
+	// otherwise it is only re-armed when the next event becomes earlier
+	else if (!wheel.running && expires < wheel.armed)
+		wheel_arm();
+}
+
+static void *timer_thread(void *arg)
+{
+	while (1) {
+		u64 expirations;
+		if (read(wheel.tfd, &expirations, sizeof(expirations)) < 0 && errno != EINTR) {
+			perror("Read timerfd failed");
+			exit(1);
+		}
+
+		pthread_mutex_lock(&wheel.lock);
+		wheel.armed = NO_EVENT;
+		wheel.running = 1;
+		wheel_run(timer_now());
+		wheel.running = 0;
+		wheel_arm();
+		pthread_mutex_unlock(&wheel.lock);
+	}
+
+	return NULL;
+}
+
+// the virtual clock jumps to the next event, once the sleepers woken up by
+// the last one have gone to sleep again, unless it is driven by timer_advance
+static void *vclock_thread(void *arg)
+{
+	pthread_mutex_lock(&wheel.lock);
+	while (1) {
+		u64 next = wheel_next();
+		if (wheel.driven || wheel.awake > 0 || next == NO_EVENT) {
+			pthread_cond_wait(&wheel.cond, &wheel.lock);
+			continue;
+		}
+
+		vclock_advance(next);
+	}
+	pthread_mutex_unlock(&wheel.lock);
+
+	return NULL;
+}
+
+static void wheel_init()
+{
+	for (int i = 0; i < WHEEL_LEVELS * WHEEL_SIZE; i++)
+		init_list_head(&wheel.slots[i]);
+	wheel.armed = NO_EVENT;
+	pthread_mutex_init(&wheel.lock, NULL);
+	pthread_cond_init(&wheel.cond, NULL);
+
+	// on live interfaces, the clock would be fast-forwarded whenever no 
+	// sleeper is awake, while the peers run on the real time
+	char *env = getenv("USTACK_VCLOCK");
+	if (env && atoi(env) > 0 && !getenv("USTACK_VDEV")) {
+		log(INFO, "USTACK_VCLOCK is only used with USTACK_VDEV.");
+		env = NULL;
+	}
+	if (env && atoi(env) > 0) {
+		// the virtual clock starts from 0, and no timerfd is needed
+		wheel.virtual = 1;
+		wheel.clk = wheel.now = 0;
+		log(INFO, "timers run on the virtual clock.");
+	}
+	else {
+		wheel.clk = clock_now();
+		wheel.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		if (wheel.tfd < 0) {
+			perror("Create timerfd failed");
+			exit(1);
+		}
+	}
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, wheel.virtual ? vclock_thread : timer_thread, NULL) != 0) {
+		log(ERROR, "could not create the timer thread.");
+		exit(1);
+	}
+	pthread_detach(thread);
+}
+
+// initialize the timer, the timer thread is started with the first timer
+void init_timer(struct timer *timer, timer_handler_t func, void *arg)
+{
+	pthread_once(&wheel_once, wheel_init);
+
+	bzero(timer, sizeof(struct timer));
+	init_list_head(&timer->list);
+	timer->slot = -1;
+	timer->func = func;
+	timer->arg = arg;
+}
+
+// arm the timer at expires, with the lock held
+static void wheel_mod(struct timer *timer, u64 expires)
+{
+	if (timer->pending)
+		wheel_remove(timer);
+	timer->expires = expires;
+	__atomic_store_n(&timer->pending, 1, __ATOMIC_RELAXED);
+	wheel_add(timer);
+	wheel_kick(expires);
+}
+
+// arm the timer to expire after timeout ms, or re-arm it if already armed
+void mod_timer(struct timer *timer, u64 timeout)
+{
+	u64 expires = timer_now() + timeout;
+
+	pthread_mutex_lock(&wheel.lock);
+	wheel_mod(timer, expires);
+	pthread_mutex_unlock(&wheel.lock);
+}
+
+// re-arm the timer only if it is armed and has not expired (return 1 then),
+// so that an expired timer, whose handler might be running, is not armed again
+int mod_timer_pending(struct timer *timer, u64 timeout)
+{
+	u64 expires = timer_now() + timeout;
+	int pending = 0;
+
+	pthread_mutex_lock(&wheel.lock);
+	if (timer->pending) {
+		wheel_remove(timer);
+		timer->expires = expires;
+		wheel_add(timer);
+		wheel_kick(expires);
+		pending = 1;
+	}
+	pthread_mutex_unlock(&wheel.lock);
+
+	return pending;
+}
+
+// cancel the timer, return 1 if it was armed and has not expired
+int del_timer(struct timer *timer)
+{
+	int pending = 0;
+
+	pthread_mutex_lock(&wheel.lock);
+	if (timer->pending) {
+		wheel_remove(timer);
+		__atomic_store_n(&timer->pending, 0, __ATOMIC_RELAXED);
+		pending = 1;
+	}
+	pthread_mutex_unlock(&wheel.lock);
+
+	return pending;
+}
+
+static void timer_wake_up(void *arg)
+{
+	int *done = arg;
+
+	pthread_mutex_lock(&wheel.lock);
+	*done = 1;
+	wheel.awake += 1;
+	pthread_cond_broadcast(&wheel.cond);
+	pthread_mutex_unlock(&wheel.lock);
+}
+
+// sleep for timeout ms of the timer clock
+//
+// On the virtual clock, the sleeper is woken up by a timer, and is counted as
+// awake until it sleeps again, so that the clock does not move on while it is
+// doing the work of this tick.
+void timer_sleep(u64 timeout)
+{
+	pthread_once(&wheel_once, wheel_init);
+	if (!wheel.virtual) {
+		struct timespec ts = {
+			.tv_sec = timeout / 1000,
+			.tv_nsec = (timeout % 1000) * 1000000,
+		};
+		while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+			;
+		return ;
+	}
+
+	struct timer timer;
+	int done = 0;
+	init_timer(&timer, timer_wake_up, &done);
+
+	pthread_mutex_lock(&wheel.lock);
+	wheel_mod(&timer, wheel.now + timeout);
+	if (sleeper_awake) {
+		sleeper_awake = 0;
+		wheel.awake -= 1;
+	}
+	while (!done)
+		pthread_cond_wait(&wheel.cond, &wheel.lock);
+	sleeper_awake = 1;
+	pthread_mutex_unlock(&wheel.lock);
+}
+
+// advance the virtual clock to now, running the timers due on the way, and
+// stop fast-forwarding it: the caller drives the clock from then on
+void timer_advance(u64 now)
+{
+	pthread_once(&wheel_once, wheel_init);
+	if (!wheel.virtual)
+		return ;
+
+	pthread_mutex_lock(&wheel.lock);
+	wheel.driven = 1;
+	while (wheel.running || wheel.awake > 0)
+		pthread_cond_wait(&wheel.cond, &wheel.lock);
+	vclock_advance(now);
+	pthread_mutex_unlock(&wheel.lock);
+}
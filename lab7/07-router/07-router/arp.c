@@ -3,12 +3,14 @@
 #include "types.h"
 #include "ether.h"
 #include "arpcache.h"
+#include "packet_pool.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 // #include "log.h"
+#include "metrics.h"
 
 const u8 eth_broadcast_addr[] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
 const u8 arp_request_addr[] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
@@ -18,7 +20,7 @@ const u8 arp_request_addr[] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
 void arp_send_request(iface_info_t *iface, u32 dst_ip)
 {
 	//fprintf(stderr, "TODO: send arp request when lookup failed in arpcache.\n");
-	char *packet = (char *)malloc(ETHER_HDR_SIZE + sizeof(struct ether_arp));
+	char *packet = packet_alloc(ETHER_HDR_SIZE + sizeof(struct ether_arp));
 	memset(packet, 0, ETHER_HDR_SIZE + sizeof(struct ether_arp));
 	
 	struct ether_header *eh = (struct ether_header *)packet;
@@ -47,7 +49,7 @@ void arp_send_request(iface_info_t *iface, u32 dst_ip)
 void arp_send_reply(iface_info_t *iface, struct ether_arp *req_hdr)
 {
 	//fprintf(stderr, "TODO: send arp reply when receiving arp request.\n");
-	char *packet = (char*)malloc(ETHER_HDR_SIZE + sizeof(struct ether_arp));
+	char *packet = packet_alloc(ETHER_HDR_SIZE + sizeof(struct ether_arp));
 	struct ether_header *eh = (struct ether_header *)packet;
 	struct ether_arp *arp =  (struct ether_arp*)(packet + ETHER_HDR_SIZE);
 	//ether header
@@ -90,7 +92,7 @@ void handle_arp_packet(iface_info_t *iface, char *packet, int len)
 		fprintf(stderr, "Unknown arp packet type");
 	}
 
-	free(packet);
+	packet_free(packet);
 }
 
 // send (IP) packet through arpcache lookup 
@@ -100,6 +102,8 @@ void handle_arp_packet(iface_info_t *iface, char *packet, int len)
 // this packet into arpcache, and send arp request.
 void iface_send_packet_by_arp(iface_info_t *iface, u32 dst_ip, char *packet, int len)
 {
+	latency_stage(LAT_SEND_BY_ARP);
+
 	struct ether_header *eh = (struct ether_header *)packet;
 	memcpy(eh->ether_shost, iface->mac, ETH_ALEN);
 	eh->ether_type = htons(ETH_P_IP);
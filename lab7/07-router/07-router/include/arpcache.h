@@ -4,12 +4,15 @@
 #include "base.h"
 #include "types.h"
 #include "list.h"
+#include "timer.h"
+#include "rcu.h"
 
 #include <pthread.h>
 
 #define MAX_ARP_SIZE 32
 #define ARP_ENTRY_TIMEOUT 15
 #define ARP_REQUEST_MAX_RETRIES	5
+#define ARP_REQUEST_INTERVAL 1
 
 struct cached_pkt {
 	struct list_head list;
@@ -21,28 +24,33 @@ struct arp_req {
 	struct list_head list;
 	iface_info_t *iface;
 	u32 ip4;
-	time_t sent;
+	struct timer timer;		// retransmission of arp request
 	int retries;
+	int answered;			// replied while the timer is running
 	struct list_head cached_packets;
 };
 
+// never changed once published, replaced by a new one instead
 struct arp_cache_entry {
+	struct rcu_head rcu;
 	u32 ip4; 	// stored in host byte order
 	u8 mac[ETH_ALEN];
-	time_t added;
-	int valid;
+};
+
+struct arp_cache_slot {
+	struct arp_cache_entry *entry;	// published to lookups, NULL if free
+	struct timer timer;	// timeout of the entry
 };
 
 typedef struct {
-	struct arp_cache_entry entries[MAX_ARP_SIZE];
+	struct arp_cache_slot slots[MAX_ARP_SIZE];
 	struct list_head req_list;
-	pthread_mutex_t lock;
-	pthread_t thread;
+	pthread_mutex_t lock;		// serializes the updates, which are not 
+								// waited by lookups (see rcu.h)
 } arpcache_t;
 
 void arpcache_init();
 void arpcache_destroy();
-void *arpcache_sweep(void *);
 
 int arpcache_lookup(u32 ip4, u8 mac[]);
 void arpcache_insert(u32 ip4, u8 mac[]);
@@ -0,0 +1,195 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include "base.h"
+
+#include <time.h>
+
+// reasons of dropping packets, named in drop_reason_str (metrics.c)
+enum drop_reason {
+	DROP_RX_ERROR = 0,			// failed to receive from the socket
+	DROP_NO_BUFFER,				// no packet buffer available
+	DROP_TX_ERROR,				// failed to send to the socket
+	DROP_UNKNOWN_PROTO,			// unsupported ether type or IP protocol
+	DROP_NOT_LOCAL,				// not destined to us, while not forwarding
+	DROP_NO_ROUTE,				// no route to the destination
+	DROP_TTL_EXCEEDED,			// TTL reaches 0 when forwarding
+	DROP_ARP_UNREACHABLE,		// no ARP reply after all the retries
+	DROP_BAD_CHECKSUM,			// invalid checksum
+	DROP_NAT_INVALID_DIR,		// the direction of NAT could not be decided
+	DROP_NAT_NO_MAPPING,		// no NAT mapping, and not a SYN packet
+	DROP_NAT_NO_PORT,			// NAT runs out of external ports
+	DROP_TCP_NO_SOCK,			// no TCP socket for the packet
+	DROP_TCP_INVALID_SEQ,		// sequence number out of the receiving window
+	DROP_MALFORMED,				// truncated frame or inconsistent headers
+	DROP_VLAN_FILTERED,			// not of a vlan the port is a member of
+	NR_DROP_REASONS,
+};
+
+// stages of the packet pipeline, the latency from receiving the frame to 
+// reaching each stage is recorded (named in latency_stage_str, metrics.c)
+enum latency_stage {
+	LAT_DISPATCH = 0,			// handle_packet
+	LAT_IP,						// handle_ip_packet
+	LAT_LPM,					// longest_prefix_match
+	LAT_SEND_BY_ARP,			// iface_send_packet_by_arp
+	LAT_TCP_PROCESS,			// tcp_process
+	LAT_DONE,					// the frame is handled
+	NR_LAT_STAGES,
+};
+
+// log-linear histogram of TSC cycles: 2^LAT_SUB_BITS buckets for each power
+// of 2, i.e. the values are recorded within 1/2^LAT_SUB_BITS precision
+#define LAT_SUB_BITS		3
+#define LAT_NR_BUCKETS		(64 << LAT_SUB_BITS)
+
+struct latency_hist {
+	u64 count;
+	u64 sum;
+	u64 max;
+	u64 buckets[LAT_NR_BUCKETS];
+};
+
+struct iface_counters {
+	u64 rx_packets;
+	u64 rx_bytes;
+	u64 tx_packets;
+	u64 tx_bytes;
+};
+
+// counters of one thread, which are only updated by the owner thread (without
+// atomic read-modify-write), and summed up over all the threads when exported
+//
+// Blocks are cache-line aligned, so threads never share a line of counters.
+struct metrics_block {
+	struct list_head list;			// link in the list of all blocks
+	int nifaces;					// number of entries in ifaces
+	u64 drops[NR_DROP_REASONS];		// dropped packets of each reason
+	u64 polls;						// iterations of the receiving loop
+	u64 empty_polls;				// iterations which found nothing ready
+	struct latency_hist *lat;		// histograms of each stage (NULL if the
+									// latency is not recorded)
+	struct iface_counters ifaces[];	// counters of each iface, by ifindex
+};
+
+extern __thread struct metrics_block *local_metrics;
+extern int latency_sample;
+extern __thread int latency_countdown;
+extern __thread u64 latency_rx_tsc;
+
+struct metrics_block *metrics_block_alloc();
+void metrics_init();
+
+static inline struct metrics_block *metrics_local()
+{
+	if (!local_metrics)
+		local_metrics = metrics_block_alloc();
+	return local_metrics;
+}
+
+// the owner is the only writer, a relaxed store is enough for the exporter
+// to read a consistent value
+static inline void metrics_add(u64 *counter, u64 n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_iface_rx(iface_info_t *iface, int len)
+{
+	struct metrics_block *mb = metrics_local();
+	if (mb && iface->index < mb->nifaces) {
+		metrics_add(&mb->ifaces[iface->index].rx_packets, 1);
+		metrics_add(&mb->ifaces[iface->index].rx_bytes, len);
+	}
+}
+
+static inline void metrics_iface_tx(iface_info_t *iface, int len)
+{
+	struct metrics_block *mb = metrics_local();
+	if (mb && iface->index < mb->nifaces) {
+		metrics_add(&mb->ifaces[iface->index].tx_packets, 1);
+		metrics_add(&mb->ifaces[iface->index].tx_bytes, len);
+	}
+}
+
+static inline void metrics_drop(enum drop_reason reason)
+{
+	struct metrics_block *mb = metrics_local();
+	if (mb)
+		metrics_add(&mb->drops[reason], 1);
+}
+
+// count one iteration of the receiving loop, in which ready interfaces are
+// found (mostly 0 with busy polling)
+static inline void metrics_poll(int ready)
+{
+	struct metrics_block *mb = metrics_local();
+	if (mb) {
+		metrics_add(&mb->polls, 1);
+		if (ready == 0)
+			metrics_add(&mb->empty_polls, 1);
+	}
+}
+
+static inline u64 read_tsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline int latency_bucket(u64 v)
+{
+	if (v < (1 << LAT_SUB_BITS))
+		return v;
+
+	int shift = 63 - __builtin_clzll(v) - LAT_SUB_BITS;
+	return ((shift + 1) << LAT_SUB_BITS) + ((v >> shift) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+// record the latency of the frame being handled by this thread, from its
+// receiving to the stage (nothing if the thread is not handling a frame)
+static inline void latency_stage(enum latency_stage stage)
+{
+	if (!latency_rx_tsc)
+		return ;
+
+	struct metrics_block *mb = metrics_local();
+	if (!mb || !mb->lat)
+		return ;
+
+	u64 v = read_tsc() - latency_rx_tsc;
+	struct latency_hist *h = &mb->lat[stage];
+	metrics_add(&h->count, 1);
+	metrics_add(&h->sum, v);
+	metrics_add(&h->buckets[latency_bucket(v)], 1);
+	if (v > h->max)
+		__atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+// the frames are handled synchronously by the receiving thread, so the
+// timestamp of receiving is kept per thread until the frame is handled
+//
+// Only one of every latency_sample frames is timestamped: reading the TSC is
+// not free (tens of ns in a VM), and a sampled histogram has the same shape.
+static inline void latency_rx_begin()
+{
+	if (latency_sample && --latency_countdown <= 0) {
+		latency_countdown = latency_sample;
+		latency_rx_tsc = read_tsc();
+	}
+}
+
+static inline void latency_rx_end()
+{
+	if (latency_rx_tsc) {
+		latency_stage(LAT_DONE);
+		latency_rx_tsc = 0;
+	}
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef __RCU_H__
+#define __RCU_H__
+
+#include "types.h"
+#include "list.h"
+
+// read-copy-update with epoch-based reclamation, for the tables looked up on
+// every packet but rarely changed (rtable, arpcache, the mac_port table)
+//
+// Readers take no lock: rcu_read_lock only records the current epoch in the
+// reader record of the thread, which is written by nobody else, and the
+// pointers published by writers are loaded by rcu_dereference. Writers are
+// serialized by the lock of their table, and never change what readers could
+// see in place: a new version is published by rcu_assign_pointer, and the old
+// one is handed to call_rcu, which frees it after a grace period, i.e. when
+// every reader in a critical section since before the publication has left.
+//
+// The receiving loops hold one critical section for a whole batch of packets,
+// so that the fence of rcu_read_lock is paid once per batch, and leave it
+// before waiting in epoll, so that an idle thread never holds up a grace
+// period, as quiescent states do in QSBR. The critical sections could nest,
+// and must not block or keep a reference after rcu_read_unlock. So the TCP
+// stacks, whose handlers could sleep until the application reads, leave the
+// batch out of any critical section, and each lookup takes its own.
+
+struct rcu_reader {
+	struct list_head list;		// link in the registry of readers
+	u64 epoch;					// epoch when the outermost critical section
+								// is entered, 0 if out of any
+	int nesting;				// depth of the critical sections
+	int registered;
+};
+
+struct rcu_head {
+	struct rcu_head *next;
+	void (*func)(struct rcu_head *head);
+};
+
+extern u64 rcu_epoch;
+extern __thread struct rcu_reader rcu_reader;
+
+void rcu_register_thread();
+void synchronize_rcu();
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+
+#define rcu_dereference(p)			__atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define rcu_assign_pointer(p, v)	__atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+static inline void rcu_read_lock()
+{
+	struct rcu_reader *reader = &rcu_reader;
+	if (reader->nesting++ > 0)
+		return ;
+
+	if (!reader->registered)
+		rcu_register_thread();
+
+	__atomic_store_n(&reader->epoch, __atomic_load_n(&rcu_epoch, \
+				__ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	// the epoch must be seen by writers before any pointer is loaded
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void rcu_read_unlock()
+{
+	struct rcu_reader *reader = &rcu_reader;
+	if (--reader->nesting > 0)
+		return ;
+
+	__atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef __XSK_H__
+#define __XSK_H__
+
+#include "base.h"
+
+// AF_XDP backend: with USTACK_XDP=1, a minimal XDP program redirects the
+// frames received on each interface into an AF_XDP socket, which replaces the
+// AF_PACKET one for both receiving and sending.
+//
+// The program is attached in generic (SKB) mode and the socket is bound in
+// copy mode, so that it works on veth and any other device, and is detached
+// when the process exits.
+//
+// Each interface has its own UMEM of XSK_NR_FRAMES frames: the first half is
+// posted to the fill ring for receiving, and the other half is used to send,
+// which are returned by kernel through the completion ring.
+
+#define XSK_FRAME_SIZE		2048
+#define XSK_NR_FRAMES		4096
+#define XSK_RING_SIZE		(XSK_NR_FRAMES / 2)	// size of each ring
+#define XSK_TX_BATCH		64			// kick the tx ring once so many queued
+
+// single producer, single consumer ring shared with kernel
+struct xsk_ring {
+	u32 *producer;
+	u32 *consumer;
+	void *descs;				// u64 addresses (fill and completion rings),
+								// or struct xdp_desc (rx and tx rings)
+	u32 mask;
+	void *map;					// start address of the mapped ring
+	int map_len;				// length of the mapped ring
+};
+
+struct xsk {
+	char *umem;					// frames shared with kernel
+	struct xsk_ring fill;		// frames handed to kernel for receiving
+	struct xsk_ring comp;		// frames sent out by kernel
+	struct xsk_ring rx;			// received frames
+	struct xsk_ring tx;			// frames to send
+	u64 *tx_free;				// addresses of the free frames to send
+	int tx_nfree;				// number of entries in tx_free
+	int tx_pending;				// number of frames queued but not kicked
+	pthread_mutex_t tx_lock;	// packets could be sent from several threads
+	int map_fd;					// XSKMAP from rx queue to the socket
+	int prog_fd;				// the XDP program
+	int link_fd;				// link of the program to the interface
+};
+
+int xsk_open(iface_info_t *iface);
+int xsk_send_packet(iface_info_t *iface, const char *packet, int len, int flush);
+void xsk_flush_tx(iface_info_t *iface);
+int xsk_recv(iface_info_t *iface, packet_handler_t handler);
+
+#endif
@@ -3,6 +3,8 @@
 #include "rtable.h"
 #include "icmp.h"
 #include "arp.h"
+#include "packet_pool.h"
+#include "metrics.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,6 +16,8 @@
 // packet.
 void handle_ip_packet(iface_info_t *iface, char *packet, int len)
 {
+	latency_stage(LAT_IP);
+
 	//fprintf(stderr, "TODO: handle ip packet.\n");
 	struct iphdr *iph =  packet_to_ip_hdr(packet);
 	struct icmphdr *icmph = (struct icmphdr *) IP_DATA(iph);
@@ -25,7 +29,7 @@ void handle_ip_packet(iface_info_t *iface, char *packet, int len)
 	if((daddr==iface->ip) && (protocol==IPPROTO_ICMP) && (type==ICMP_ECHOREQUEST)){
 		//send ICMP echo reply
 		icmp_send_packet(packet, len, ICMP_ECHOREPLY, 0);
-		free(packet);
+		packet_free(packet);
 		return ;
 	}
 
@@ -34,17 +38,21 @@ void handle_ip_packet(iface_info_t *iface, char *packet, int len)
 	//ttl-1
 	iph->ttl --;
 	if(iph->ttl <= 0){
+		metrics_drop(DROP_TTL_EXCEEDED);
 		icmp_send_packet(packet, len, ICMP_TIME_EXCEEDED, ICMP_EXC_TTL);
-		free(packet);
+		packet_free(packet);
 		return ;
 	}
 	//checksum
 	iph->checksum = ip_checksum(iph);
 	//lookup rtable
+	rcu_read_lock();
 	rt_entry_t *match = longest_prefix_match(daddr);
 	if(match == NULL){
+		rcu_read_unlock();
+		metrics_drop(DROP_NO_ROUTE);
 		icmp_send_packet(packet, len, ICMP_DEST_UNREACH, ICMP_NET_UNREACH);
-		free(packet);
+		packet_free(packet);
 		return ;
 	}
 	//get next ip addr
@@ -55,6 +63,8 @@ void handle_ip_packet(iface_info_t *iface, char *packet, int len)
 	else{
 		next_ip = daddr;
 	}
+	iface_info_t *out_iface = match->iface;
+	rcu_read_unlock();
 	//forward
-	iface_send_packet_by_arp(match->iface, next_ip, packet, len);
+	iface_send_packet_by_arp(out_iface, next_ip, packet, len);
 }
@@ -3,8 +3,10 @@
 #include "arpcache.h"
 #include "rtable.h"
 #include "arp.h"
+#include "packet_pool.h"
 
 // #include "log.h"
+#include "metrics.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,17 +29,25 @@ void ip_init_hdr(struct iphdr *ip, u32 saddr, u32 daddr, u16 len, u8 proto)
 
 // lookup in the routing table, to find the entry with the same and longest prefix.
 // the input address is in host byte order
+//
+// The published copy of rtable is looked up, which must be in a critical 
+// section of rcu, and the entry returned is valid until rcu_read_unlock.
 rt_entry_t *longest_prefix_match(u32 dst)
 {
+	latency_stage(LAT_LPM);
+
 	//fprintf(stderr, "TODO: longest prefix match for the packet.\n");
-	rt_entry_t *entry, *match = NULL;
-	list_for_each_entry(entry,&rtable,list){
-		if((entry->dest & entry->mask) == (dst & entry->mask)){
-			if(match == NULL || (unsigned)entry->mask > (unsigned)match->mask)
-				match = entry;
-		}
+	struct rtable_snapshot *snapshot = rcu_dereference(rtable_snapshot);
+	if (!snapshot)
+		return NULL;
+
+	// sorted by the length of prefix, the first match is the longest
+	for (int i = 0; i < snapshot->size; i++) {
+		rt_entry_t *entry = &snapshot->entries[i];
+		if((entry->dest & entry->mask) == (dst & entry->mask))
+			return entry;
 	}
-	return match;
+	return NULL;
 }
 
 // send IP packet
@@ -50,9 +60,12 @@ void ip_send_packet(char *packet, int len)
 	struct iphdr *iph =  packet_to_ip_hdr(packet);
 	u32 daddr = ntohl(iph->daddr);
 	//lookup rtable
+	rcu_read_lock();
 	rt_entry_t *match = longest_prefix_match(daddr);
 	if(match == NULL){
-		free(packet);
+		rcu_read_unlock();
+		metrics_drop(DROP_NO_ROUTE);
+		packet_free(packet);
 		return ;
 	}
 	//get next ip addr
@@ -64,6 +77,8 @@ void ip_send_packet(char *packet, int len)
 	else{
 		next_ip = daddr;
 	}
+	iface_info_t *iface = match->iface;
+	rcu_read_unlock();
 	//forward
-	iface_send_packet_by_arp(match->iface, next_ip, packet, len);
+	iface_send_packet_by_arp(iface, next_ip, packet, len);
 }
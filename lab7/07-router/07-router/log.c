@@ -0,0 +1,452 @@
+#include "log.h"
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define LOG_RING_SIZE		4096	// number of records in each ring (power of 2)
+#define LOG_RECORD_SIZE		256		// size of each record
+#define LOG_DRAIN_INTERVAL	1000	// us to sleep when there is nothing to drain
+#define LOG_LINE_SIZE		1024	// max length of a formatted record
+#define LOG_FLUSH_BUF_SIZE	65536	// records are written to stderr in batch
+
+static const char *log_level_str[] = { "DEBUG", "INFO", "WARNING", "ERROR" };
+
+// a log record, the arguments are stored as 8-byte words in the order of the
+// conversions in fmt, and strings are copied inline
+struct log_record {
+	const char *fmt;
+	const char *file;
+	int line;
+	short level;
+	short truncated;			// the arguments do not fit into the record
+	char args[LOG_RECORD_SIZE - 2 * sizeof(char *) - 2 * sizeof(int)];
+};
+
+// single-producer single-consumer ring of each thread, the owner thread is
+// the only producer and the drainer is the only consumer
+struct log_ring {
+	struct log_ring *next;		// link in the list of all rings
+	int dead;					// the owner thread has exited
+	unsigned long dropped;		// records dropped since the ring is full
+	unsigned long head __attribute__((aligned(64)));	// next to write
+	unsigned long tail __attribute__((aligned(64)));	// next to read
+	struct log_record records[LOG_RING_SIZE];
+};
+
+static struct log_ring *log_rings;
+static __thread struct log_ring *local_ring;
+
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_key;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// a conversion specification in the format string
+struct log_conv {
+	const char *start;			// points to '%'
+	const char *end;			// points to the conversion character
+	int nstars;					// number of '*' for width and precision
+	int length;					// 0, 'H' (hh), 'h', 'l', 'q' (ll), 'j', 'z', 't', 'L'
+	char conv;
+};
+
+// parse the next conversion from *p, return 0 when reaching the end of fmt
+static int next_conv(const char **p, struct log_conv *c)
+{
+	const char *s = *p;
+	while (*s && *s != '%')
+		s++;
+	if (!*s)
+		return 0;
+
+	bzero(c, sizeof(*c));
+	c->start = s++;
+	while (*s && strchr("-+ #0", *s))
+		s++;
+	for (; *s && (*s == '*' || *s == '.' || (*s >= '0' && *s <= '9')); s++) {
+		if (*s == '*')
+			c->nstars += 1;
+	}
+
+	if (*s == 'h' && s[1] == 'h')
+		c->length = 'H', s += 2;
+	else if (*s == 'l' && s[1] == 'l')
+		c->length = 'q', s += 2;
+	else if (*s && strchr("hljztL", *s))
+		c->length = *s++;
+
+	c->conv = *s;
+	c->end = s;
+	*p = *s ? s + 1 : s;
+
+	return 1;
+}
+
+static void log_flush_on_exit()
+{
+	log_flush();
+}
+
+static void log_thread_exit(void *arg)
+{
+	struct log_ring *ring = arg;
+	__atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void *log_drainer(void *arg)
+{
+	while (1) {
+		if (log_flush() == 0)
+			usleep(LOG_DRAIN_INTERVAL);
+	}
+
+	return NULL;
+}
+
+static void log_init()
+{
+	pthread_key_create(&log_key, log_thread_exit);
+	atexit(log_flush_on_exit);
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, log_drainer, NULL) != 0) {
+		perror("Create log drainer thread failed");
+		exit(1);
+	}
+	pthread_detach(thread);
+}
+
+static struct log_ring *log_ring_get()
+{
+	if (local_ring)
+		return local_ring;
+
+	pthread_once(&log_once, log_init);
+
+	struct log_ring *ring = malloc(sizeof(struct log_ring));
+	if (!ring)
+		return NULL;
+	bzero(ring, sizeof(struct log_ring));
+
+	ring->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&log_rings, &ring->next, ring, 0, \
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	pthread_setspecific(log_key, ring);
+	local_ring = ring;
+
+	return ring;
+}
+
+// store the arguments into the record according to the conversions of fmt
+static void log_encode(struct log_record *rec, const char *fmt, va_list ap)
+{
+	char *pos = rec->args, *end = rec->args + sizeof(rec->args);
+	struct log_conv c;
+
+	while (next_conv(&fmt, &c)) {
+		if (c.conv == '%')
+			continue;
+
+		for (int i = 0; i < c.nstars; i++) {
+			if (pos + 8 > end)
+				goto truncated;
+			long long star = va_arg(ap, int);
+			memcpy(pos, &star, 8);
+			pos += 8;
+		}
+
+		if (c.conv == 's') {
+			const char *str = va_arg(ap, const char *);
+			if (!str)
+				str = "(null)";
+			int avail = end - pos;
+			int len = strnlen(str, avail);
+			if (avail <= 0)
+				goto truncated;
+			if (len == avail)
+				len = avail - 1;
+			memcpy(pos, str, len);
+			pos[len] = '\0';
+			pos += (len + 1 + 7) & ~7;
+			continue;
+		}
+
+		if (pos + 8 > end)
+			goto truncated;
+
+		switch (c.conv) {
+			case 'd': case 'i': case 'c': {
+				long long v;
+				if (c.length == 'l') v = va_arg(ap, long);
+				else if (c.length == 'q') v = va_arg(ap, long long);
+				else if (c.length == 'j') v = va_arg(ap, intmax_t);
+				else if (c.length == 'z') v = va_arg(ap, ssize_t);
+				else if (c.length == 't') v = va_arg(ap, ptrdiff_t);
+				else if (c.length == 'H') v = (signed char)va_arg(ap, int);
+				else if (c.length == 'h') v = (short)va_arg(ap, int);
+				else v = va_arg(ap, int);
+				memcpy(pos, &v, 8);
+				break;
+			}
+			case 'u': case 'o': case 'x': case 'X': {
+				unsigned long long v;
+				if (c.length == 'l') v = va_arg(ap, unsigned long);
+				else if (c.length == 'q') v = va_arg(ap, unsigned long long);
+				else if (c.length == 'j') v = va_arg(ap, uintmax_t);
+				else if (c.length == 'z') v = va_arg(ap, size_t);
+				else if (c.length == 't') v = va_arg(ap, ptrdiff_t);
+				else if (c.length == 'H') v = (unsigned char)va_arg(ap, unsigned int);
+				else if (c.length == 'h') v = (unsigned short)va_arg(ap, unsigned int);
+				else v = va_arg(ap, unsigned int);
+				memcpy(pos, &v, 8);
+				break;
+			}
+			case 'f': case 'F': case 'e': case 'E':
+			case 'g': case 'G': case 'a': case 'A': {
+				double v;
+				if (c.length == 'L') v = va_arg(ap, long double);
+				else v = va_arg(ap, double);
+				memcpy(pos, &v, 8);
+				break;
+			}
+			case 'p': {
+				void *v = va_arg(ap, void *);
+				memcpy(pos, &v, sizeof(v));
+				break;
+			}
+			default:
+				// unsupported conversion, the arguments after it are unknown
+				goto truncated;
+		}
+		pos += 8;
+	}
+
+	return ;
+
+truncated:
+	rec->truncated = 1;
+}
+
+void log_write(int level, const char *file, int line, const char *fmt, ...)
+{
+	struct log_ring *ring = log_ring_get();
+	if (!ring)
+		return ;
+
+	unsigned long head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+		// never block the caller for debug and info logs, drop them instead,
+		// while warnings and errors are kept by draining the ring in place
+		if (level < WARNING) {
+			__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+			return ;
+		}
+		log_flush();
+	}
+
+	struct log_record *rec = &ring->records[head & (LOG_RING_SIZE - 1)];
+	rec->fmt = fmt;
+	rec->file = file;
+	rec->line = line;
+	rec->level = level;
+	rec->truncated = 0;
+
+	va_list ap;
+	va_start(ap, fmt);
+	log_encode(rec, fmt, ap);
+	va_end(ap);
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// format a record into buf in the same way as fprintf, return the length
+static int log_format(struct log_record *rec, char *buf, int size)
+{
+	const char *fmt = rec->fmt, *lit = fmt;
+	const char *pos = rec->args, *end = rec->args + sizeof(rec->args);
+	struct log_conv c;
+	int n = 0;
+
+#define LOG_APPEND(...) \
+	do { \
+		int __r = snprintf(buf + n, size - n, __VA_ARGS__); \
+		if (__r > 0) \
+			n = (n + __r < size) ? n + __r : size - 1; \
+	} while (0)
+
+#ifdef LOG_DEBUG
+	LOG_APPEND("[%s:%u] ", rec->file, rec->line);
+#endif
+	LOG_APPEND("%s: ", log_level_str[rec->level]);
+
+	while (next_conv(&fmt, &c)) {
+		LOG_APPEND("%.*s", (int)(c.start - lit), lit);
+		lit = fmt;
+
+		if (c.conv == '%') {
+			LOG_APPEND("%%");
+			continue;
+		}
+
+		// the same conversion, with the length modifier of the stored words
+		char spec[32];
+		int slen = 0;
+		for (const char *s = c.start; s < c.end && slen < 28; s++) {
+			if (!strchr("hljztL", *s))
+				spec[slen++] = *s;
+		}
+		if (strchr("diouxX", c.conv)) {
+			spec[slen++] = 'l';
+			spec[slen++] = 'l';
+		}
+		spec[slen++] = c.conv;
+		spec[slen] = '\0';
+
+		int stars[2] = { 0, 0 };
+		int truncated = 0;
+		for (int i = 0; i < c.nstars && i < 2; i++) {
+			long long star;
+			if (pos + 8 > end) {
+				truncated = 1;
+				break;
+			}
+			memcpy(&star, pos, 8);
+			stars[i] = star;
+			pos += 8;
+		}
+
+		if (!truncated && c.conv == 's' && pos < end) {
+			const char *str = pos;
+			pos += (strlen(str) + 1 + 7) & ~7;
+			if (c.nstars == 2) LOG_APPEND(spec, stars[0], stars[1], str);
+			else if (c.nstars == 1) LOG_APPEND(spec, stars[0], str);
+			else LOG_APPEND(spec, str);
+			continue;
+		}
+		if (truncated || pos + 8 > end || !strchr("diucoxXfFeEgGaAp", c.conv)) {
+			LOG_APPEND("...");
+			lit = "";
+			break;
+		}
+
+		long long v;
+		double d;
+		void *p;
+		memcpy(&v, pos, 8);
+		memcpy(&d, pos, 8);
+		memcpy(&p, pos, sizeof(p));
+		pos += 8;
+
+#define LOG_APPEND_STARS(arg) \
+		do { \
+			if (c.nstars == 2) LOG_APPEND(spec, stars[0], stars[1], arg); \
+			else if (c.nstars == 1) LOG_APPEND(spec, stars[0], arg); \
+			else LOG_APPEND(spec, arg); \
+		} while (0)
+
+		if (c.conv == 'c')
+			LOG_APPEND_STARS((int)v);
+		else if (strchr("fFeEgGaA", c.conv))
+			LOG_APPEND_STARS(d);
+		else if (c.conv == 'p')
+			LOG_APPEND_STARS(p);
+		else
+			LOG_APPEND_STARS(v);
+	}
+	LOG_APPEND("%s%s\n", lit, rec->truncated && *lit ? " ..." : "");
+
+	return n;
+}
+
+// unlink a dead ring which has been drained, only called by the drainer
+static void log_ring_release(struct log_ring *ring)
+{
+	struct log_ring *head = ring;
+	if (__atomic_compare_exchange_n(&log_rings, &head, ring->next, 0, \
+				__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		free(ring);
+		return ;
+	}
+
+	// rings are only pushed at the head, so the predecessor is stable
+	for (struct log_ring *prev = head; prev; prev = prev->next) {
+		if (prev->next == ring) {
+			prev->next = ring->next;
+			free(ring);
+			return ;
+		}
+	}
+}
+
+// format the pending records of ring into buf, which is written to stderr
+// when it is full, return the number of records
+static int log_drain_ring(struct log_ring *ring, char *buf, int *len)
+{
+	unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	unsigned long tail = ring->tail;
+	int n = 0;
+
+	for (; tail != head; tail++) {
+		if (LOG_FLUSH_BUF_SIZE - *len < LOG_LINE_SIZE) {
+			fwrite(buf, 1, *len, stderr);
+			*len = 0;
+		}
+
+		struct log_record *rec = &ring->records[tail & (LOG_RING_SIZE - 1)];
+		*len += log_format(rec, buf + *len, LOG_LINE_SIZE);
+		n += 1;
+	}
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+	unsigned long dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+	if (dropped) {
+		if (LOG_FLUSH_BUF_SIZE - *len < LOG_LINE_SIZE) {
+			fwrite(buf, 1, *len, stderr);
+			*len = 0;
+		}
+		*len += snprintf(buf + *len, LOG_LINE_SIZE, \
+				"WARNING: %lu log records dropped.\n", dropped);
+	}
+
+	return n;
+}
+
+// format and write all the pending records, return the number of them
+//
+// Records of the same thread are written in order, while those of different
+// threads are only ordered by the rings they are in.
+int log_flush()
+{
+	static char buf[LOG_FLUSH_BUF_SIZE];
+	int len = 0, n = 0;
+
+	pthread_mutex_lock(&drain_lock);
+
+	// rings are pushed at the head, drain them from the oldest one
+	int nrings = 0;
+	struct log_ring *ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE);
+	for (struct log_ring *r = ring; r; r = r->next)
+		nrings += 1;
+
+	struct log_ring *rings[nrings + 1];
+	for (int i = 0; i < nrings; i++, ring = ring->next)
+		rings[i] = ring;
+
+	for (int i = nrings - 1; i >= 0; i--) {
+		int dead = __atomic_load_n(&rings[i]->dead, __ATOMIC_ACQUIRE);
+		n += log_drain_ring(rings[i], buf, &len);
+		if (dead)
+			log_ring_release(rings[i]);
+	}
+
+	if (len)
+		fwrite(buf, 1, len, stderr);
+	pthread_mutex_unlock(&drain_lock);
+
+	return n;
+}
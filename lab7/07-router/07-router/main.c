@@ -7,6 +7,10 @@
 #include "rtable.h"
 
 #include "log.h"
+#include "packet_pool.h"
+#include "vdev.h"
+#include "xsk.h"
+#include "metrics.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,6 +23,8 @@
 // the packet should be free'd or cached accordingly.
 void handle_packet(iface_info_t *iface, char *packet, int len)
 {
+	latency_stage(LAT_DISPATCH);
+
 	struct ether_header *eh = (struct ether_header *)packet;
 
 	// log(DEBUG, "got packet from %s, %d bytes, proto: 0x%04hx\n", 
@@ -31,6 +37,7 @@ void handle_packet(iface_info_t *iface, char *packet, int len)
 			handle_arp_packet(iface, packet, len);
 			break;
 		default:
+			metrics_drop(DROP_UNKNOWN_PROTO);
 			log(ERROR, "Unknown packet type 0x%04hx, ingore it.", \
 					ntohs(eh->ether_type));
 			break;
@@ -41,55 +48,62 @@ void handle_packet(iface_info_t *iface, char *packet, int len)
 // like normal TCP/IP stack
 void ustack_run()
 {
-	struct sockaddr_ll addr;
-	socklen_t addr_len = sizeof(addr);
-	char buf[ETH_FRAME_LEN];
-	int len;
+	struct epoll_event events[USTACK_MAX_EVENTS];
+
+	pin_rx_thread(0);
 
+	if (instance->vdev) {
+		vdev_run(handle_packet);
+		return ;
+	}
+
+	if (instance->nworkers > 0) {
+		// packets are received and handled by the workers in parallel
+		ustack_run_workers(handle_packet);
+		return ;
+	}
+
+	// busy polling never sleeps in epoll_wait
+	int timeout = instance->busy_poll ? 0 : -1;
 	while (1) {
-		int ready = poll(instance->fds, instance->nifs, -1);
+		int ready = epoll_wait(instance->epfd, events, USTACK_MAX_EVENTS, timeout);
 		if (ready < 0) {
-			perror("Poll failed!");
+			if (errno == EINTR)
+				continue;
+			perror("Epoll failed!");
 			break;
 		}
-		else if (ready == 0)
+
+		metrics_poll(ready);
+		if (ready == 0)
 			continue;
 
-		for (int i = 0; i < instance->nifs; i++) {
-			if (instance->fds[i].revents & POLLIN) {
-				len = recvfrom(instance->fds[i].fd, buf, ETH_FRAME_LEN, 0, \
-						(struct sockaddr*)&addr, &addr_len);
-				if (len <= 0) {
-					log(ERROR, "receive packet error: %s", strerror(errno));
-				}
-				else if (addr.sll_pkttype == PACKET_OUTGOING) {
-					// XXX: Linux raw socket will capture both incoming and
-					// outgoing packets, while we only care about the incoming ones.
-
-					// log(DEBUG, "received packet which is sent from the "
-					// 		"interface itself, drop it.");
-				}
-				else {
-					iface_info_t *iface = fd_to_iface(instance->fds[i].fd);
-					if (!iface)
-						continue;
-
-					char *packet = malloc(len);
-					if (!packet) {
-						log(ERROR, "malloc failed when receiving packet.");
-						continue;
-					}
-					memcpy(packet, buf, len);
-					handle_packet(iface, packet, len);
-				}
+		// packets sent while handling received ones are flushed in batch, 
+		// before waiting in epoll again, and the whole batch is handled in 
+		// one critical section of rcu
+		rcu_read_lock();
+		tx_batch_begin();
+		for (int i = 0; i < ready; i++) {
+			// each interface is registered with itself as the event data
+			iface_info_t *iface = (iface_info_t *)events[i].data.ptr;
+			if (iface->xsk) {
+				xsk_recv(iface, handle_packet);
+			}
+			else if (instance->rx_ring) {
+				iface_recv_ring(iface, handle_packet);
+			}
+			else {
+				iface_recv_packet(iface, handle_packet);
 			}
 		}
+		tx_batch_end();
+		rcu_read_unlock();
 	}
 }
 
 int main(int argc, const char **argv)
 {
-	if (getuid() && geteuid()) {
+	if (getuid() && geteuid() && !getenv("USTACK_VDEV")) {
 		printf("Permission denied, should be superuser!\n");
 		exit(1);
 	}
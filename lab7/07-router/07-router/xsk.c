@@ -0,0 +1,347 @@
+#include "xsk.h"
+#include "log.h"
+#include "packet_pool.h"
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#ifndef SOL_XDP
+#define SOL_XDP		283
+#endif
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(SYS_bpf, cmd, attr, sizeof(union bpf_attr));
+}
+
+// map the ring at pgoff of the socket fd, with descriptors of desc_size bytes
+static int xsk_map_ring(int fd, struct xsk_ring *ring, struct xdp_ring_offset *off, \
+		int desc_size, off_t pgoff)
+{
+	ring->map_len = off->desc + XSK_RING_SIZE * desc_size;
+	ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, \
+			MAP_SHARED | MAP_POPULATE, fd, pgoff);
+	if (ring->map == MAP_FAILED) {
+		perror("mmap() xsk ring failed!");
+		return -1;
+	}
+
+	ring->producer = (u32 *)((char *)ring->map + off->producer);
+	ring->consumer = (u32 *)((char *)ring->map + off->consumer);
+	ring->descs = (char *)ring->map + off->desc;
+	ring->mask = XSK_RING_SIZE - 1;
+
+	return 0;
+}
+
+// register the UMEM of xsk to the socket fd, and map all the rings
+static int xsk_setup_rings(int fd, struct xsk *xsk)
+{
+	xsk->umem = mmap(NULL, XSK_NR_FRAMES * XSK_FRAME_SIZE, PROT_READ | PROT_WRITE, \
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (xsk->umem == MAP_FAILED) {
+		perror("mmap() umem failed!");
+		return -1;
+	}
+
+	struct xdp_umem_reg mr;
+	bzero(&mr, sizeof(mr));
+	mr.addr = (unsigned long)xsk->umem;
+	mr.len = XSK_NR_FRAMES * XSK_FRAME_SIZE;
+	mr.chunk_size = XSK_FRAME_SIZE;
+	if (setsockopt(fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) < 0) {
+		perror("setsockopt() XDP_UMEM_REG failed!");
+		return -1;
+	}
+
+	int size = XSK_RING_SIZE;
+	if (setsockopt(fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0 || \
+			setsockopt(fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) < 0 || \
+			setsockopt(fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0 || \
+			setsockopt(fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) < 0) {
+		perror("setsockopt() xsk ring size failed!");
+		return -1;
+	}
+
+	struct xdp_mmap_offsets off;
+	socklen_t len = sizeof(off);
+	if (getsockopt(fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len) < 0) {
+		perror("getsockopt() XDP_MMAP_OFFSETS failed!");
+		return -1;
+	}
+
+	if (xsk_map_ring(fd, &xsk->fill, &off.fr, sizeof(u64), XDP_UMEM_PGOFF_FILL_RING) < 0 || \
+			xsk_map_ring(fd, &xsk->comp, &off.cr, sizeof(u64), XDP_UMEM_PGOFF_COMPLETION_RING) < 0 || \
+			xsk_map_ring(fd, &xsk->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) < 0 || \
+			xsk_map_ring(fd, &xsk->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) < 0)
+		return -1;
+
+	// the first half of the frames are posted for receiving, the other half
+	// are free to send
+	u64 *fill = (u64 *)xsk->fill.descs;
+	for (int i = 0; i < XSK_RING_SIZE; i++)
+		fill[i] = (u64)i * XSK_FRAME_SIZE;
+	__atomic_store_n(xsk->fill.producer, XSK_RING_SIZE, __ATOMIC_RELEASE);
+
+	xsk->tx_free = malloc(sizeof(u64) * XSK_RING_SIZE);
+	for (int i = 0; i < XSK_RING_SIZE; i++)
+		xsk->tx_free[i] = (u64)(XSK_RING_SIZE + i) * XSK_FRAME_SIZE;
+	xsk->tx_nfree = XSK_RING_SIZE;
+
+	return 0;
+}
+
+// load the XDP program, which redirects each frame into the socket bound to
+// its rx queue (in map_fd), or passes it to kernel if there is none:
+//
+//   r2 = ctx->rx_queue_index
+//   r1 = map_fd
+//   r3 = XDP_PASS
+//   return bpf_redirect_map(r1, r2, r3)
+static int xsk_load_prog(int map_fd)
+{
+	struct bpf_insn insns[] = {
+		{ .code = BPF_LDX | BPF_MEM | BPF_W, .dst_reg = BPF_REG_2, \
+			.src_reg = BPF_REG_1, .off = offsetof(struct xdp_md, rx_queue_index) },
+		{ .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_1, \
+			.src_reg = BPF_PSEUDO_MAP_FD, .imm = map_fd },
+		{ 0 },		// the upper 32 bits of the imm64 above
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3, .imm = XDP_PASS },
+		{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+
+	union bpf_attr attr;
+	bzero(&attr, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (unsigned long)insns;
+	attr.insn_cnt = sizeof(insns) / sizeof(struct bpf_insn);
+	attr.license = (unsigned long)"GPL";
+
+	return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+// create the XSKMAP and the XDP program for xsk (bound to queue 0 of iface
+// as fd), and attach the program to iface in generic mode
+static int xsk_attach_prog(iface_info_t *iface, struct xsk *xsk, int fd)
+{
+	union bpf_attr attr;
+	bzero(&attr, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(u32);
+	attr.value_size = sizeof(u32);
+	attr.max_entries = 1;
+	xsk->map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+	if (xsk->map_fd < 0) {
+		perror("Create XSKMAP failed");
+		return -1;
+	}
+
+	u32 queue = 0;
+	bzero(&attr, sizeof(attr));
+	attr.map_fd = xsk->map_fd;
+	attr.key = (unsigned long)&queue;
+	attr.value = (unsigned long)&fd;
+	if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+		perror("Add socket into XSKMAP failed");
+		return -1;
+	}
+
+	xsk->prog_fd = xsk_load_prog(xsk->map_fd);
+	if (xsk->prog_fd < 0) {
+		perror("Load XDP program failed");
+		return -1;
+	}
+
+	// the link (and the program) is released when the process exits
+	bzero(&attr, sizeof(attr));
+	attr.link_create.prog_fd = xsk->prog_fd;
+	attr.link_create.target_ifindex = iface->index;
+	attr.link_create.attach_type = BPF_XDP;
+	attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+	xsk->link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+	if (xsk->link_fd < 0) {
+		perror("Attach XDP program failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+// open the AF_XDP socket of iface, and redirect the frames of iface into it,
+// return the socket (which exits on failure)
+int xsk_open(iface_info_t *iface)
+{
+	struct xsk *xsk = malloc(sizeof(struct xsk));
+	bzero(xsk, sizeof(struct xsk));
+	pthread_mutex_init(&xsk->tx_lock, NULL);
+
+	int fd = socket(AF_XDP, SOCK_RAW, 0);
+	if (fd < 0) {
+		perror("Create AF_XDP socket failed");
+		exit(1);
+	}
+
+	if (xsk_setup_rings(fd, xsk) < 0) {
+		log(ERROR, "could not set up xsk rings on %s.", iface->name);
+		exit(1);
+	}
+
+	struct sockaddr_xdp sxdp;
+	bzero(&sxdp, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = iface->index;
+	sxdp.sxdp_queue_id = 0;
+	sxdp.sxdp_flags = XDP_COPY;
+	if (bind(fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0) {
+		perror("Bind AF_XDP socket failed");
+		exit(1);
+	}
+
+	if (xsk_attach_prog(iface, xsk, fd) < 0) {
+		log(ERROR, "could not redirect the frames of %s into AF_XDP socket.", \
+				iface->name);
+		exit(1);
+	}
+
+	iface->xsk = xsk;
+
+	return fd;
+}
+
+// move the frames sent out by kernel from the completion ring to tx_free,
+// with tx_lock held
+static void xsk_reclaim_tx(struct xsk *xsk)
+{
+	u64 *comp = (u64 *)xsk->comp.descs;
+	u32 prod = __atomic_load_n(xsk->comp.producer, __ATOMIC_ACQUIRE);
+	u32 cons = *xsk->comp.consumer;
+
+	for (; cons != prod; cons++)
+		xsk->tx_free[xsk->tx_nfree++] = comp[cons & xsk->comp.mask];
+
+	__atomic_store_n(xsk->comp.consumer, cons, __ATOMIC_RELEASE);
+}
+
+// kick kernel to send the frames in the tx ring, with tx_lock held
+//
+// In copy mode, kernel only sends a limited batch of frames for each kick, so
+// it is kicked until the ring is drained or no more progress is made.
+static void xsk_kick_tx(iface_info_t *iface, struct xsk *xsk)
+{
+	u32 prod = *xsk->tx.producer;
+	u32 cons = __atomic_load_n(xsk->tx.consumer, __ATOMIC_ACQUIRE);
+	while (cons != prod) {
+		if (sendto(iface->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 && \
+				errno != EAGAIN && errno != EBUSY && errno != ENOBUFS) {
+			perror("Kick xsk tx ring failed");
+			break;
+		}
+		xsk_reclaim_tx(xsk);
+
+		u32 last = cons;
+		cons = __atomic_load_n(xsk->tx.consumer, __ATOMIC_ACQUIRE);
+		if (cons == last)
+			break;
+	}
+	xsk->tx_pending = 0;
+}
+
+// kick kernel to send out all the frames queued in the tx ring of iface
+void xsk_flush_tx(iface_info_t *iface)
+{
+	struct xsk *xsk = iface->xsk;
+	if (!__atomic_load_n(&xsk->tx_pending, __ATOMIC_RELAXED))
+		return ;
+
+	pthread_mutex_lock(&xsk->tx_lock);
+	xsk_kick_tx(iface, xsk);
+	pthread_mutex_unlock(&xsk->tx_lock);
+}
+
+// copy the packet into a free frame, and queue it into the tx ring of iface
+//
+// The frames are kicked out immediately if flush is set, or XSK_TX_BATCH
+// frames have been queued.
+int xsk_send_packet(iface_info_t *iface, const char *packet, int len, int flush)
+{
+	struct xsk *xsk = iface->xsk;
+	if (len > XSK_FRAME_SIZE)
+		return -1;
+
+	pthread_mutex_lock(&xsk->tx_lock);
+	if (!xsk->tx_nfree)
+		xsk_reclaim_tx(xsk);
+	if (!xsk->tx_nfree) {
+		// all the frames are in flight, wait until kernel sends some out
+		xsk_kick_tx(iface, xsk);
+		if (!xsk->tx_nfree) {
+			pthread_mutex_unlock(&xsk->tx_lock);
+			return -1;
+		}
+	}
+
+	u64 addr = xsk->tx_free[--xsk->tx_nfree];
+	memcpy(xsk->umem + addr, packet, len);
+
+	// there are as many slots in the tx ring as the frames to send
+	u32 prod = *xsk->tx.producer;
+	struct xdp_desc *desc = &((struct xdp_desc *)xsk->tx.descs)[prod & xsk->tx.mask];
+	desc->addr = addr;
+	desc->len = len;
+	desc->options = 0;
+	__atomic_store_n(xsk->tx.producer, prod + 1, __ATOMIC_RELEASE);
+
+	if (flush || ++xsk->tx_pending >= XSK_TX_BATCH)
+		xsk_kick_tx(iface, xsk);
+	pthread_mutex_unlock(&xsk->tx_lock);
+
+	return 0;
+}
+
+// hand all the frames in the rx ring of iface to handler, and post them back
+// into the fill ring
+//
+// The frame is copied into a buffer from the packet pool, as handler owns the
+// packet and may cache it after the frame is reused by kernel.
+int xsk_recv(iface_info_t *iface, packet_handler_t handler)
+{
+	struct xsk *xsk = iface->xsk;
+	struct xdp_desc *descs = (struct xdp_desc *)xsk->rx.descs;
+	u64 *fill = (u64 *)xsk->fill.descs;
+
+	u32 prod = __atomic_load_n(xsk->rx.producer, __ATOMIC_ACQUIRE);
+	u32 cons = *xsk->rx.consumer;
+	u32 fill_prod = *xsk->fill.producer;
+	int n = 0;
+
+	for (; cons != prod; cons++) {
+		struct xdp_desc *desc = &descs[cons & xsk->rx.mask];
+		char *packet = packet_alloc(desc->len);
+		if (packet) {
+			memcpy(packet, xsk->umem + desc->addr, desc->len);
+			metrics_iface_rx(iface, desc->len);
+			latency_rx_begin();
+			handler(iface, packet, desc->len);
+			latency_rx_end();
+			n += 1;
+		}
+		else {
+			metrics_drop(DROP_NO_BUFFER);
+		}
+
+		// the address may point into the frame (after the headroom)
+		fill[fill_prod++ & xsk->fill.mask] = desc->addr & ~(u64)(XSK_FRAME_SIZE - 1);
+	}
+
+	__atomic_store_n(xsk->rx.consumer, cons, __ATOMIC_RELEASE);
+	__atomic_store_n(xsk->fill.producer, fill_prod, __ATOMIC_RELEASE);
+
+	return n;
+}
@@ -1,27 +1,140 @@
+#define _GNU_SOURCE
+
 #include "base.h"
 #include "ether.h"
 #include "log.h"
+#include "packet_pool.h"
+#include "vdev.h"
+#include "metrics.h"
 
 #include <stdlib.h>
+#include <sched.h>
+#include <linux/filter.h>
+#include <sys/mman.h>
+
+#define RX_RING_BLOCK_SIZE	(1 << 16)	// size of each block in rx ring
+#define RX_RING_BLOCK_NR	64			// number of blocks in rx ring
+#define RX_RING_FRAME_SIZE	2048		// (nominal) size of each frame
+#define RX_RING_BLOCK_TMO	1			// retire a partly filled block after 1ms
+
+#define TX_RING_BLOCK_SIZE	(1 << 16)	// size of each block in tx ring
+#define TX_RING_BLOCK_NR	8			// number of blocks in tx ring
+#define TX_RING_FRAME_SIZE	2048		// size of each slot in tx ring
+#define TX_RING_BATCH		64			// flush the tx ring once so many queued
+
+// the frame data follows the (aligned) tpacket3_hdr in each tx slot
+#define TX_RING_DATA_OFFSET	(TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
 
 ustack_t *instance;
 
-// get the interface according to file descriptor (fd)
-iface_info_t *fd_to_iface(int fd)
+// whether the packets sent by this thread are deferred until tx_batch_end
+static __thread int tx_batching;
+
+// get the interface according to ifindex, NULL if it is not one of ours
+iface_info_t *ifindex_to_iface(int index)
+{
+	if (index <= 0 || index > instance->max_ifindex)
+		return NULL;
+
+	return instance->ifindex_map[index];
+}
+
+// kick kernel to send out all the packets queued in the tx ring of iface
+void iface_flush_tx(iface_info_t *iface)
+{
+	struct tx_ring *ring = iface->tx_ring;
+	if (!ring || !__atomic_load_n(&ring->pending, __ATOMIC_RELAXED))
+		return ;
+
+	pthread_mutex_lock(&ring->lock);
+	ring->pending = 0;
+	pthread_mutex_unlock(&ring->lock);
+
+	if (send(iface->fd, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN)
+		perror("Flush tx ring failed");
+}
+
+// defer the packets sent by this thread, until tx_batch_end is called
+void tx_batch_begin()
+{
+	tx_batching = 1;
+}
+
+// stop deferring, and flush the tx ring of each interface
+void tx_batch_end()
 {
+	tx_batching = 0;
+	if (!instance->tx_ring)
+		return ;
+
 	iface_info_t *iface = NULL;
 	list_for_each_entry(iface, &instance->iface_list, list) {
-		if (iface->fd == fd)
-			return iface;
+		iface_flush_tx(iface);
+	}
+}
+
+static inline int tx_slot_free(struct tpacket3_hdr *hdr)
+{
+	u32 status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+	return status == TP_STATUS_AVAILABLE || status == TP_STATUS_WRONG_FORMAT;
+}
+
+// copy the packet into a free slot of the tx ring of iface
+//
+// The slot is sent out immediately, unless this thread is in a tx batch (the 
+// packets are handled in ustack_run) which will be flushed when the batch 
+// ends, or TX_RING_BATCH packets have been queued.
+static int iface_queue_packet(iface_info_t *iface, const char *packet, int len)
+{
+	struct tx_ring *ring = iface->tx_ring;
+	if (len > ring->frame_size - TX_RING_DATA_OFFSET)
+		return -1;
+
+	pthread_mutex_lock(&ring->lock);
+	struct tpacket3_hdr *hdr = (struct tpacket3_hdr *) \
+		(ring->map + ring->head * ring->frame_size);
+	if (!tx_slot_free(hdr)) {
+		// all the slots are in use, kick kernel to send them out without 
+		// waiting (we are in the middle of a batch), and fall back to 
+		// sendto if no slot is freed yet
+		pthread_mutex_unlock(&ring->lock);
+		iface_flush_tx(iface);
+		pthread_mutex_lock(&ring->lock);
+
+		hdr = (struct tpacket3_hdr *)(ring->map + ring->head * ring->frame_size);
+		if (!tx_slot_free(hdr)) {
+			pthread_mutex_unlock(&ring->lock);
+			return -1;
+		}
 	}
 
-	log(ERROR, "Could not find the desired interface according to fd %d", fd);
+	memcpy((char *)hdr + TX_RING_DATA_OFFSET, packet, len);
+	hdr->tp_len = len;
+	hdr->tp_next_offset = 0;
+	__atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
 
-	return NULL;
+	ring->head = (ring->head + 1) % ring->frame_nr;
+	int pending = ++ring->pending;
+	pthread_mutex_unlock(&ring->lock);
+
+	if (!tx_batching || pending >= TX_RING_BATCH)
+		iface_flush_tx(iface);
+
+	return 0;
 }
 
 void iface_send_packet(iface_info_t *iface, const char *packet, int len)
 {
+	metrics_iface_tx(iface, len);
+
+	if (iface->vdev) {
+		vdev_send_packet(iface, packet, len);
+		return ;
+	}
+
+	if (iface->tx_ring && iface_queue_packet(iface, packet, len) == 0)
+		return ;
+
 	struct sockaddr_ll addr;
 	memset(&addr, 0, sizeof(struct sockaddr_ll));
 	addr.sll_family = AF_PACKET;
@@ -34,20 +147,222 @@ void iface_send_packet(iface_info_t *iface, const char *packet, int len)
 	if (sendto(iface->fd, packet, len, 0, (const struct sockaddr *)&addr,
 				sizeof(struct sockaddr_ll)) < 0) {
 		perror("Send raw packet failed");
+		metrics_drop(DROP_TX_ERROR);
 	}
 
 	//free((char *)packet);
 }
 
+// receive one packet from the socket of iface, and hand it to handler, return
+// the number of packets handled
+int iface_recv_packet(iface_info_t *iface, packet_handler_t handler)
+{
+	struct sockaddr_ll addr;
+	socklen_t addr_len = sizeof(addr);
+
+	// receive into a buffer from the packet pool directly
+	char *packet = packet_alloc(ETH_FRAME_LEN);
+	if (!packet) {
+		metrics_drop(DROP_NO_BUFFER);
+		return 0;
+	}
+
+	int len = recvfrom(iface->fd, packet, ETH_FRAME_LEN, 0, \
+			(struct sockaddr *)&addr, &addr_len);
+	if (len <= 0) {
+		log(ERROR, "receive packet error: %s", strerror(errno));
+		metrics_drop(DROP_RX_ERROR);
+		packet_free(packet);
+	}
+	else if (addr.sll_pkttype == PACKET_OUTGOING) {
+		// XXX: Linux raw socket will capture both incoming and outgoing 
+		// packets, while we only care about the incoming ones.
+		packet_free(packet);
+	}
+	else {
+		metrics_iface_rx(iface, len);
+		latency_rx_begin();
+		handler(iface, packet, len);
+		latency_rx_end();
+		return 1;
+	}
+
+	return 0;
+}
+
+// walk all the blocks handed over by kernel in the rx ring of iface, hand each
+// frame to handler, and return the blocks to kernel
+//
+// The frame is copied into a buffer from the packet pool, as handler owns the 
+// packet and may cache it after the block is returned.
+int iface_recv_ring(iface_info_t *iface, packet_handler_t handler)
+{
+	struct rx_ring *ring = iface->rx_ring;
+	int n = 0;
+
+	while (1) {
+		struct tpacket_block_desc *bd = (struct tpacket_block_desc *) \
+			(ring->map + ring->cur_block * ring->block_size);
+		if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) \
+					& TP_STATUS_USER))
+			break;
+
+		int num_pkts = bd->hdr.bh1.num_pkts;
+		struct tpacket3_hdr *hdr = (struct tpacket3_hdr *) \
+			((char *)bd + bd->hdr.bh1.offset_to_first_pkt);
+		for (int i = 0; i < num_pkts; i++) {
+			struct sockaddr_ll *sll = (struct sockaddr_ll *) \
+				((char *)hdr + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+			// XXX: the same as recvfrom, outgoing packets are captured as well
+			if (sll->sll_pkttype != PACKET_OUTGOING) {
+				int len = hdr->tp_snaplen;
+				char *packet = packet_alloc(len);
+				if (packet) {
+					memcpy(packet, (char *)hdr + hdr->tp_mac, len);
+					metrics_iface_rx(iface, len);
+					latency_rx_begin();
+					handler(iface, packet, len);
+					latency_rx_end();
+					n += 1;
+				}
+				else {
+					metrics_drop(DROP_NO_BUFFER);
+				}
+			}
+
+			hdr = (struct tpacket3_hdr *)((char *)hdr + hdr->tp_next_offset);
+		}
+
+		__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, \
+				__ATOMIC_RELEASE);
+		ring->cur_block = (ring->cur_block + 1) % ring->block_nr;
+	}
+
+	return n;
+}
+
+// set up the TPACKET_V3 rings (rx and/or tx, according to instance) on the 
+// socket of iface, and map them into user space
+static int setup_packet_rings(iface_info_t *iface)
+{
+	int sd = iface->fd;
+	int version = TPACKET_V3;
+	if (setsockopt(sd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+		perror("setsockopt() PACKET_VERSION failed!");
+		return -1;
+	}
+
+	struct tpacket_req3 req;
+	int rx_len = 0, tx_len = 0;
+	if (instance->rx_ring) {
+		bzero(&req, sizeof(req));
+		req.tp_block_size = RX_RING_BLOCK_SIZE;
+		req.tp_block_nr = RX_RING_BLOCK_NR;
+		req.tp_frame_size = RX_RING_FRAME_SIZE;
+		req.tp_frame_nr = (RX_RING_BLOCK_SIZE / RX_RING_FRAME_SIZE) * RX_RING_BLOCK_NR;
+		req.tp_retire_blk_tov = RX_RING_BLOCK_TMO;
+		if (setsockopt(sd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+			perror("setsockopt() PACKET_RX_RING failed!");
+			return -1;
+		}
+		rx_len = RX_RING_BLOCK_SIZE * RX_RING_BLOCK_NR;
+	}
+
+	if (instance->tx_ring) {
+		bzero(&req, sizeof(req));
+		req.tp_block_size = TX_RING_BLOCK_SIZE;
+		req.tp_block_nr = TX_RING_BLOCK_NR;
+		req.tp_frame_size = TX_RING_FRAME_SIZE;
+		req.tp_frame_nr = (TX_RING_BLOCK_SIZE / TX_RING_FRAME_SIZE) * TX_RING_BLOCK_NR;
+		if (setsockopt(sd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+			perror("setsockopt() PACKET_TX_RING failed!");
+			return -1;
+		}
+		tx_len = TX_RING_BLOCK_SIZE * TX_RING_BLOCK_NR;
+	}
+
+	// rx ring and tx ring are mapped in one area, rx ring goes first
+	char *map = mmap(NULL, rx_len + tx_len, PROT_READ | PROT_WRITE, \
+			MAP_SHARED | MAP_LOCKED | MAP_POPULATE, sd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap() packet rings failed!");
+		return -1;
+	}
+
+	if (instance->rx_ring) {
+		struct rx_ring *ring = malloc(sizeof(struct rx_ring));
+		bzero(ring, sizeof(struct rx_ring));
+		ring->map = map;
+		ring->map_len = rx_len;
+		ring->block_size = RX_RING_BLOCK_SIZE;
+		ring->block_nr = RX_RING_BLOCK_NR;
+		iface->rx_ring = ring;
+	}
+
+	if (instance->tx_ring) {
+		struct tx_ring *ring = malloc(sizeof(struct tx_ring));
+		bzero(ring, sizeof(struct tx_ring));
+		ring->map = map + rx_len;
+		ring->map_len = tx_len;
+		ring->frame_size = TX_RING_FRAME_SIZE;
+		ring->frame_nr = tx_len / TX_RING_FRAME_SIZE;
+		pthread_mutex_init(&ring->lock, NULL);
+		iface->tx_ring = ring;
+	}
+
+	return 0;
+}
+
+// frames sent by ourselves are dropped, and only IP and ARP frames are kept,
+// the others would be dropped by handle_packet anyway
+static struct sock_filter rx_filter[] = {
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 4, 0),
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),				// ether_type
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 1, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_ARP, 0, 1),
+	BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+	BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+// attach rx_filter to socket sd, so that the unwanted frames are dropped in
+// kernel, without waking us up or copying them to userspace
+static int attach_rx_filter(int sd)
+{
+	struct sock_fprog prog = {
+		.len = sizeof(rx_filter) / sizeof(struct sock_filter),
+		.filter = rx_filter,
+	};
+	if (setsockopt(sd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+		perror("setsockopt() SO_ATTACH_FILTER failed!");
+		return -1;
+	}
+
+#ifdef PACKET_IGNORE_OUTGOING
+	// the outgoing frames are not even cloned for this socket (since linux
+	// 4.20), otherwise they are dropped by rx_filter
+	int one = 1;
+	if (setsockopt(sd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one)) < 0)
+		log(DEBUG, "PACKET_IGNORE_OUTGOING is not supported: %s", strerror(errno));
+#endif
+
+	return 0;
+}
+
 // open the interface to read all the necessary information
 int open_device(const char *dname)
 {
-	int sd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	// no frame is received before binding with ETH_P_ALL, so that none of
+	// them slips in before the filter is attached
+	int sd = socket(AF_PACKET, SOCK_RAW, 0);
 	if (sd < 0) { 
 		perror("creating SOCK_RAW failed!");
 		return -1;
 	}
 
+	if (attach_rx_filter(sd) < 0)
+		return -1;
+
 	struct ifreq ifr;
 	bzero(&ifr, sizeof(struct ifreq));
 	strcpy(ifr.ifr_name, dname);
@@ -60,6 +375,7 @@ int open_device(const char *dname)
 	bzero(&sll, sizeof(sll));
 	sll.sll_family = AF_PACKET;
 	sll.sll_ifindex = ifr.ifr_ifindex;
+	sll.sll_protocol = htons(ETH_P_ALL);
 
 	if (bind((int)sd, (struct sockaddr *) &sll, sizeof(sll)) < 0) {
 		perror("binding to device failed!");
@@ -95,6 +411,13 @@ int read_iface_info(iface_info_t *iface)
 
 	iface->fd = fd;
 
+	if (instance->rx_ring || instance->tx_ring) {
+		if (setup_packet_rings(iface) < 0) {
+			log(ERROR, "could not set up packet rings on %s.", iface->name);
+			exit(1);
+		}
+	}
+
 	int s = socket(AF_INET, SOCK_DGRAM, 0);
 	struct ifreq ifr;
 	strcpy(ifr.ifr_name, iface->name);
@@ -164,21 +487,159 @@ static void find_available_ifaces()
 }
 
 // read the information of all interfaces, and store them in iface_list
+// ifindex is small and dense, so the interface of an ifindex (e.g. the output
+// interface of a route) is found by indexing instead of lookup
+static void init_ifindex_map()
+{
+	iface_info_t *iface = NULL;
+	list_for_each_entry(iface, &instance->iface_list, list) {
+		if (iface->index > instance->max_ifindex)
+			instance->max_ifindex = iface->index;
+	}
+
+	instance->ifindex_map = malloc(sizeof(iface_info_t *) * (instance->max_ifindex + 1));
+	bzero(instance->ifindex_map, sizeof(iface_info_t *) * (instance->max_ifindex + 1));
+	list_for_each_entry(iface, &instance->iface_list, list)
+		instance->ifindex_map[iface->index] = iface;
+}
+
 void init_all_ifaces()
 {
+	// USTACK_VDEV replaces the interfaces with virtual ones replaying pcap 
+	// files, which are driven by vdev_run instead of epoll
+	if (vdev_init_ifaces() > 0) {
+		instance->vdev = 1;
+		init_ifindex_map();
+		return ;
+	}
+
 	find_available_ifaces();
 
-	instance->fds = malloc(sizeof(struct pollfd) * instance->nifs);
-	bzero(instance->fds, sizeof(struct pollfd) * instance->nifs);
+	instance->epfd = epoll_create1(0);
+	if (instance->epfd < 0) {
+		perror("Create epoll instance failed");
+		exit(1);
+	}
 
 	iface_info_t *iface = NULL;
-	int i = 0;
 	list_for_each_entry(iface, &instance->iface_list, list) {
 		int fd = read_iface_info(iface);
-		instance->fds[i].fd = fd;
-		instance->fds[i].events |= POLLIN;
 
-		i += 1;
+		struct epoll_event ev;
+		bzero(&ev, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = iface;
+		if (epoll_ctl(instance->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			perror("Add interface to epoll instance failed");
+			exit(1);
+		}
+	}
+
+	init_ifindex_map();
+}
+
+// parse a list of cpus like "2,4-7" into set, return the number of cpus in it
+// (-1 if the list is invalid)
+static int parse_cpu_list(const char *str, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+
+	const char *p = str;
+	while (*p) {
+		char *end = NULL;
+		long first = strtol(p, &end, 10), last = first;
+		if (end == p)
+			return -1;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p)
+				return -1;
+		}
+		if (first < 0 || last < first || last >= CPU_SETSIZE)
+			return -1;
+
+		for (long cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, set);
+
+		if (*end == ',')
+			end += 1;
+		else if (*end)
+			return -1;
+		p = end;
+	}
+
+	return CPU_COUNT(set);
+}
+
+// pin the calling thread, which receives the packets as the index-th worker 
+// (0 for ustack_run), to one of USTACK_RX_CPUS in round robin
+void pin_rx_thread(int index)
+{
+	if (!instance->nr_rx_cpus)
+		return ;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	int cpu = instance->rx_cpus[index % instance->nr_rx_cpus];
+	CPU_SET(cpu, &set);
+	int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (err) {
+		log(ERROR, "could not pin the receiving thread to cpu %d: %s", \
+				cpu, strerror(err));
+		exit(1);
+	}
+
+	log(DEBUG, "receiving thread %d is pinned to cpu %d.", index, cpu);
+}
+
+// USTACK_RX_CPUS=LIST pins the receiving threads to the cpus, and 
+// USTACK_HELPER_CPUS=LIST pins all the other threads
+//
+// The calling thread is pinned to the helper cpus here, which is inherited by
+// the threads created afterwards (sweeping, timers, log and metrics...), and
+// the receiving threads pin themselves again by pin_rx_thread. Without 
+// USTACK_HELPER_CPUS, the helpers run on any cpu but the receiving ones.
+static void init_cpu_affinity()
+{
+	cpu_set_t rx, helpers;
+
+	char *env = getenv("USTACK_RX_CPUS");
+	if (env) {
+		if (parse_cpu_list(env, &rx) <= 0) {
+			log(ERROR, "invalid cpu list '%s' of USTACK_RX_CPUS.", env);
+			exit(1);
+		}
+		instance->rx_cpus = malloc(sizeof(int) * CPU_COUNT(&rx));
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &rx))
+				instance->rx_cpus[instance->nr_rx_cpus++] = cpu;
+	}
+
+	env = getenv("USTACK_HELPER_CPUS");
+	if (env) {
+		if (parse_cpu_list(env, &helpers) <= 0) {
+			log(ERROR, "invalid cpu list '%s' of USTACK_HELPER_CPUS.", env);
+			exit(1);
+		}
+	}
+	else if (instance->nr_rx_cpus) {
+		if (pthread_getaffinity_np(pthread_self(), sizeof(helpers), &helpers))
+			return ;
+		for (int i = 0; i < instance->nr_rx_cpus; i++)
+			CPU_CLR(instance->rx_cpus[i], &helpers);
+		// nothing left for the helpers, let them share the receiving cpus
+		if (CPU_COUNT(&helpers) == 0)
+			return ;
+	}
+	else {
+		return ;
+	}
+
+	int err = pthread_setaffinity_np(pthread_self(), sizeof(helpers), &helpers);
+	if (err) {
+		log(ERROR, "could not pin the helper threads: %s", strerror(err));
+		exit(1);
 	}
 }
 
@@ -191,5 +652,21 @@ void init_ustack()
 	bzero(instance, sizeof(ustack_t));
 	init_list_head(&instance->iface_list);
 
+	init_cpu_affinity();
+
+	// USTACK_RX_RING=1 switches the receive path to the memory-mapped ring
+	char *rx_ring = getenv("USTACK_RX_RING");
+	instance->rx_ring = rx_ring && atoi(rx_ring);
+	// USTACK_TX_RING=1 queues the packets to send into the memory-mapped ring, 
+	// which are flushed in batch
+	char *tx_ring = getenv("USTACK_TX_RING");
+	instance->tx_ring = tx_ring && atoi(tx_ring);
+	// USTACK_BUSY_POLL=1 spins on the interfaces instead of sleeping until
+	// packets arrive, which saves the wake-up latency at the cost of a cpu
+	char *busy_poll = getenv("USTACK_BUSY_POLL");
+	instance->busy_poll = busy_poll && atoi(busy_poll);
+
 	init_all_ifaces();
+
+	metrics_init();
 }
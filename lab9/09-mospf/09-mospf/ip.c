@@ -8,6 +8,8 @@
 #include "mospf_daemon.h"
 
 #include "log.h"
+#include "packet_pool.h"
+#include "metrics.h"
 
 #include <stdlib.h>
 #include <assert.h>
@@ -19,6 +21,8 @@
 // packet.
 void handle_ip_packet(iface_info_t *iface, char *packet, int len)
 {
+	latency_stage(LAT_IP);
+
 	struct iphdr *iph = packet_to_ip_hdr(packet);
 	u32 daddr = ntohl(iph->daddr);
 	if (daddr == iface->ip) {
@@ -32,29 +36,33 @@ void handle_ip_packet(iface_info_t *iface, char *packet, int len)
 			handle_mospf_packet(iface, packet, len);
 		}
 
-		free(packet);
+		packet_free(packet);
 	}
 	else if (iph->daddr == htonl(MOSPF_ALLSPFRouters)) {
 		assert(iph->protocol == IPPROTO_MOSPF);
 		handle_mospf_packet(iface, packet, len);
 
-		free(packet);
+		packet_free(packet);
 	}
 	else {
 		iph->ttl --;
 		if (iph->ttl <= 0) { //ICMP TTL equals 0 during transit
+			metrics_drop(DROP_TTL_EXCEEDED);
 			icmp_send_packet(packet, len, ICMP_TIME_EXCEEDED, ICMP_EXC_TTL);
-			free(packet);
+			packet_free(packet);
 			return;
 		}
 
 		//checksum
 		iph->checksum = ip_checksum(iph);
 		//lookup rtable
+		rcu_read_lock();
 		rt_entry_t *match = longest_prefix_match(daddr);
 		if(match == NULL){
+			rcu_read_unlock();
+			metrics_drop(DROP_NO_ROUTE);
 			icmp_send_packet(packet, len, ICMP_DEST_UNREACH, ICMP_NET_UNREACH);
-			free(packet);
+			packet_free(packet);
 			return ;
 		}
 		//get next ip addr
@@ -65,7 +73,9 @@ void handle_ip_packet(iface_info_t *iface, char *packet, int len)
 		else{
 			next_ip = daddr;
 		}
+		iface_info_t *out_iface = match->iface;
+		rcu_read_unlock();
 		//forward
-		iface_send_packet_by_arp(match->iface, next_ip, packet, len);
+		iface_send_packet_by_arp(out_iface, next_ip, packet, len);
 	}
 }
@@ -8,6 +8,9 @@
 
 #include "list.h"
 #include "log.h"
+#include "packet_pool.h"
+#include "metrics.h"
+#include "timer.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -80,7 +83,7 @@ void *sending_mospf_hello_thread(void *param)
 {
 	//fprintf(stdout, "TODO: send mOSPF Hello message periodically.\n");
 	while (1) {
-		sleep(MOSPF_DEFAULT_HELLOINT);
+		timer_sleep(MOSPF_DEFAULT_HELLOINT * 1000);
 		pthread_mutex_lock(&mospf_lock);
 
 		iface_info_t *iface = NULL;
@@ -98,7 +101,7 @@ void *sending_mospf_hello_thread(void *param)
 void send_mospf_hello_packet(iface_info_t *iface){
 	int msg_len = MOSPF_HDR_SIZE + MOSPF_HELLO_SIZE;
 	int len = ETHER_HDR_SIZE + IP_BASE_HDR_SIZE + msg_len;
-	char * hello_pkt = malloc(len);
+	char *hello_pkt = packet_alloc(len);
 	struct ether_header *eh_hdr = (struct ether_header *)hello_pkt;
 	struct iphdr *ip_hdr = packet_to_ip_hdr(hello_pkt);
 	struct mospf_hdr *mospf = (struct mospf_hdr *)((char *)ip_hdr + IP_BASE_HDR_SIZE);
@@ -118,14 +121,14 @@ void send_mospf_hello_packet(iface_info_t *iface){
 	eh_hdr->ether_type = htons(ETH_P_IP);
 
 	iface_send_packet(iface, hello_pkt, ETHER_HDR_SIZE + IP_BASE_HDR_SIZE + msg_len);
-	free(hello_pkt);
+	packet_free(hello_pkt);
 }
 
 void *checking_nbr_thread(void *param)
 {
 	//fprintf(stdout, "TODO: neighbor list timeout operation.\n");
 	while (1) {
-		sleep(1);
+		timer_sleep(1000);
 		pthread_mutex_lock(&mospf_lock);
 
 		int update = 0;
@@ -159,7 +162,7 @@ void *checking_database_thread(void *param)
 {
 	//fprintf(stdout, "TODO: link state database timeout operation.\n");
 	while (1) {
-		sleep(1);
+		timer_sleep(1000);
 		pthread_mutex_lock(&mospf_lock);
 
 		int update = 0;
@@ -223,7 +226,7 @@ void *sending_mospf_lsu_thread(void *param)
 {
 	//fprintf(stdout, "TODO: send mOSPF LSU message periodically.\n");
 	while (1) {
-		sleep(MOSPF_DEFAULT_LSUINT);
+		timer_sleep(MOSPF_DEFAULT_LSUINT * 1000);
 		pthread_mutex_lock(&mospf_lock);
 
 		send_mospf_lsu_packet();
@@ -282,7 +285,7 @@ void send_mospf_lsu_packet(void)
 		if (iface->num_nbr) {
 			mospf_nbr_t *nbr = NULL;
 			list_for_each_entry(nbr, &iface->nbr_list, list) {
-				char *packet = (char *)malloc(ETHER_HDR_SIZE + IP_BASE_HDR_SIZE + mospf_packet_len);
+				char *packet = packet_alloc(ETHER_HDR_SIZE + IP_BASE_HDR_SIZE + mospf_packet_len);
 				struct ether_header *eh = (struct ether_header *)packet;
 				struct iphdr *ip_hdr = (struct iphdr *)(packet + ETHER_HDR_SIZE);
 				char *mospf_message = packet + ETHER_HDR_SIZE + IP_BASE_HDR_SIZE;
@@ -381,7 +384,7 @@ void handle_mospf_lsu(iface_info_t *iface, char *packet, int len)
 			if (iface_out->num_nbr && iface_out != iface) {
 				mospf_nbr_t *nbr = NULL;
 				list_for_each_entry(nbr, &iface_out->nbr_list, list) {
-					char *packet_out = (char *)malloc(len);
+					char *packet_out = packet_alloc(len);
 					struct ether_header *eh_out = (struct ether_header *)packet_out;
 					struct iphdr *ip_out = (struct iphdr *)(packet_out + ETHER_HDR_SIZE);
 					memcpy(packet_out, packet, len);
@@ -414,6 +417,7 @@ void handle_mospf_packet(iface_info_t *iface, char *packet, int len)
 	}
 	if (mospf->checksum != mospf_checksum(mospf)) {
 		log(ERROR, "received mospf packet with incorrect checksum");
+		metrics_drop(DROP_BAD_CHECKSUM);
 		return ;
 	}
 	if (ntohl(mospf->aid) != instance->area_id) {
@@ -232,6 +232,8 @@ void update_route_table(void)
 	Dijkstra();
 	
 	build_route_table();
+	// the forwarding path sees the new routes all at once
+	publish_rtable();
 	print_rtable();
 
 	return;